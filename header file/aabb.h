@@ -39,25 +39,20 @@ public:
 
     bool isHit(const Ray& inputRay, Interval timeIntervalToCheck) const {
         const Point3& rayOrigin = inputRay.getOrigin();
-        const Vec3& rayDirection = inputRay.getDirection();
+        const Vec3& inverseRayDirection = inputRay.getInverseDirection();
 
         for (int currentAxis = 0; currentAxis < 3; ++currentAxis) {
             const Interval& currentIntervalAABB = getAxisInterval(currentAxis);
-            const double currentInverseRayDirection = 1.0 / rayDirection[currentAxis];
 
-            auto timeBegin = (currentIntervalAABB.min - rayOrigin[currentAxis]) * currentInverseRayDirection;
-            auto timeEnd = (currentIntervalAABB.max - rayOrigin[currentAxis]) * currentInverseRayDirection;
+            // the ray enters the slab at the min plane, or at the max plane when it points backwards
+            bool isNegative = inputRay.isDirectionNegative(currentAxis);
+            auto timeBegin = ((isNegative ? currentIntervalAABB.max : currentIntervalAABB.min) - rayOrigin[currentAxis]) * inverseRayDirection[currentAxis];
+            auto timeEnd = ((isNegative ? currentIntervalAABB.min : currentIntervalAABB.max) - rayOrigin[currentAxis]) * inverseRayDirection[currentAxis];
 
             // this function checks the overlapping between two intervals in terms of time instead of position
             // [timeBegin, timeEnd], timeIntervalToCheck
-            if (timeBegin < timeEnd) {
-                if (timeBegin > timeIntervalToCheck.min) timeIntervalToCheck.min = timeBegin;
-                if (timeEnd < timeIntervalToCheck.max) timeIntervalToCheck.max = timeEnd;
-            }
-            else {
-                if (timeEnd > timeIntervalToCheck.min) timeIntervalToCheck.min = timeEnd;
-                if (timeBegin < timeIntervalToCheck.max) timeIntervalToCheck.max = timeBegin;
-            }
+            if (timeBegin > timeIntervalToCheck.min) timeIntervalToCheck.min = timeBegin;
+            if (timeEnd < timeIntervalToCheck.max) timeIntervalToCheck.max = timeEnd;
 
             if (timeIntervalToCheck.max <= timeIntervalToCheck.min)
                 return false;
@@ -75,6 +70,16 @@ public:
             return intervalY.getSize() > intervalZ.getSize() ? 1 : 2;
     }
 
+    double getSurfaceArea() const {
+        // an empty box has no area
+        auto x = intervalX.getSize();
+        auto y = intervalY.getSize();
+        auto z = intervalZ.getSize();
+        if (x < 0 || y < 0 || z < 0)
+            return 0;
+        return 2 * (x * y + y * z + z * x);
+    }
+
     static const AABB empty, universe;
 
 private:
@@ -0,0 +1,106 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include "camera.h"
+#include "hittable.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+struct Keyframe {
+    double time;            // seconds from the start of the animation
+    Vec3   offset;          // Translate offset at that time
+    double angle = 0;       // RotateY angle in degrees at that time
+};
+
+class AnimationTrack {
+public:
+    // Moves a Translate, and optionally a RotateY below it, through keyframes with linear interpolation.
+    // Before the first keyframe and after the last one the object holds still.
+    AnimationTrack(std::shared_ptr<Translate> inputTranslate, std::shared_ptr<RotateY> inputRotate, std::vector<Keyframe> inputKeyframes)
+        : translate(inputTranslate), rotate(inputRotate), keyframes(std::move(inputKeyframes)) {
+        std::sort(keyframes.begin(), keyframes.end(), [](const Keyframe& lhs, const Keyframe& rhs) { return lhs.time < rhs.time; });
+    }
+
+    void apply(double time) const {
+        if (keyframes.empty())
+            return;
+
+        // the keyframes around time
+        auto next = std::upper_bound(keyframes.begin(), keyframes.end(), time,
+            [](double value, const Keyframe& keyframe) { return value < keyframe.time; });
+        const Keyframe& after = (next == keyframes.end()) ? keyframes.back() : *next;
+        const Keyframe& before = (next == keyframes.begin()) ? keyframes.front() : *(next - 1);
+
+        double span = after.time - before.time;
+        double t = (span > 0) ? (time - before.time) / span : 0;
+        t = std::fmin(std::fmax(t, 0.0), 1.0);
+
+        // the rotation sits below the translation, so it goes first
+        if (rotate)
+            rotate->setAngle((1 - t) * before.angle + t * after.angle);
+        if (translate)
+            translate->setOffset((1 - t) * before.offset + t * after.offset);
+    }
+
+private:
+    std::shared_ptr<Translate> translate;
+    std::shared_ptr<RotateY> rotate;
+    std::vector<Keyframe> keyframes;
+};
+
+// Renders a sequence of frames of one scene. The scene is built once, so textures, images and Perlin
+// tables stay loaded; between frames only the animated transforms change. The BVH is then refit
+// bottom-up instead of rebuilt, and only subtrees whose boxes grew past rebuildThreshold are rebuilt.
+class Animation {
+public:
+    int    frameCount = 24;                 // Number of frames to render
+    double framesPerSecond = 24;            // Frame i shows the scene at time i / framesPerSecond
+    double rebuildThreshold = 2.0;          // Rebuild a BVH subtree once its box area grew by this factor
+    std::string fileNamePattern = "frame_%04d.ppm";     // printf pattern of the frame files, given the frame index
+
+    void addTrack(const AnimationTrack& track) {
+        tracks.push_back(track);
+    }
+
+    void addFrameUpdate(const std::function<void(int, double)>& update) {
+        // for motion that keyframes can't express: called with the frame index and time before every frame
+        frameUpdates.push_back(update);
+    }
+
+    void render(Camera& camera, Hittable& world) const {
+        for (int currentFrame = 0; currentFrame < frameCount; ++currentFrame) {
+            double time = currentFrame / framesPerSecond;
+            for (const AnimationTrack& track : tracks)
+                track.apply(time);
+            for (const auto& update : frameUpdates)
+                update(currentFrame, time);
+
+            auto refitStartTime = std::chrono::steady_clock::now();
+            world.refit();
+            int rebuiltCount = world.rebuildDegradedSubtrees(rebuildThreshold);
+            double refitSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - refitStartTime).count();
+
+            camera.outputFileName = getFrameFileName(currentFrame);
+            std::clog << "\rFrame " << currentFrame + 1 << " / " << frameCount << ": BVH refit in " << refitSeconds * 1000
+                << " ms, " << rebuiltCount << " subtrees rebuilt\n";
+            camera.render(world);
+        }
+    }
+
+private:
+    std::string getFrameFileName(int frameIndex) const {
+        std::vector<char> fileName(fileNamePattern.size() + 32);
+        std::snprintf(fileName.data(), fileName.size(), fileNamePattern.c_str(), frameIndex);
+        return std::string(fileName.data());
+    }
+
+    std::vector<AnimationTrack> tracks;
+    std::vector<std::function<void(int, double)>> frameUpdates;
+};
+
+#endif
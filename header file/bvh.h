@@ -2,88 +2,784 @@
 #define BVH_H
 
 #include "AABB.h"
+#include "bvh_statistics.h"
 #include "Hittable.h"
 #include "hittable_list.h"
+#include "thread_pool.h"
 
 #include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+
+enum class BVHSplitMethod {
+    Median,     // sort-free median split on the longest axis, leaves of one or two objects
+    SAH,        // binned surface area heuristic
+    LBVH        // objects sorted along a Morton curve and split where their codes differ; fastest to build
+};
+
+// The flattened layouts store leaf sizes in 16 bits; larger maxLeafSize values are clamped to this.
+constexpr int BVH_MAX_LEAF_SIZE = 65535;
+
+struct BVHBuildOptions {
+    BVHSplitMethod splitMethod = BVHSplitMethod::SAH;
+    int    maxLeafSize = 4;             // SAH and LBVH: most objects a leaf may hold, at most BVH_MAX_LEAF_SIZE
+    int    binCount = 16;               // SAH: candidate split planes per axis, minus one
+    double traversalCost = 1.0;         // SAH: cost of visiting a node ...
+    double intersectionCost = 1.0;      // ... relative to testing one object in a leaf
+    int    threadCount = 0;             // Build threads; 0 uses every hardware thread. The tree is the same for any count
+    bool   isOptimizingTreelets = false;    // LBVH: build the top levels over groups of nearby objects with the SAH
+};
 
 class BVHNode : public Hittable {
 public:
-    BVHNode(HittableList list) : BVHNode(list.objects, 0, list.objects.size()) {
+    BVHNode(HittableList list, const BVHBuildOptions& options = BVHBuildOptions())
+        : BVHNode(list.objects, 0, list.objects.size(), options) {
         // There's a C++ subtlety here. This constructor (without span indices) creates an
         // implicit copy of the Hittable list, which we will modify. The lifetime of the copied
         // list only extends until this constructor exits. That's OK, because we only need to
         // persist the resulting bounding volume hierarchy.
     }
 
-    BVHNode(std::vector<std::shared_ptr<Hittable>>& objects, size_t start, size_t end) {
+    BVHNode(std::vector<std::shared_ptr<Hittable>>& objects, size_t start, size_t end, const BVHBuildOptions& inputOptions = BVHBuildOptions()) {
+        BVHBuildOptions options = getValidOptions(inputOptions);
+        auto buildStartTime = std::chrono::steady_clock::now();
+        int threadCount = ThreadPool(options.threadCount).getThreadCount();
+
+        // every box is fetched once; the build then sorts and partitions these small records instead
+        std::vector<BuildObject> buildObjects(end - start);
+        runChunks(0, buildObjects.size(), threadCount, [&](int chunk, size_t chunkStart, size_t chunkEnd) {
+            for (size_t currentObjectIndex = chunkStart; currentObjectIndex < chunkEnd; ++currentObjectIndex) {
+                AABB objectBox = objects[start + currentObjectIndex]->getBoundingBox();
+                buildObjects[currentObjectIndex] = { objectBox, getCentroid(objectBox), start + currentObjectIndex };
+            }
+        });
+
+        if (options.splitMethod == BVHSplitMethod::LBVH)
+            buildLBVH(objects, buildObjects, options, threadCount);
+        else
+            build(objects, buildObjects, 0, buildObjects.size(), options, threadCount);
+        buildOptions = std::make_shared<const BVHBuildOptions>(options);     // after the build, which may replace *this
+        buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - buildStartTime).count();
+    }
+
+    bool isHit(const Ray& inputRay, Interval timeIntervalToCheck, HitRecord& record) const override {
+        RT_COUNT_BVH(boxTests, 1);
+        if (!boundingBox.isHit(inputRay, timeIntervalToCheck))
+            return false;
+        return isHitInside(inputRay, timeIntervalToCheck, record);
+    }
+
+    bool isOccluded(const Ray& inputRay, Interval timeIntervalToCheck) const override {
+        RT_COUNT_BVH(boxTests, 1);
+        if (!boundingBox.isHit(inputRay, timeIntervalToCheck))
+            return false;
+        return isOccludedInside(inputRay, timeIntervalToCheck);
+    }
+
+    AABB getBoundingBox() const override { return boundingBox; }
+
+    bool isLeaf() const { return !left; }
+    int getSplitAxis() const { return splitAxis; }
+    double getBuildSeconds() const { return buildSeconds; }
+
+    // the tree, for flattening it into other layouts; children only exist in inner nodes
+    const BVHNode& getLeftChild() const { return static_cast<const BVHNode&>(*left); }
+    const BVHNode& getRightChild() const { return static_cast<const BVHNode&>(*right); }
+    const std::vector<std::shared_ptr<Hittable>>& getLeafObjects() const { return leafObjects; }
+
+    double getSAHCost(const BVHBuildOptions& options = BVHBuildOptions()) const {
+        // Expected cost of a random ray that hits this node's box, under the same model the SAH
+        // builder minimizes. Lets trees from different builders be compared.
+        if (isLeaf())
+            return options.intersectionCost * leafObjects.size();
+
+        auto area = boundingBox.getSurfaceArea();
+        if (area <= 0)
+            return options.traversalCost;
+
+        const auto* leftNode = static_cast<const BVHNode*>(left.get());
+        const auto* rightNode = static_cast<const BVHNode*>(right.get());
+        return options.traversalCost
+            + (leftNode->boundingBox.getSurfaceArea() * leftNode->getSAHCost(options)
+               + rightNode->boundingBox.getSurfaceArea() * rightNode->getSAHCost(options)) / area;
+    }
+
+    BVHTreeStatistics getTreeStatistics() const {
+        BVHTreeStatistics statistics;
+        statistics.structureName = "BVHNode";
+        double leafDepthSum = 0;
+        double overlapSum = 0;
+        addTreeStatistics(statistics, 0, leafDepthSum, overlapSum);
+
+        size_t innerCount = statistics.nodeCount - statistics.leafCount;
+        statistics.averageLeafDepth = (statistics.leafCount > 0) ? leafDepthSum / statistics.leafCount : 0;
+        statistics.averageOverlap = (innerCount > 0) ? overlapSum / innerCount : 0;
+        statistics.sahCost = buildOptions ? getSAHCost(*buildOptions) : getSAHCost();
+        return statistics;
+    }
+
+    size_t getMemoryUsage() const {
+        // The tree, without the objects: this node plus what the tree below it allocates, see getHeapUsage.
+        return sizeof(BVHNode) + getHeapUsage();
+    }
+
+    void collectEmitters(std::vector<const Hittable*>& emitters) const override {
+        if (isLeaf()) {
+            for (const auto& object : leafObjects)
+                object->collectEmitters(emitters);
+            return;
+        }
+        left->collectEmitters(emitters);
+        right->collectEmitters(emitters);
+    }
+
+    void collectTreeStatistics(std::vector<BVHTreeStatistics>& statistics) const override {
+        statistics.push_back(getTreeStatistics());
+        std::vector<std::shared_ptr<Hittable>> objects;
+        collectObjects(objects);
+        for (const auto& object : objects)
+            object->collectTreeStatistics(statistics);
+    }
+
+    void refit() override {
+        // Same tree, new boxes. Fine for rigid motion of whole subtrees, but as objects move apart
+        // the boxes overlap more and more; see rebuildDegradedSubtrees().
+        if (isLeaf()) {
+            boundingBox = AABB::empty;
+            for (const auto& object : leafObjects) {
+                object->refit();
+                boundingBox = AABB(boundingBox, object->getBoundingBox());
+            }
+            return;
+        }
+        left->refit();
+        right->refit();
+        boundingBox = AABB(left->getBoundingBox(), right->getBoundingBox());
+    }
+
+    int rebuildDegradedSubtrees(double rebuildThreshold) override {
+        // Top-down, after refit(): a node whose box area grew by more than rebuildThreshold times since
+        // it was built is rebuilt from the objects below it, with the options the tree was built with.
+        // Nodes that kept their size are left alone.
+        return rebuildDegradedSubtrees(rebuildThreshold, buildOptions);
+    }
+
+private:
+    // Spans below these sizes are built on one thread; forking or chunking them costs more than it saves.
+    static constexpr size_t PARALLEL_SUBTREE_MIN_OBJECTS = 4096;
+    static constexpr size_t PARALLEL_LOOP_MIN_OBJECTS = 65536;
+
+    struct BuildObject {
+        AABB box;
+        Point3 centroid;
+        size_t objectIndex;     // into the objects the tree is built from
+    };
+
+    struct MortonObject {
+        std::uint64_t code;         // position of the centroid along the Morton curve
+        std::uint32_t buildObject;  // index into the build objects
+    };
+
+    struct CentroidBounds {
+        Interval axes[3];   // unlike an AABB not padded, so equal centroids give an empty axis
+    };
+
+    struct SAHBins {
+        // per axis and bin: box and number of the objects whose centroid falls into it
+        std::vector<AABB> boxes;
+        std::vector<size_t> counts;
+    };
+
+    BVHNode() {}
+
+    static BVHBuildOptions getValidOptions(BVHBuildOptions options) {
+        options.maxLeafSize = std::min(options.maxLeafSize, BVH_MAX_LEAF_SIZE);
+        return options;
+    }
+
+    int rebuildDegradedSubtrees(double rebuildThreshold, std::shared_ptr<const BVHBuildOptions> options) {
+        // options is held by value: rebuilding the root replaces the buildOptions it came from
+        if (boundingBox.getSurfaceArea() > rebuildThreshold * builtSurfaceArea) {
+            std::vector<std::shared_ptr<Hittable>> objects;
+            collectObjects(objects);
+            *this = BVHNode(objects, 0, objects.size(), *options);
+            return 1;
+        }
+
+        if (isLeaf())
+            return 0;
+        return std::static_pointer_cast<BVHNode>(left)->rebuildDegradedSubtrees(rebuildThreshold, options)
+            + std::static_pointer_cast<BVHNode>(right)->rebuildDegradedSubtrees(rebuildThreshold, options);
+    }
+
+    void build(const std::vector<std::shared_ptr<Hittable>>& objects, std::vector<BuildObject>& buildObjects, size_t start, size_t end,
+               const BVHBuildOptions& options, int threadCount) {
+        // The subtrees are built in parallel and so are the loops over large spans, with threadCount
+        // split between the two children. Every parallel step gives the same result as the serial one
+        // (box unions and counts are exact, partitions are stable), so the tree never depends on it.
         boundingBox = AABB::empty;
+        for (const AABB& chunkBox : getChunkResults<AABB>(start, end, threadCount, [&](size_t chunkStart, size_t chunkEnd, AABB& chunkBox) {
+                 for (size_t currentObjectIndex = chunkStart; currentObjectIndex < chunkEnd; ++currentObjectIndex)
+                     chunkBox = AABB(chunkBox, buildObjects[currentObjectIndex].box);
+             }))
+            boundingBox = AABB(boundingBox, chunkBox);
+        builtSurfaceArea = boundingBox.getSurfaceArea();
+
+        // then split the span, or keep it as a leaf
+        size_t mid = (options.splitMethod == BVHSplitMethod::SAH)
+            ? partitionSAH(buildObjects, start, end, options, threadCount, splitAxis)
+            : partitionMedian(buildObjects, start, end, splitAxis);
 
-        // now calculate the final boundingBox first
-        for (size_t currentObjectIndex = start; currentObjectIndex < end; ++currentObjectIndex)
-            boundingBox = AABB(boundingBox, objects[currentObjectIndex]->getBoundingBox());
-        
-        int axis = boundingBox.getLongestAxisIndex();       // optimization applied
-        auto comparator = compareBoxZ;
-        if (axis == 0)
-            comparator = compareBoxX;
-        else if (axis == 1)
-            comparator = compareBoxY;
-
-        // then calculate the boundingBoxes for its left and right children
-        size_t objectSpan = end - start;
-        if (objectSpan == 1)
-            left = right = objects[start];
-        else if (objectSpan == 2) {
-            left = objects[start];
-            right = objects[start + 1];
+        if (mid == start || mid == end) {
+            leafObjects.reserve(end - start);
+            for (size_t currentObjectIndex = start; currentObjectIndex < end; ++currentObjectIndex)
+                leafObjects.push_back(objects[buildObjects[currentObjectIndex].objectIndex]);
+            return;
+        }
+
+        auto leftNode = std::shared_ptr<BVHNode>(new BVHNode());
+        auto rightNode = std::shared_ptr<BVHNode>(new BVHNode());
+
+        if (threadCount > 1 && end - start >= PARALLEL_SUBTREE_MIN_OBJECTS) {
+            int leftThreadCount = threadCount / 2;
+            ThreadPool(2).run(2, [&](int side) {
+                if (side == 0)
+                    leftNode->build(objects, buildObjects, start, mid, options, leftThreadCount);
+                else
+                    rightNode->build(objects, buildObjects, mid, end, options, threadCount - leftThreadCount);
+            });
         }
         else {
-            std::sort(std::begin(objects) + start, std::begin(objects) + end, comparator);
+            leftNode->build(objects, buildObjects, start, mid, options, 1);
+            rightNode->build(objects, buildObjects, mid, end, options, 1);
+        }
+
+        left = leftNode;
+        right = rightNode;
+    }
+
+    template <typename ChunkFunction>
+    static int runChunks(size_t start, size_t end, int threadCount, const ChunkFunction& processChunk) {
+        // Calls processChunk(chunk, chunkStart, chunkEnd) for one chunk of [start, end) per thread, or
+        // for a single chunk if the span is small. Returns the number of chunks.
+        size_t objectCount = end - start;
+        int chunkCount = (threadCount > 1 && objectCount >= PARALLEL_LOOP_MIN_OBJECTS) ? threadCount : 1;
+
+        auto runChunk = [&](int chunk) {
+            processChunk(chunk, start + objectCount * chunk / chunkCount, start + objectCount * (chunk + 1) / chunkCount);
+        };
+        if (chunkCount == 1)
+            runChunk(0);
+        else
+            ThreadPool(chunkCount).run(chunkCount, runChunk);
+        return chunkCount;
+    }
 
-            auto mid = start + objectSpan / 2;
-            left = std::make_shared<BVHNode>(objects, start, mid);
-            right = std::make_shared<BVHNode>(objects, mid, end);
+    template <typename Result, typename ChunkFunction>
+    static std::vector<Result> getChunkResults(size_t start, size_t end, int threadCount, const ChunkFunction& processChunk) {
+        // what processChunk(chunkStart, chunkEnd, result) left in each chunk's default Result, in chunk order
+        size_t objectCount = end - start;
+        std::vector<Result> results((threadCount > 1 && objectCount >= PARALLEL_LOOP_MIN_OBJECTS) ? threadCount : 1);
+        runChunks(start, end, threadCount, [&](int chunk, size_t chunkStart, size_t chunkEnd) {
+            processChunk(chunkStart, chunkEnd, results[chunk]);
+        });
+        return results;
+    }
+
+    bool isHitInside(const Ray& inputRay, Interval timeIntervalToCheck, HitRecord& record) const {
+        // The ray is known to hit this node's box. The child on the side the ray comes from along the
+        // split axis goes first; once it found a hit, the far child's box only counts if the ray
+        // enters it before that hit, which often skips the whole far subtree.
+        RT_COUNT_BVH(nodeVisits, 1);
+        if (isLeaf()) {
+            RT_COUNT_BVH(objectTests, leafObjects.size());
+            bool isHitAnything = false;
+            for (const auto& object : leafObjects) {
+                if (object->isHit(inputRay, timeIntervalToCheck, record)) {
+                    isHitAnything = true;
+                    timeIntervalToCheck.max = record.hitTime;
+                }
+            }
+            return isHitAnything;
+        }
+
+        const auto* nearChild = static_cast<const BVHNode*>(left.get());
+        const auto* farChild = static_cast<const BVHNode*>(right.get());
+        if (inputRay.isDirectionNegative(splitAxis))
+            std::swap(nearChild, farChild);
+
+        RT_COUNT_BVH(boxTests, 2);
+        bool isHitAnything = false;
+        if (nearChild->boundingBox.isHit(inputRay, timeIntervalToCheck) && nearChild->isHitInside(inputRay, timeIntervalToCheck, record)) {
+            isHitAnything = true;
+            timeIntervalToCheck.max = record.hitTime;
         }
+        if (farChild->boundingBox.isHit(inputRay, timeIntervalToCheck) && farChild->isHitInside(inputRay, timeIntervalToCheck, record))
+            isHitAnything = true;
+
+        return isHitAnything;
     }
 
-    bool isHit(const Ray& inputRay, Interval timeIntervalToCheck, HitRecord& record) const override {
-        if (!boundingBox.isHit(inputRay, timeIntervalToCheck))
+    bool isOccludedInside(const Ray& inputRay, Interval timeIntervalToCheck) const {
+        // Like isHitInside, but the first hit anywhere ends the search.
+        RT_COUNT_BVH(nodeVisits, 1);
+        if (isLeaf()) {
+            for (const auto& object : leafObjects) {
+                RT_COUNT_BVH(objectTests, 1);
+                if (object->isOccluded(inputRay, timeIntervalToCheck))
+                    return true;
+            }
             return false;
+        }
 
-        bool isHitLeft = left->isHit(inputRay, timeIntervalToCheck, record);
-        bool isHitRight = right->isHit(inputRay, Interval(timeIntervalToCheck.min, isHitLeft ? record.hitTime : timeIntervalToCheck.max), record);
+        const auto* nearChild = static_cast<const BVHNode*>(left.get());
+        const auto* farChild = static_cast<const BVHNode*>(right.get());
+        if (inputRay.isDirectionNegative(splitAxis))
+            std::swap(nearChild, farChild);
 
-        return isHitLeft || isHitRight;
+        RT_COUNT_BVH(boxTests, 1);
+        if (nearChild->boundingBox.isHit(inputRay, timeIntervalToCheck) && nearChild->isOccludedInside(inputRay, timeIntervalToCheck))
+            return true;
+        RT_COUNT_BVH(boxTests, 1);
+        return farChild->boundingBox.isHit(inputRay, timeIntervalToCheck) && farChild->isOccludedInside(inputRay, timeIntervalToCheck);
     }
 
-    AABB getBoundingBox() const override { return boundingBox; }
+    void addTreeStatistics(BVHTreeStatistics& statistics, int depth, double& leafDepthSum, double& overlapSum) const {
+        ++statistics.nodeCount;
+        statistics.maxDepth = std::max(statistics.maxDepth, depth);
 
-private:
-    static bool compareBox(const std::shared_ptr<Hittable> lhs, const std::shared_ptr<Hittable> rhs, int axisIndex) {
-        auto leftInterval = lhs->getBoundingBox().getAxisInterval(axisIndex);
-        auto rightIterval = rhs->getBoundingBox().getAxisInterval(axisIndex);
-        return leftInterval.min < rightIterval.min;
+        if (isLeaf()) {
+            size_t leafSize = leafObjects.size();
+            ++statistics.leafCount;
+            statistics.objectCount += leafSize;
+            statistics.emptyLeafCount += (leafSize == 0);
+            statistics.maxLeafSize = std::max(statistics.maxLeafSize, leafSize);
+            if (statistics.leafSizeCounts.size() <= leafSize)
+                statistics.leafSizeCounts.resize(leafSize + 1);
+            ++statistics.leafSizeCounts[leafSize];
+            leafDepthSum += depth;
+            return;
+        }
+
+        // rays that enter the overlap of the children have to visit both of them
+        const auto* leftNode = static_cast<const BVHNode*>(left.get());
+        const auto* rightNode = static_cast<const BVHNode*>(right.get());
+        double overlapSizes[3];
+        for (int axis = 0; axis < 3; ++axis) {
+            const Interval& leftInterval = leftNode->boundingBox.getAxisInterval(axis);
+            const Interval& rightInterval = rightNode->boundingBox.getAxisInterval(axis);
+            overlapSizes[axis] = std::max(0.0, std::min(leftInterval.max, rightInterval.max) - std::max(leftInterval.min, rightInterval.min));
+        }
+        double area = boundingBox.getSurfaceArea();
+        if (area > 0)
+            overlapSum += 2 * (overlapSizes[0] * overlapSizes[1] + overlapSizes[1] * overlapSizes[2] + overlapSizes[2] * overlapSizes[0]) / area;
+
+        leftNode->addTreeStatistics(statistics, depth + 1, leafDepthSum, overlapSum);
+        rightNode->addTreeStatistics(statistics, depth + 1, leafDepthSum, overlapSum);
     }
 
-    static bool compareBoxX(const std::shared_ptr<Hittable> lhs, const std::shared_ptr<Hittable> rhs) {
-        return compareBox(lhs, rhs, 0);
+    void collectObjects(std::vector<std::shared_ptr<Hittable>>& objects) const {
+        // the objects the subtree was built from
+        if (isLeaf()) {
+            objects.insert(objects.end(), leafObjects.begin(), leafObjects.end());
+            return;
+        }
+        std::static_pointer_cast<BVHNode>(left)->collectObjects(objects);
+        std::static_pointer_cast<BVHNode>(right)->collectObjects(objects);
     }
 
-    static bool compareBoxY(const std::shared_ptr<Hittable> lhs, const std::shared_ptr<Hittable> rhs) {
-        return compareBox(lhs, rhs, 1);
+    size_t partitionMedian(std::vector<BuildObject>& buildObjects, size_t start, size_t end, int& axis) const {
+        // Splits at the median of the longest axis. nth_element only puts the median in place and the
+        // smaller ones before it, which is all the split needs and linear instead of a full sort.
+        if (end - start <= 2)
+            return start;
+
+        axis = boundingBox.getLongestAxisIndex();
+        auto mid = start + (end - start) / 2;
+        std::nth_element(std::begin(buildObjects) + start, std::begin(buildObjects) + mid, std::begin(buildObjects) + end,
+            [axis](const BuildObject& lhs, const BuildObject& rhs) { return lhs.box.getAxisInterval(axis).min < rhs.box.getAxisInterval(axis).min; });
+        return mid;
     }
 
-    static bool compareBoxZ(const std::shared_ptr<Hittable> lhs, const std::shared_ptr<Hittable> rhs) {
-        return compareBox(lhs, rhs, 2);
+    size_t partitionSAH(std::vector<BuildObject>& buildObjects, size_t start, size_t end, const BVHBuildOptions& options, int threadCount, int& axis) const {
+        // Binned SAH (Wald 2007): object centroids are counted into binCount equal bins per axis, and
+        // only the planes between bins are candidates. Each node costs O(n) this way, the whole build
+        // O(n log n). Returns start for a leaf.
+        size_t objectCount = end - start;
+        if (objectCount <= 1)
+            return start;
+
+        CentroidBounds centroidBounds;
+        for (const CentroidBounds& chunkBounds : getChunkResults<CentroidBounds>(start, end, threadCount,
+                 [&](size_t chunkStart, size_t chunkEnd, CentroidBounds& chunkBounds) {
+                     for (size_t currentObjectIndex = chunkStart; currentObjectIndex < chunkEnd; ++currentObjectIndex) {
+                         const Point3& centroid = buildObjects[currentObjectIndex].centroid;
+                         for (int axis = 0; axis < 3; ++axis)
+                             chunkBounds.axes[axis] = Interval(chunkBounds.axes[axis], Interval(centroid[axis], centroid[axis]));
+                     }
+                 }))
+            for (int axis = 0; axis < 3; ++axis)
+                centroidBounds.axes[axis] = Interval(centroidBounds.axes[axis], chunkBounds.axes[axis]);
+
+        // small spans don't need more bins than objects
+        const int binCount = static_cast<int>(std::min<size_t>(std::max(options.binCount, 2), std::max<size_t>(objectCount, 2)));
+        SAHBins bins = { std::vector<AABB>(3 * binCount, AABB::empty), std::vector<size_t>(3 * binCount, 0) };
+        for (const SAHBins& chunkBins : getChunkResults<SAHBins>(start, end, threadCount,
+                 [&](size_t chunkStart, size_t chunkEnd, SAHBins& chunkBins) {
+                     chunkBins = { std::vector<AABB>(3 * binCount, AABB::empty), std::vector<size_t>(3 * binCount, 0) };
+                     for (size_t currentObjectIndex = chunkStart; currentObjectIndex < chunkEnd; ++currentObjectIndex) {
+                         const BuildObject& buildObject = buildObjects[currentObjectIndex];
+                         for (int axis = 0; axis < 3; ++axis) {
+                             int bin = axis * binCount + getBinIndex(buildObject.centroid[axis], centroidBounds.axes[axis], binCount);
+                             chunkBins.boxes[bin] = AABB(chunkBins.boxes[bin], buildObject.box);
+                             ++chunkBins.counts[bin];
+                         }
+                     }
+                 })) {
+            for (int bin = 0; bin < 3 * binCount; ++bin) {
+                bins.boxes[bin] = AABB(bins.boxes[bin], chunkBins.boxes[bin]);
+                bins.counts[bin] += chunkBins.counts[bin];
+            }
+        }
+
+        std::vector<double> rightAreaCounts(binCount);
+        double bestCost = RT_INFINITY;
+        int bestAxis = -1, bestSplit = 0;
+
+        for (int axis = 0; axis < 3; ++axis) {
+            if (centroidBounds.axes[axis].getSize() <= 0)
+                continue;       // all centroids in one plane: nothing to split on this axis
+
+            const AABB* binBoxes = &bins.boxes[axis * binCount];
+            const size_t* binCounts = &bins.counts[axis * binCount];
+
+            // sweep from the right for the area times count of every right side, then from the left
+            AABB sideBox = AABB::empty;
+            size_t sideCount = 0;
+            for (int split = binCount - 1; split > 0; --split) {
+                sideBox = AABB(sideBox, binBoxes[split]);
+                sideCount += binCounts[split];
+                rightAreaCounts[split] = sideBox.getSurfaceArea() * sideCount;
+            }
+
+            sideBox = AABB::empty;
+            sideCount = 0;
+            for (int split = 1; split < binCount; ++split) {
+                sideBox = AABB(sideBox, binBoxes[split - 1]);
+                sideCount += binCounts[split - 1];
+                if (sideCount == 0 || sideCount == objectCount)
+                    continue;
+
+                double cost = sideBox.getSurfaceArea() * sideCount + rightAreaCounts[split];
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestSplit = split;
+                }
+            }
+        }
+
+        // every centroid in the same spot: the objects can only be split arbitrarily
+        axis = (bestAxis < 0) ? boundingBox.getLongestAxisIndex() : bestAxis;
+        if (bestAxis < 0)
+            return (objectCount <= static_cast<size_t>(options.maxLeafSize)) ? start : start + objectCount / 2;
+
+        auto area = boundingBox.getSurfaceArea();
+        double splitCost = options.traversalCost + options.intersectionCost * (area > 0 ? bestCost / area : objectCount);
+        double leafCost = options.intersectionCost * objectCount;
+        if (objectCount <= static_cast<size_t>(options.maxLeafSize) && leafCost <= splitCost)
+            return start;
+
+        const Interval& splitInterval = centroidBounds.axes[bestAxis];
+        return partitionStable(buildObjects, start, end, threadCount, [&](const BuildObject& buildObject) {
+            return getBinIndex(buildObject.centroid[bestAxis], splitInterval, binCount) < bestSplit;
+        });
+    }
+
+    template <typename Predicate>
+    static size_t partitionStable(std::vector<BuildObject>& buildObjects, size_t start, size_t end, int threadCount, const Predicate& isLeft) {
+        // Stable, so the order of the objects, and with it the tree, is the same with any threadCount.
+        // In parallel, every chunk counts its left objects, and prefix sums of these counts give each
+        // chunk the places its objects move to.
+        if (threadCount <= 1 || end - start < PARALLEL_LOOP_MIN_OBJECTS) {
+            auto middle = std::stable_partition(std::begin(buildObjects) + start, std::begin(buildObjects) + end, isLeft);
+            return static_cast<size_t>(middle - std::begin(buildObjects));
+        }
+
+        std::vector<size_t> leftCounts = getChunkResults<size_t>(start, end, threadCount, [&](size_t chunkStart, size_t chunkEnd, size_t& leftCount) {
+            for (size_t currentObjectIndex = chunkStart; currentObjectIndex < chunkEnd; ++currentObjectIndex)
+                leftCount += isLeft(buildObjects[currentObjectIndex]) ? 1 : 0;
+        });
+
+        size_t totalLeftCount = 0;
+        for (size_t leftCount : leftCounts)
+            totalLeftCount += leftCount;
+
+        // a chunk's right objects come after all left objects and the right objects of earlier chunks
+        std::vector<size_t> leftOffsets, rightOffsets;
+        size_t leftOffset = 0, rightOffset = totalLeftCount;
+        for (size_t chunk = 0; chunk < leftCounts.size(); ++chunk) {
+            size_t chunkSize = (end - start) * (chunk + 1) / leftCounts.size() - (end - start) * chunk / leftCounts.size();
+            leftOffsets.push_back(leftOffset);
+            rightOffsets.push_back(rightOffset);
+            leftOffset += leftCounts[chunk];
+            rightOffset += chunkSize - leftCounts[chunk];
+        }
+
+        std::vector<BuildObject> partitioned(end - start);
+        runChunks(start, end, threadCount, [&](int chunk, size_t chunkStart, size_t chunkEnd) {
+            for (size_t currentObjectIndex = chunkStart; currentObjectIndex < chunkEnd; ++currentObjectIndex) {
+                size_t& position = isLeft(buildObjects[currentObjectIndex]) ? leftOffsets[chunk] : rightOffsets[chunk];
+                partitioned[position++] = buildObjects[currentObjectIndex];
+            }
+        });
+        std::copy(partitioned.begin(), partitioned.end(), std::begin(buildObjects) + start);
+        return start + totalLeftCount;
     }
 
+    // LBVH (Lauterbach et al. 2009, Karras 2012). Centroids are quantized to 21 bits per axis and
+    // interleaved into 63-bit Morton codes, which a radix sort puts in order along a space-filling
+    // curve. Every node then splits its run of codes where their highest differing bit flips; that
+    // bit also tells the split axis. No cost is ever evaluated, so the build is a sort plus one pass,
+    // at the price of a worse tree than the SAH gives. With isOptimizingTreelets, the runs sharing
+    // their top TREELET_BITS bits become treelets, and the levels above them are built with the SAH
+    // over the treelet boxes (HLBVH, Pantaleoni and Luebke 2010), which recovers most of the quality.
+    static constexpr int MORTON_BITS_PER_AXIS = 21;
+    static constexpr int TREELET_BITS = 12;
+
+    void buildLBVH(const std::vector<std::shared_ptr<Hittable>>& objects, const std::vector<BuildObject>& buildObjects,
+                   const BVHBuildOptions& options, int threadCount) {
+        if (buildObjects.empty()) {
+            boundingBox = AABB::empty;
+            builtSurfaceArea = 0;
+            return;
+        }
 
+        CentroidBounds centroidBounds;
+        for (const CentroidBounds& chunkBounds : getChunkResults<CentroidBounds>(0, buildObjects.size(), threadCount,
+                 [&](size_t chunkStart, size_t chunkEnd, CentroidBounds& chunkBounds) {
+                     for (size_t currentObjectIndex = chunkStart; currentObjectIndex < chunkEnd; ++currentObjectIndex)
+                         for (int axis = 0; axis < 3; ++axis) {
+                             double centroid = buildObjects[currentObjectIndex].centroid[axis];
+                             chunkBounds.axes[axis] = Interval(chunkBounds.axes[axis], Interval(centroid, centroid));
+                         }
+                 }))
+            for (int axis = 0; axis < 3; ++axis)
+                centroidBounds.axes[axis] = Interval(centroidBounds.axes[axis], chunkBounds.axes[axis]);
 
+        std::vector<MortonObject> mortonObjects(buildObjects.size());
+        runChunks(0, buildObjects.size(), threadCount, [&](int chunk, size_t chunkStart, size_t chunkEnd) {
+            for (size_t currentObjectIndex = chunkStart; currentObjectIndex < chunkEnd; ++currentObjectIndex) {
+                std::uint64_t code = 0;
+                for (int axis = 0; axis < 3; ++axis) {
+                    const Interval& bounds = centroidBounds.axes[axis];
+                    double relative = (bounds.getSize() > 0) ? (buildObjects[currentObjectIndex].centroid[axis] - bounds.min) / bounds.getSize() : 0;
+                    auto quantized = static_cast<std::uint64_t>(std::min(std::max(relative * (1 << MORTON_BITS_PER_AXIS), 0.0), (1 << MORTON_BITS_PER_AXIS) - 1.0));
+                    code |= getSpreadBits(quantized) << (2 - axis);      // x in the highest bit of every triple
+                }
+                mortonObjects[currentObjectIndex] = { code, static_cast<std::uint32_t>(currentObjectIndex) };
+            }
+        });
+        sortByMortonCode(mortonObjects, threadCount);
+
+        if (!options.isOptimizingTreelets) {
+            emitLBVH(objects, buildObjects, mortonObjects, 0, mortonObjects.size(), options, threadCount);
+            return;
+        }
+
+        // runs of codes with the same top bits
+        const int treeletShift = 3 * MORTON_BITS_PER_AXIS - TREELET_BITS;
+        std::vector<size_t> treeletStarts;
+        for (size_t currentObjectIndex = 0; currentObjectIndex < mortonObjects.size(); ++currentObjectIndex)
+            if (currentObjectIndex == 0 || (mortonObjects[currentObjectIndex].code >> treeletShift) != (mortonObjects[currentObjectIndex - 1].code >> treeletShift))
+                treeletStarts.push_back(currentObjectIndex);
+        treeletStarts.push_back(mortonObjects.size());
+
+        auto treeletCount = static_cast<int>(treeletStarts.size() - 1);
+        std::vector<std::shared_ptr<BVHNode>> treelets(treeletCount);
+        std::vector<BuildObject> treeletObjects(treeletCount);
+        ThreadPool(threadCount).run(treeletCount, [&](int treelet) {
+            treelets[treelet] = std::shared_ptr<BVHNode>(new BVHNode());
+            treelets[treelet]->emitLBVH(objects, buildObjects, mortonObjects, treeletStarts[treelet], treeletStarts[treelet + 1], options, 1);
+            const AABB& treeletBox = treelets[treelet]->boundingBox;
+            treeletObjects[treelet] = { treeletBox, getCentroid(treeletBox), static_cast<size_t>(treelet) };
+        });
+
+        buildOverTreelets(treelets, treeletObjects, 0, treeletObjects.size(), options);
+    }
+
+    void emitLBVH(const std::vector<std::shared_ptr<Hittable>>& objects, const std::vector<BuildObject>& buildObjects,
+                  const std::vector<MortonObject>& mortonObjects, size_t start, size_t end, const BVHBuildOptions& options, int threadCount) {
+        // The boxes are merged bottom-up, so each level costs a binary search per node, not a pass over its objects.
+        if (end - start <= static_cast<size_t>(std::max(options.maxLeafSize, 1))) {
+            boundingBox = AABB::empty;
+            leafObjects.reserve(end - start);
+            for (size_t currentObjectIndex = start; currentObjectIndex < end; ++currentObjectIndex) {
+                const BuildObject& buildObject = buildObjects[mortonObjects[currentObjectIndex].buildObject];
+                boundingBox = AABB(boundingBox, buildObject.box);
+                leafObjects.push_back(objects[buildObject.objectIndex]);
+            }
+            builtSurfaceArea = boundingBox.getSurfaceArea();
+            return;
+        }
+
+        // the first code with the highest differing bit set; identical codes are split in the middle
+        std::uint64_t differingBits = mortonObjects[start].code ^ mortonObjects[end - 1].code;
+        size_t mid = start + (end - start) / 2;
+        splitAxis = 0;
+        if (differingBits != 0) {
+            int highestBit = getHighestSetBit(differingBits);
+            std::uint64_t bitMask = std::uint64_t(1) << highestBit;
+            mid = static_cast<size_t>(std::partition_point(std::begin(mortonObjects) + start, std::begin(mortonObjects) + end,
+                [bitMask](const MortonObject& mortonObject) { return (mortonObject.code & bitMask) == 0; }) - std::begin(mortonObjects));
+            splitAxis = 2 - highestBit % 3;
+        }
+
+        auto leftNode = std::shared_ptr<BVHNode>(new BVHNode());
+        auto rightNode = std::shared_ptr<BVHNode>(new BVHNode());
+
+        if (threadCount > 1 && end - start >= PARALLEL_SUBTREE_MIN_OBJECTS) {
+            int leftThreadCount = threadCount / 2;
+            ThreadPool(2).run(2, [&](int side) {
+                if (side == 0)
+                    leftNode->emitLBVH(objects, buildObjects, mortonObjects, start, mid, options, leftThreadCount);
+                else
+                    rightNode->emitLBVH(objects, buildObjects, mortonObjects, mid, end, options, threadCount - leftThreadCount);
+            });
+        }
+        else {
+            leftNode->emitLBVH(objects, buildObjects, mortonObjects, start, mid, options, 1);
+            rightNode->emitLBVH(objects, buildObjects, mortonObjects, mid, end, options, 1);
+        }
+
+        left = leftNode;
+        right = rightNode;
+        boundingBox = AABB(leftNode->boundingBox, rightNode->boundingBox);
+        builtSurfaceArea = boundingBox.getSurfaceArea();
+    }
+
+    void buildOverTreelets(std::vector<std::shared_ptr<BVHNode>>& treelets, std::vector<BuildObject>& treeletObjects, size_t start, size_t end, const BVHBuildOptions& options) {
+        // SAH splits down to single treelets, which then take this node's place.
+        if (end - start == 1) {
+            *this = std::move(*treelets[treeletObjects[start].objectIndex]);
+            return;
+        }
+
+        boundingBox = AABB::empty;
+        for (size_t currentTreelet = start; currentTreelet < end; ++currentTreelet)
+            boundingBox = AABB(boundingBox, treeletObjects[currentTreelet].box);
+        builtSurfaceArea = boundingBox.getSurfaceArea();
+
+        BVHBuildOptions treeletOptions = options;
+        treeletOptions.maxLeafSize = 1;
+        size_t mid = partitionSAH(treeletObjects, start, end, treeletOptions, 1, splitAxis);
+        if (mid == start || mid == end)
+            mid = start + (end - start) / 2;
+
+        auto leftNode = std::shared_ptr<BVHNode>(new BVHNode());
+        auto rightNode = std::shared_ptr<BVHNode>(new BVHNode());
+        leftNode->buildOverTreelets(treelets, treeletObjects, start, mid, options);
+        rightNode->buildOverTreelets(treelets, treeletObjects, mid, end, options);
+        left = leftNode;
+        right = rightNode;
+    }
+
+    static void sortByMortonCode(std::vector<MortonObject>& mortonObjects, int threadCount) {
+        // Stable LSD radix sort, 8 bits per pass. Every chunk counts its digits; the counts, summed digit
+        // by digit and chunk by chunk, tell each chunk where its objects go. Passes over a digit that
+        // is the same in every code are skipped.
+        constexpr int DIGIT_BITS = 8;
+        constexpr size_t DIGIT_COUNT = 1 << DIGIT_BITS;
+        using DigitCounts = std::vector<size_t>;
+
+        std::vector<MortonObject> sorted(mortonObjects.size());
+        for (int shift = 0; shift < 3 * MORTON_BITS_PER_AXIS; shift += DIGIT_BITS) {
+            std::vector<DigitCounts> chunkCounts = getChunkResults<DigitCounts>(0, mortonObjects.size(), threadCount,
+                [&](size_t chunkStart, size_t chunkEnd, DigitCounts& digitCounts) {
+                    digitCounts.assign(DIGIT_COUNT, 0);
+                    for (size_t currentObjectIndex = chunkStart; currentObjectIndex < chunkEnd; ++currentObjectIndex)
+                        ++digitCounts[(mortonObjects[currentObjectIndex].code >> shift) & (DIGIT_COUNT - 1)];
+                });
+
+            size_t offset = 0;
+            bool isDigitConstant = false;
+            for (size_t digit = 0; digit < DIGIT_COUNT; ++digit) {
+                size_t digitTotal = 0;
+                for (DigitCounts& digitCounts : chunkCounts) {
+                    size_t count = digitCounts[digit];
+                    digitCounts[digit] = offset + digitTotal;      // from now on: where the chunk's first object with this digit goes
+                    digitTotal += count;
+                }
+                offset += digitTotal;
+                isDigitConstant = isDigitConstant || digitTotal == mortonObjects.size();
+            }
+            if (isDigitConstant)
+                continue;
+
+            runChunks(0, mortonObjects.size(), threadCount, [&](int chunk, size_t chunkStart, size_t chunkEnd) {
+                DigitCounts& positions = chunkCounts[chunk];
+                for (size_t currentObjectIndex = chunkStart; currentObjectIndex < chunkEnd; ++currentObjectIndex)
+                    sorted[positions[(mortonObjects[currentObjectIndex].code >> shift) & (DIGIT_COUNT - 1)]++] = mortonObjects[currentObjectIndex];
+            });
+            std::swap(mortonObjects, sorted);
+        }
+    }
+
+    static std::uint64_t getSpreadBits(std::uint64_t x) {
+        // moves bit i of a 21-bit number to bit 3i
+        x &= 0x1FFFFF;
+        x = (x | (x << 32)) & 0x1F00000000FFFFull;
+        x = (x | (x << 16)) & 0x1F0000FF0000FFull;
+        x = (x | (x << 8)) & 0x100F00F00F00F00Full;
+        x = (x | (x << 4)) & 0x10C30C30C30C30C3ull;
+        x = (x | (x << 2)) & 0x1249249249249249ull;
+        return x;
+    }
+
+    static int getHighestSetBit(std::uint64_t x) {
+        int bit = 0;
+        for (int shift = 32; shift > 0; shift >>= 1) {
+            if (x >> shift) {
+                x >>= shift;
+                bit += shift;
+            }
+        }
+        return bit;
+    }
+
+    size_t getHeapUsage() const {
+        // Every child is its own allocation with a separate shared_ptr control block, and every leaf
+        // has its own array of object pointers. The allocator adds about a pointer of bookkeeping to each.
+        const size_t allocationOverhead = sizeof(void*);
+        const size_t controlBlockSize = sizeof(void*) + 2 * sizeof(int) + sizeof(void*);   // vtable, counts, pointer
+        if (isLeaf()) {
+            size_t capacity = leafObjects.capacity();
+            return (capacity > 0) ? capacity * sizeof(std::shared_ptr<Hittable>) + allocationOverhead : 0;
+        }
+        size_t childUsage = 2 * (sizeof(BVHNode) + controlBlockSize + 2 * allocationOverhead);
+        return childUsage + static_cast<const BVHNode&>(*left).getHeapUsage() + static_cast<const BVHNode&>(*right).getHeapUsage();
+    }
+
+    static Point3 getCentroid(const AABB& box) {
+        return Point3(0.5 * (box.intervalX.min + box.intervalX.max), 0.5 * (box.intervalY.min + box.intervalY.max), 0.5 * (box.intervalZ.min + box.intervalZ.max));
+    }
+
+    static int getBinIndex(double centroid, const Interval& centroidBounds, int binCount) {
+        if (centroidBounds.getSize() <= 0)
+            return 0;       // flat axis: every centroid goes in the first bin; the split search skips this axis
+        auto bin = static_cast<int>(binCount * (centroid - centroidBounds.min) / centroidBounds.getSize());
+        return std::min(std::max(bin, 0), binCount - 1);
+    }
 
-    std::shared_ptr<Hittable> left;
+    std::shared_ptr<Hittable> left;     // children of an inner node, both BVHNodes; empty in a leaf
     std::shared_ptr<Hittable> right;
+    std::vector<std::shared_ptr<Hittable>> leafObjects;
     AABB boundingBox;
+    double builtSurfaceArea;    // area of boundingBox when the node was built
+    double buildSeconds = 0;    // time the public constructor took to build the tree below this node
+    int splitAxis = 0;          // inner node: axis along which the objects were split between the children
+    std::shared_ptr<const BVHBuildOptions> buildOptions;   // set in nodes the public constructor built; used to rebuild subtrees
 };
 
 #endif
@@ -0,0 +1,195 @@
+#ifndef BVH_CACHE_H
+#define BVH_CACHE_H
+
+#include "hittable_list.h"
+#include "linear_bvh.h"
+#include "mapped_file.h"
+#include "sampler.h"
+#include "wide_bvh.h"
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// BVH cache files hold a built LinearBVH or WideBVH, so rendering an unchanged scene again skips the
+// build. The file is
+//   BVHCacheHeader
+//   nodeCount nodes, exactly as they are in memory
+//   objectCount uint32 indices: the tree's objects in leaf order, as positions in the scene's HittableList
+// Loading maps the file and traverses the nodes where they lie; only the object list is rebuilt.
+// The header holds a hash of every object's box and of the build options. A file whose hash, version,
+// node layout or byte order doesn't match is ignored and rebuilt, so changing the geometry invalidates
+// the cache by itself. Changes that keep every box, like new materials, keep the cache.
+
+constexpr std::uint32_t BVH_CACHE_MAGIC = 0x43425452;     // "RTBC"
+constexpr std::uint32_t BVH_CACHE_VERSION = 1;
+
+struct alignas(32) BVHCacheHeader {
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint32_t nodeLayout;       // BVHCacheLayout<Structure>::ID of the tree
+    std::uint32_t nodeSize;         // bytes per node
+    std::uint64_t sceneHash;        // getSceneHash of the objects and options the tree was built from
+    std::uint64_t nodeCount;
+    std::uint64_t objectCount;
+    std::int64_t  maxDepth;
+    double bounds[2][3];            // min and max corner of the tree's bounding box
+};
+
+static_assert(sizeof(BVHCacheHeader) % 32 == 0, "the nodes after the header must stay aligned");
+
+// Node type and layout id of each structure that can be cached.
+template <typename Structure>
+struct BVHCacheLayout;
+
+template <>
+struct BVHCacheLayout<LinearBVH> {
+    using Node = LinearBVHNode;
+    static constexpr std::uint32_t ID = 1;
+};
+
+template <int Width>
+struct BVHCacheLayout<WideBVH<Width>> {
+    using Node = WideBVHNode<Width>;
+    static constexpr std::uint32_t ID = Width;
+};
+
+inline std::uint64_t getSceneHash(const HittableList& list, const BVHBuildOptions& options) {
+    // Everything the tree depends on: the object count, the boxes in list order and the options that
+    // shape the tree. The thread count doesn't, since every count builds the same tree.
+    std::uint64_t hash = getMixedBits(list.objects.size());
+    auto addValue = [&hash](std::uint64_t value) { hash = getMixedBits(hash ^ value); };
+    auto addDouble = [&addValue](double value) {
+        std::uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        addValue(bits);
+    };
+
+    for (const auto& object : list.objects) {
+        AABB box = object->getBoundingBox();
+        for (int axis = 0; axis < 3; ++axis) {
+            addDouble(box.getAxisInterval(axis).min);
+            addDouble(box.getAxisInterval(axis).max);
+        }
+    }
+
+    addValue(static_cast<std::uint64_t>(options.splitMethod));
+    addValue(static_cast<std::uint64_t>(options.maxLeafSize));
+    addValue(static_cast<std::uint64_t>(options.binCount));
+    addDouble(options.traversalCost);
+    addDouble(options.intersectionCost);
+    addValue(options.isOptimizingTreelets);
+    return hash;
+}
+
+template <typename Structure>
+bool saveBVHCache(const std::string& fileName, const Structure& tree, const HittableList& list, std::uint64_t sceneHash) {
+    using Node = typename BVHCacheLayout<Structure>::Node;
+
+    std::unordered_map<const Hittable*, std::uint32_t> listPositions;
+    for (size_t currentObject = 0; currentObject < list.objects.size(); ++currentObject)
+        listPositions.emplace(list.objects[currentObject].get(), static_cast<std::uint32_t>(currentObject));
+
+    std::vector<std::uint32_t> objectIndices;
+    objectIndices.reserve(tree.getObjects().size());
+    for (const auto& object : tree.getObjects()) {
+        auto position = listPositions.find(object.get());
+        if (position == listPositions.end())
+            return false;       // the tree was not built from this list
+        objectIndices.push_back(position->second);
+    }
+
+    BVHCacheHeader header = {};
+    header.magic = BVH_CACHE_MAGIC;
+    header.version = BVH_CACHE_VERSION;
+    header.nodeLayout = BVHCacheLayout<Structure>::ID;
+    header.nodeSize = sizeof(Node);
+    header.sceneHash = sceneHash;
+    header.nodeCount = tree.getNodes().size();
+    header.objectCount = list.objects.size();
+    header.maxDepth = tree.getMaxDepth();
+    AABB box = tree.getBoundingBox();
+    for (int axis = 0; axis < 3; ++axis) {
+        header.bounds[0][axis] = box.getAxisInterval(axis).min;
+        header.bounds[1][axis] = box.getAxisInterval(axis).max;
+    }
+
+    // as with checkpoints: write a temporary file and rename it, so readers never see half a file
+    auto temporaryFileName = fileName + ".tmp";
+    {
+        std::ofstream out(temporaryFileName, std::ios::binary | std::ios::trunc);
+        if (!out)
+            return false;
+
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(tree.getNodes().data()), tree.getNodes().size() * sizeof(Node));
+        out.write(reinterpret_cast<const char*>(objectIndices.data()), objectIndices.size() * sizeof(std::uint32_t));
+        if (!out)
+            return false;
+    }
+
+    // replaces an existing cache in one step, unlike removing it first
+    std::error_code error;
+    std::filesystem::rename(temporaryFileName, fileName, error);
+    return !error;
+}
+
+template <typename Structure>
+std::shared_ptr<Structure> loadBVHCache(const std::string& fileName, const HittableList& list, std::uint64_t sceneHash) {
+    // Returns nullptr if the file is missing, stale, truncated or damaged.
+    using Node = typename BVHCacheLayout<Structure>::Node;
+
+    auto file = std::make_shared<MappedFile>(fileName);
+    if (!file->isOpen() || file->getSize() < sizeof(BVHCacheHeader))
+        return nullptr;
+
+    BVHCacheHeader header;
+    std::memcpy(&header, file->getData(), sizeof(header));
+    if (header.magic != BVH_CACHE_MAGIC || header.version != BVH_CACHE_VERSION || header.nodeLayout != BVHCacheLayout<Structure>::ID
+        || header.nodeSize != sizeof(Node) || header.sceneHash != sceneHash || header.objectCount != list.objects.size())
+        return nullptr;
+
+    size_t payloadSize = file->getSize() - sizeof(header);
+    if (header.nodeCount > payloadSize / sizeof(Node) || header.objectCount > payloadSize / sizeof(std::uint32_t)
+        || header.nodeCount * sizeof(Node) + header.objectCount * sizeof(std::uint32_t) != payloadSize)
+        return nullptr;
+
+    auto nodeCount = static_cast<size_t>(header.nodeCount);
+    const unsigned char* indexData = file->getData() + sizeof(header) + nodeCount * sizeof(Node);
+    std::vector<std::shared_ptr<Hittable>> objects(static_cast<size_t>(header.objectCount));
+    for (size_t currentObject = 0; currentObject < objects.size(); ++currentObject) {
+        std::uint32_t listPosition;
+        std::memcpy(&listPosition, indexData + currentObject * sizeof(listPosition), sizeof(listPosition));
+        if (listPosition >= list.objects.size())
+            return nullptr;
+        objects[currentObject] = list.objects[listPosition];
+    }
+
+    AABB box(Interval(header.bounds[0][0], header.bounds[1][0]), Interval(header.bounds[0][1], header.bounds[1][1]),
+             Interval(header.bounds[0][2], header.bounds[1][2]));
+    auto tree = std::make_shared<Structure>(NodeArray<Node>(file, sizeof(header), nodeCount), std::move(objects), box,
+                                            static_cast<int>(header.maxDepth));
+    return tree->isConsistent() ? tree : nullptr;
+}
+
+template <typename Structure>
+std::shared_ptr<Structure> getCachedBVH(const std::string& fileName, const HittableList& list, const BVHBuildOptions& options = BVHBuildOptions()) {
+    // The tree from fileName if that was built from the same boxes with the same options; otherwise a new
+    // tree, which then replaces fileName.
+    std::uint64_t sceneHash = getSceneHash(list, options);
+    if (auto cachedTree = loadBVHCache<Structure>(fileName, list, sceneHash))
+        return cachedTree;
+
+    auto tree = std::make_shared<Structure>(list, options);
+    if (!saveBVHCache(fileName, *tree, list, sceneHash))
+        std::cerr << "ERROR: Could not write BVH cache file '" << fileName << "'.\n";
+    return tree;
+}
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef BVH_STATISTICS_H
+#define BVH_STATISTICS_H
+
+#include <cstddef>
+#include <iomanip>
+#include <ostream>
+#include <vector>
+
+// BVH statistics, for finding out whether a slow scene has a bad tree. Compiling with
+// -DRT_BVH_STATISTICS makes the camera report, after each render, the tree metrics of every BVH in the
+// world it rendered (see Hittable::collectTreeStatistics) and how many nodes, boxes and objects each
+// ray visited, split into camera rays and all other rays (bounces and shadow rays). Without the flag
+// the counting macros are empty, so traversal costs exactly what it did before.
+
+struct BVHTreeStatistics {
+    const char* structureName = "BVH";  // the structure that owns the tree
+    size_t nodeCount = 0;
+    size_t leafCount = 0;
+    size_t objectCount = 0;
+    size_t emptyLeafCount = 0;
+    size_t maxLeafSize = 0;
+    int    maxDepth = 0;                // root has depth 0
+    double averageLeafDepth = 0;
+    double sahCost = 0;                 // BVHNode::getSAHCost with default options
+    double averageOverlap = 0;          // surface area of the overlap of sibling boxes over their parent's, averaged over inner nodes
+    std::vector<size_t> leafSizeCounts; // [n]: leaves holding n objects
+
+    void print(std::ostream& out) const {
+        out << structureName << ": " << nodeCount << " nodes, " << leafCount << " leaves (" << emptyLeafCount << " empty), "
+            << objectCount << " objects\n"
+            << "  depth: max " << maxDepth << ", leaf average " << averageLeafDepth << '\n'
+            << "  leaf size: max " << maxLeafSize << ", average " << (leafCount > 0 ? static_cast<double>(objectCount) / leafCount : 0.0) << ", counts";
+        for (size_t leafSize = 0; leafSize < leafSizeCounts.size(); ++leafSize)
+            if (leafSizeCounts[leafSize] > 0)
+                out << ' ' << leafSize << ':' << leafSizeCounts[leafSize];
+        out << "\n  SAH cost " << sahCost << ", sibling overlap " << averageOverlap * 100 << "%\n";
+    }
+};
+
+// Per ray traversal work, counted by the BVH traversals into the calling thread's counters.
+struct BVHRayCounters {
+    long long nodeVisits = 0;       // nodes whose children or objects were looked at
+    long long boxTests = 0;         // ray-box slab tests, one per child box for wide nodes
+    long long objectTests = 0;      // objects a leaf handed the ray to
+};
+
+enum class BVHRayKind {
+    Primary,        // camera rays
+    Secondary       // bounces and shadow rays
+};
+
+class BVHCountHistogram {
+public:
+    // Counts in power of two bins: 0, 1, 2-3, 4-7, ...
+    static constexpr int BIN_COUNT = 40;
+
+    void add(long long value) {
+        int bin = 0;
+        while (bin < BIN_COUNT - 1 && value >= (1LL << bin))
+            ++bin;
+        ++bins[bin];
+        ++rayCount;
+        total += value;
+    }
+
+    void merge(const BVHCountHistogram& other) {
+        for (int bin = 0; bin < BIN_COUNT; ++bin)
+            bins[bin] += other.bins[bin];
+        rayCount += other.rayCount;
+        total += other.total;
+    }
+
+    long long getRayCount() const { return rayCount; }
+    double getMean() const { return rayCount > 0 ? static_cast<double>(total) / rayCount : 0; }
+
+    long long getPercentileBound(double fraction) const {
+        // upper end of the bin holding that fraction of the rays
+        long long needed = static_cast<long long>(fraction * rayCount);
+        long long seen = 0;
+        for (int bin = 0; bin < BIN_COUNT; ++bin) {
+            seen += bins[bin];
+            if (seen > needed)
+                return (bin == 0) ? 0 : (1LL << bin) - 1;
+        }
+        return (1LL << (BIN_COUNT - 1)) - 1;
+    }
+
+    void print(std::ostream& out) const {
+        out << "mean " << std::setw(7) << getMean() << ", median <= " << getPercentileBound(0.5)
+            << ", 99% <= " << getPercentileBound(0.99) << "  |";
+        int lastBin = BIN_COUNT - 1;
+        while (lastBin > 0 && bins[lastBin] == 0)
+            --lastBin;
+        for (int bin = 0; bin <= lastBin; ++bin)
+            out << ' ' << (rayCount > 0 ? 100 * bins[bin] / rayCount : 0);
+        out << " (% per bin 0, 1, 2-3, 4-7, ...)\n";
+    }
+
+private:
+    long long bins[BIN_COUNT] = {};
+    long long rayCount = 0;
+    long long total = 0;
+};
+
+struct BVHRayStatistics {
+    BVHCountHistogram nodeVisits[2];      // indexed by BVHRayKind
+    BVHCountHistogram boxTests[2];
+    BVHCountHistogram objectTests[2];
+
+    void record(BVHRayKind kind, BVHRayCounters& counters) {
+        // adds the ray counted so far and starts the next one
+        auto index = static_cast<int>(kind);
+        nodeVisits[index].add(counters.nodeVisits);
+        boxTests[index].add(counters.boxTests);
+        objectTests[index].add(counters.objectTests);
+        counters = BVHRayCounters();
+    }
+
+    void merge(const BVHRayStatistics& other) {
+        for (int index = 0; index < 2; ++index) {
+            nodeVisits[index].merge(other.nodeVisits[index]);
+            boxTests[index].merge(other.boxTests[index]);
+            objectTests[index].merge(other.objectTests[index]);
+        }
+    }
+
+    void print(std::ostream& out) const {
+        const char* kindNames[2] = { "Primary", "Secondary" };
+        for (int index = 0; index < 2; ++index) {
+            if (nodeVisits[index].getRayCount() == 0)
+                continue;
+            out << kindNames[index] << " rays: " << nodeVisits[index].getRayCount() << '\n';
+            out << "  node visits   ";
+            nodeVisits[index].print(out);
+            out << "  box tests     ";
+            boxTests[index].print(out);
+            out << "  object tests  ";
+            objectTests[index].print(out);
+        }
+    }
+};
+
+inline BVHRayCounters& getThreadBVHRayCounters() {
+    thread_local BVHRayCounters counters;
+    return counters;
+}
+
+inline BVHRayStatistics& getThreadBVHRayStatistics() {
+    // recorded per thread without locking; the camera folds them together after every tile
+    thread_local BVHRayStatistics statistics;
+    return statistics;
+}
+
+#ifdef RT_BVH_STATISTICS
+#define RT_COUNT_BVH(counter, amount) (getThreadBVHRayCounters().counter += (amount))
+#define RT_RECORD_BVH_RAY(kind) getThreadBVHRayStatistics().record((kind), getThreadBVHRayCounters())
+#else
+#define RT_COUNT_BVH(counter, amount) ((void)0)
+#define RT_RECORD_BVH_RAY(kind) ((void)0)
+#endif
+
+#endif
@@ -3,6 +3,30 @@
 
 #include "hittable.h"
 #include "material.h"
+#include "bvh_statistics.h"
+#include "checkpoint.h"
+#include "denoiser.h"
+#include "distributed.h"
+#include "framebuffer.h"
+#include "image_writer.h"
+#include "light_sampler.h"
+#include "render_tile.h"
+#include "thread_pool.h"
+#include "wavefront.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct PathStatistics {
+    long long pathCount = 0;        // camera paths traced
+    long long segmentCount = 0;     // rays cast along those paths, including the camera ray
+};
 
 class Camera {
 public:
@@ -10,6 +34,8 @@ public:
     int    imageWidth = 100;            // Rendered image width in pixel count
     int    samplesPerPixel = 10;        // Count of random sampels for each pixel
     int    maxDepth = 10;               // Maximum number of ray bounces into scene
+    int    russianRouletteDepth = 3;    // Bounces before Russian roulette may end a path
+    bool   isLightSampling = true;      // Sample emissive quads and spheres directly at non-specular hits
     Color  backgroundColor;             // Scene background color
 
     double verticalFOV = 90;            // vertical view angle
@@ -20,45 +46,115 @@ public:
     double defocusAngle = 0;  // Variation angle of rays through each pixel; size of the aperture
     double focusDistance = 10;    // Distance from camera lookfrom point to plane of perfect focus
 
+    int    threadCount = 0;         // Number of render threads; 0 uses every hardware thread
+    int    tileSize = 16;           // Width and height of a square render tile in pixels
+    std::uint64_t randomSeed = 0;   // Seed of the per-sample random streams
+    SamplerType samplerType = SamplerType::Sobol;   // Low-discrepancy (or independent) numbers for every sample
+
+    bool   isProgressive = false;   // Render in passes reaching 1, 4, 16, ... samples per pixel
+    double timeBudgetSeconds = 0;   // Progressive only: stop after this wall-clock time; 0 means no limit
+    std::string checkpointFileName; // Progressive only: checkpoint written after every pass and resumed from
+
+    bool   isAdaptive = false;      // Stop sampling a pixel once its estimated error is small enough
+    int    minSamplesPerPixel = 16; // Adaptive only: samples every pixel takes; samplesPerPixel is the upper bound
+    double adaptiveThreshold = 0.01;    // Adaptive only: target standard error relative to the pixel luminance
+    std::string varianceFileName;   // Adaptive only: optional image of the variance of every pixel mean
+
+    std::string outputFileName;     // Image written by render(); the extension picks the format, empty writes PPM to stdout
+    ToneMapping toneMapping = ToneMapping::Clamp;   // How linear colors above 1 are mapped for 8-bit outputs
+
+    bool   isWavefront = false;     // Trace each tile as ray batches with the wavefront engine (fixed sample count mode)
+    int    wavefrontBatchSize = 1 << 16;    // Wavefront only: camera rays traced together in one batch
+
+    bool   isDenoising = false;     // Filter the image guided by first-hit albedo, normal and depth buffers
+    int    denoiseIterations = 5;   // Denoising only: filter passes; each one doubles the filter footprint
+    std::string albedoFileName;     // Optional image of the first-hit albedo buffer
+    std::string normalFileName;     // Optional image of the first-hit normal buffer
+    std::string depthFileName;      // Optional image of the first-hit depth buffer (use .pfm)
+
+    RenderRole renderRole = RenderRole::Local;  // Render here, or coordinate / work for a distributed render
+    std::string renderAddress = "unix:/tmp/raytracer.sock";     // Distributed only: "unix:<path>" or "<host>:<port>"
+    int    leaseSampleCount = 64;       // Distributed only: samples per pixel in one leased tile
+    double leaseTimeoutSeconds = 600;   // Distributed only: a lease held longer than this goes to another worker
+
 
 
     void render(const Hittable& world) {
         initialize();
 
-        std::cout << "P3\n" << imageWidth << ' ' << imageHeight << "\n255\n";
+        // Every tile owns a disjoint region of the framebuffer and every sample keys its thread's random
+        // stream by pixel and sample index, so the image does not depend on which thread renders a tile.
+        framebuffer = Framebuffer(imageWidth, imageHeight);
+        std::vector<RenderTile> tiles = getTiles();
+        pathStatistics = PathStatistics();
+        bvhRayStatistics = BVHRayStatistics();
+        lightSampler = isLightSampling ? LightSampler(world) : LightSampler();
+        auto startTime = std::chrono::steady_clock::now();
+
+        if (renderRole == RenderRole::Worker) {
+            // the coordinator writes the image
+            renderWorker(world, tiles);
+            return;
+        }
 
-        for (int currentHeight = 0; currentHeight < imageHeight; ++currentHeight) {
-            std::clog << "\rScanlines remaining: " << (imageHeight - currentHeight) << ' ' << std::flush;
-            for (int currentWidth = 0; currentWidth < imageWidth; ++currentWidth) {
-                Color pixelColor(0, 0, 0);
+        if (renderRole == RenderRole::Coordinator) {
+            if (!renderCoordinator(world, tiles, framebuffer)) {
+                std::cerr << "ERROR: Could not collect the image from the workers; '" << outputFileName << "' was not written.\n";
+                return;
+            }
+        }
+        else if (isAdaptive)
+            renderAdaptive(world, tiles, framebuffer);
+        else if (isProgressive)
+            renderProgressive(world, tiles, framebuffer);
+        else {
+            runTiles(static_cast<int>(tiles.size()), [&](int tileIndex) {
+                if (isWavefront)
+                    renderTileWavefront(world, tiles[tileIndex], framebuffer);
+                else
+                    renderTile(world, tiles[tileIndex], framebuffer);
+            });
+        }
 
-                // jittering applied
-                for (int currentSampleRow = 0; currentSampleRow < sqrtSamplesPerPixels; ++currentSampleRow) {
-                    for (int currentSampleCol = 0; currentSampleCol < sqrtSamplesPerPixels; ++currentSampleCol) {
-                        Ray currentRay = getRayToSample(currentWidth, currentHeight, currentSampleRow, currentSampleCol);
-                        pixelColor += getRayColor(currentRay, maxDepth, world);
-                    }
-                }
-                /*
-                * original
-                for (int currentSample = 0; currentSample < samplesPerPixel; ++currentSample) {
-                    Ray currentRay = getRayToSample(currentWidth, currentHeight);
-                    pixelColor += getRayColor(currentRay, maxDepth, world);
-                }
-                */
-                writeColor(std::cout, pixelSamplesScale * pixelColor);
+        double renderSeconds = getSecondsSince(startTime);
+
+        if (isDenoising || !albedoFileName.empty() || !normalFileName.empty() || !depthFileName.empty()) {
+            AOVBuffers aovs = renderAOVs(world, tiles);
+            writeAOVs(aovs);
+            if (isDenoising) {
+                auto denoiseStartTime = std::chrono::steady_clock::now();
+                framebuffer = ATrousDenoiser(denoiseIterations).denoise(framebuffer, aovs, threadCount);
+                std::clog << "\rDenoised in " << getSecondsSince(denoiseStartTime) << " s        \n";
             }
         }
 
+        if (!writeImage(outputFileName, framebuffer, toneMapping))
+            std::cerr << "ERROR: Could not write image file '" << outputFileName << "'.\n";
+
+        if (pathStatistics.pathCount > 0) {
+            std::clog << "\rAverage path length: " << static_cast<double>(pathStatistics.segmentCount) / pathStatistics.pathCount << " segments\n";
+            std::clog << "Traced " << pathStatistics.segmentCount / renderSeconds / 1e6 << " million rays per second\n";
+        }
+#ifdef RT_BVH_STATISTICS
+        std::vector<BVHTreeStatistics> treeStatistics;
+        world.collectTreeStatistics(treeStatistics);
+        for (const BVHTreeStatistics& statistics : treeStatistics)
+            statistics.print(std::clog);
+        bvhRayStatistics.print(std::clog);
+#endif
         std::clog << "\rDone.                 \n";
     }
 
+    const Framebuffer& getFramebuffer() const {
+        // linear colors of the last render, for callers that want to post-process or write them elsewhere
+        return framebuffer;
+    }
+
 private:
     void initialize() {
         imageHeight = static_cast<int>(imageWidth / aspectRatio);
         imageHeight = (imageHeight < 1) ? 1 : imageHeight;
 
-        sqrtSamplesPerPixels = static_cast<int>(std::sqrt(samplesPerPixel));
         pixelSamplesScale = 1.0 / samplesPerPixel;
 
         center = lookFrom;
@@ -95,16 +191,411 @@ private:
         defocusVerticalRadius = axisY * defocusRadius;
     }
 
-    Ray getRayToSample(int currentWidth, int currentHeight, int currentSampleRow, int currentSampleCol) const {
-        // Construct a camera ray originating from the origin and directed at randomly sampled
-        // point around the pixel location currentWidth, currentHeight.
-        auto offset = getSampleSquareStratified(currentSampleRow, currentSampleCol);
+    void runTiles(int tileCount, const std::function<void(int)>& renderTileAt) const {
+        ThreadPool pool(threadCount);
+        std::mutex progressMutex;
+        int tilesRemaining = tileCount;
+
+        pool.run(tileCount, [&](int tileIndex) {
+            renderTileAt(tileIndex);
+
+            std::lock_guard<std::mutex> lock(progressMutex);
+            PathStatistics& threadStatistics = getThreadPathStatistics();
+            pathStatistics.pathCount += threadStatistics.pathCount;
+            pathStatistics.segmentCount += threadStatistics.segmentCount;
+            threadStatistics = PathStatistics();
+#ifdef RT_BVH_STATISTICS
+            bvhRayStatistics.merge(getThreadBVHRayStatistics());
+            getThreadBVHRayStatistics() = BVHRayStatistics();
+#endif
+
+            --tilesRemaining;
+            std::clog << "\rTiles remaining: " << tilesRemaining << ' ' << std::flush;
+        });
+    }
+
+    void renderProgressive(const Hittable& world, const std::vector<RenderTile>& tiles, Framebuffer& outputFramebuffer) const {
+        // Each pass brings every pixel up to the next power of 4 samples (capped at samplesPerPixel)
+        // and adds them to a float accumulation buffer, which is checkpointed after the pass.
+        // A checkpoint of the same resolution and scene is picked up again, so a killed render loses one pass at most.
+        RenderCheckpoint checkpoint;
+        std::uint64_t sceneKey = getSceneFingerprint(world);
+        if (!checkpointFileName.empty() && loadCheckpoint(checkpointFileName, checkpoint)
+            && checkpoint.width == imageWidth && checkpoint.height == imageHeight && checkpoint.sceneKey == sceneKey) {
+            std::clog << "Resuming from " << checkpoint.sampleCount << " samples per pixel\n";
+        }
+        else {
+            checkpoint.width = imageWidth;
+            checkpoint.height = imageHeight;
+            checkpoint.sampleCount = 0;
+            checkpoint.sceneKey = sceneKey;
+            checkpoint.accumulation.assign(static_cast<size_t>(imageWidth) * imageHeight * 3, 0.0f);
+        }
+
+        auto startTime = std::chrono::steady_clock::now();
+        double secondsPerSample = 0;
+
+        while (checkpoint.sampleCount < samplesPerPixel) {
+            int passSamples = std::min(samplesPerPixel, std::max(1, checkpoint.sampleCount * 4)) - checkpoint.sampleCount;
+
+            // shrink the pass so it still fits into the time budget, judging by the previous pass
+            if (timeBudgetSeconds > 0) {
+                double remainingSeconds = timeBudgetSeconds - getSecondsSince(startTime);
+                if (remainingSeconds <= 0)
+                    break;
+                if (secondsPerSample > 0)
+                    passSamples = std::min(passSamples, static_cast<int>(remainingSeconds / secondsPerSample));
+                if (passSamples < 1)
+                    break;
+            }
+
+            auto passStartTime = std::chrono::steady_clock::now();
+            int firstSample = checkpoint.sampleCount;
+            runTiles(static_cast<int>(tiles.size()), [&](int tileIndex) {
+                const RenderTile& tile = tiles[tileIndex];
+                float* tileSums = &checkpoint.accumulation[(static_cast<size_t>(tile.minY) * imageWidth + tile.minX) * 3];
+                renderTileSamples(world, tile, firstSample, passSamples, tileSums, imageWidth);
+            });
+
+            checkpoint.sampleCount += passSamples;
+            secondsPerSample = getSecondsSince(passStartTime) / passSamples;
+
+            if (!checkpointFileName.empty() && !saveCheckpoint(checkpointFileName, checkpoint))
+                std::cerr << "ERROR: Could not write checkpoint file '" << checkpointFileName << "'.\n";
+
+            // keep a usable image around after every pass as well
+            resolveCheckpoint(checkpoint, outputFramebuffer);
+            if (!outputFileName.empty())
+                writeImage(outputFileName, outputFramebuffer, toneMapping);
+
+            std::clog << "\rPass finished: " << checkpoint.sampleCount << " samples per pixel after "
+                << getSecondsSince(startTime) << " s\n";
+        }
+
+        resolveCheckpoint(checkpoint, outputFramebuffer);
+    }
+
+    std::uint64_t getSceneFingerprint(const Hittable& world) const {
+        // A hash of everything that changes the samples: seed, sampler, path settings, camera and the
+        // world's box. Workers and resumed checkpoints build the scene again, so this is what they compare.
+        std::uint64_t fingerprint = getMixedBits(randomSeed);
+        auto addValue = [&fingerprint](double value) {
+            std::uint64_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            fingerprint = getMixedBits(fingerprint ^ bits);
+        };
+
+        addValue(static_cast<int>(samplerType));
+        addValue(maxDepth);
+        addValue(russianRouletteDepth);
+        addValue(isLightSampling ? 1 : 0);
+        addValue(verticalFOV);
+        addValue(defocusAngle);
+        addValue(focusDistance);
+        AABB worldBox = world.getBoundingBox();
+        for (int axis = 0; axis < 3; ++axis) {
+            addValue(backgroundColor[axis]);
+            addValue(lookFrom[axis]);
+            addValue(lookAt[axis]);
+            addValue(upVector[axis]);
+            addValue(worldBox.getAxisInterval(axis).min);
+            addValue(worldBox.getAxisInterval(axis).max);
+        }
+        return fingerprint;
+    }
+
+    RenderJob getRenderJob(const Hittable& world) const {
+        RenderJob job;
+        job.width = static_cast<std::uint32_t>(imageWidth);
+        job.height = static_cast<std::uint32_t>(imageHeight);
+        job.samplesPerPixel = static_cast<std::uint32_t>(samplesPerPixel);
+        job.tileSize = static_cast<std::uint32_t>(tileSize);
+        job.fingerprint = getSceneFingerprint(world);
+        return job;
+    }
+
+    bool renderCoordinator(const Hittable& world, const std::vector<RenderTile>& tiles, Framebuffer& outputFramebuffer) const {
+        // The coordinator traces nothing itself; it hands out leases of leaseSampleCount samples
+        // of one tile and sums up what the workers send back. Returns false if that failed.
+        RenderCoordinator coordinator(getRenderJob(world), tiles, leaseSampleCount, leaseTimeoutSeconds);
+        RenderCheckpoint result;
+        if (!coordinator.run(renderAddress, result.accumulation))
+            return false;
+
+        result.width = imageWidth;
+        result.height = imageHeight;
+        result.sampleCount = samplesPerPixel;
+        resolveCheckpoint(result, outputFramebuffer);
+        return true;
+    }
+
+    void renderWorker(const Hittable& world, const std::vector<RenderTile>& tiles) const {
+        // A lease covers a single tile, so its rows are split over the threads of this worker.
+        ThreadPool pool(threadCount);
+
+        runRenderWorker(renderAddress, getRenderJob(world), [&](const WorkUnit& unit, std::vector<float>& tileSums) {
+            const RenderTile& tile = tiles[unit.tileIndex];
+            int tileWidth = tile.maxX - tile.minX;
+            tileSums.assign(static_cast<size_t>(tileWidth) * (tile.maxY - tile.minY) * 3, 0.0f);
+
+            pool.run(tile.maxY - tile.minY, [&](int row) {
+                RenderTile rowTile{ tile.minX, tile.minY + row, tile.maxX, tile.minY + row + 1 };
+                renderTileSamples(world, rowTile, unit.firstSample, unit.sampleCount, &tileSums[static_cast<size_t>(row) * tileWidth * 3], tileWidth);
+            });
+        });
+    }
+
+    AOVBuffers renderAOVs(const Hittable& world, const std::vector<RenderTile>& tiles) const {
+        // Casts up to 16 jittered camera rays per pixel (the first samples of the pixel, so the buffers
+        // line up with the image) and averages what they hit first. Cheap next to the path tracing itself.
+        AOVBuffers aovs;
+        aovs.albedo = Framebuffer(imageWidth, imageHeight);
+        aovs.normal = Framebuffer(imageWidth, imageHeight);
+        aovs.depth = Framebuffer(imageWidth, imageHeight);
+        int sampleCount = std::max(1, std::min(samplesPerPixel, 16));
+
+        runTiles(static_cast<int>(tiles.size()), [&](int tileIndex) {
+            const RenderTile& tile = tiles[tileIndex];
+            for (int currentHeight = tile.minY; currentHeight < tile.maxY; ++currentHeight) {
+                for (int currentWidth = tile.minX; currentWidth < tile.maxX; ++currentWidth) {
+                    Color albedo(0, 0, 0);
+                    Vec3 normal(0, 0, 0);
+                    double depth = 0;
+
+                    for (int currentSample = 0; currentSample < sampleCount; ++currentSample) {
+                        startPixelSample(currentWidth, currentHeight, currentSample);
+                        Ray currentRay = getRayToSample(currentWidth, currentHeight);
+                        getRandomStream().setBounce(1);
+
+                        HitRecord record;
+                        bool isHitAnything = world.isHit(currentRay, Interval(0.001, RT_INFINITY), record);
+                        RT_RECORD_BVH_RAY(BVHRayKind::Primary);
+                        if (!isHitAnything) {
+                            albedo += backgroundColor;
+                            continue;
+                        }
+                        albedo += record.material->getAlbedo(record);
+                        normal += record.normalizedVector;
+                        depth += record.hitTime * currentRay.getDirection().getLength();
+                    }
+
+                    aovs.albedo.setPixel(currentWidth, currentHeight, albedo / sampleCount);
+                    aovs.normal.setPixel(currentWidth, currentHeight, normal / sampleCount);
+                    aovs.depth.setPixel(currentWidth, currentHeight, Color(depth, depth, depth) / sampleCount);
+                }
+            }
+        });
+
+        return aovs;
+    }
+
+    void writeAOVs(const AOVBuffers& aovs) const {
+        // AOVs are data, not pictures, so no tone mapping; a .pfm keeps them exact
+        if (!albedoFileName.empty() && !writeImage(albedoFileName, aovs.albedo, ToneMapping::Clamp))
+            std::cerr << "ERROR: Could not write albedo file '" << albedoFileName << "'.\n";
+        if (!normalFileName.empty() && !writeImage(normalFileName, aovs.normal, ToneMapping::Clamp))
+            std::cerr << "ERROR: Could not write normal file '" << normalFileName << "'.\n";
+        if (!depthFileName.empty() && !writeImage(depthFileName, aovs.depth, ToneMapping::Clamp))
+            std::cerr << "ERROR: Could not write depth file '" << depthFileName << "'.\n";
+    }
+
+    static void resolveCheckpoint(const RenderCheckpoint& checkpoint, Framebuffer& outputFramebuffer) {
+        if (checkpoint.sampleCount == 0)
+            return;
+
+        float scale = 1.0f / checkpoint.sampleCount;
+        for (size_t currentPixel = 0; currentPixel < outputFramebuffer.getPixelCount(); ++currentPixel) {
+            const float* sum = &checkpoint.accumulation[currentPixel * 3];
+            outputFramebuffer[currentPixel] = Color(scale * sum[0], scale * sum[1], scale * sum[2]);
+        }
+    }
+
+    void renderAdaptive(const Hittable& world, const std::vector<RenderTile>& tiles, Framebuffer& outputFramebuffer) const {
+        Framebuffer variance(imageWidth, imageHeight);
+        std::atomic<long long> totalSampleCount(0);
+
+        runTiles(static_cast<int>(tiles.size()), [&](int tileIndex) {
+            totalSampleCount += renderTileAdaptive(world, tiles[tileIndex], outputFramebuffer, variance);
+        });
+
+        std::clog << "\rAdaptive sampling: " << static_cast<double>(totalSampleCount) / outputFramebuffer.getPixelCount()
+            << " samples per pixel on average (bounds " << minSamplesPerPixel << " - " << samplesPerPixel << ")\n";
+
+        // the variance is linear data, so it is written as is
+        if (!varianceFileName.empty() && !writeImage(varianceFileName, variance, ToneMapping::Clamp))
+            std::cerr << "ERROR: Could not write variance file '" << varianceFileName << "'.\n";
+    }
+
+    long long renderTileAdaptive(const Hittable& world, const RenderTile& tile, Framebuffer& outputFramebuffer, Framebuffer& variance) const {
+        // Every pixel takes minSamplesPerPixel samples and then keeps going in batches while the standard error
+        // of its mean luminance (from a running Welford mean/variance) is above adaptiveThreshold * mean.
+        // Returns the number of samples taken for the whole tile.
+
+        int minSamples = std::max(1, std::min(minSamplesPerPixel, samplesPerPixel));
+        int batchSize = std::max(1, minSamples / 2);
+        long long tileSampleCount = 0;
+
+        for (int currentHeight = tile.minY; currentHeight < tile.maxY; ++currentHeight) {
+            for (int currentWidth = tile.minX; currentWidth < tile.maxX; ++currentWidth) {
+                Color pixelColor(0, 0, 0);
+                double mean = 0, squaredDifferenceSum = 0;
+                int sampleCount = 0;
+                int nextCheck = minSamples;
+
+                while (sampleCount < samplesPerPixel) {
+                    startPixelSample(currentWidth, currentHeight, sampleCount);
+                    Ray currentRay = getRayToSample(currentWidth, currentHeight);
+                    Color sampleColor = getRayColor(currentRay, maxDepth, world);
+                    pixelColor += sampleColor;
+
+                    ++sampleCount;
+                    double luminance = getLuminance(sampleColor);
+                    double delta = luminance - mean;
+                    mean += delta / sampleCount;
+                    squaredDifferenceSum += delta * (luminance - mean);
+
+                    if (sampleCount < nextCheck)
+                        continue;
+                    nextCheck += batchSize;
+
+                    double varianceOfMean = (sampleCount > 1) ? squaredDifferenceSum / ((sampleCount - 1.0) * sampleCount) : 0;
+                    if (std::sqrt(varianceOfMean) <= adaptiveThreshold * std::fmax(mean, 1e-3))
+                        break;
+                }
+
+                double varianceOfMean = (sampleCount > 1) ? squaredDifferenceSum / ((sampleCount - 1.0) * sampleCount) : 0;
+                outputFramebuffer.setPixel(currentWidth, currentHeight, pixelColor / sampleCount);
+                variance.setPixel(currentWidth, currentHeight, Color(varianceOfMean, varianceOfMean, varianceOfMean));
+                tileSampleCount += sampleCount;
+            }
+        }
+
+        return tileSampleCount;
+    }
+
+    static double getLuminance(const Color& color) {
+        return 0.2126 * color.getX() + 0.7152 * color.getY() + 0.0722 * color.getZ();
+    }
+
+    static double getSecondsSince(std::chrono::steady_clock::time_point startTime) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    }
+
+    std::vector<RenderTile> getTiles() const {
+        // Split the image into tiles in scanline order; the ones on the right and bottom edges may be smaller.
+        int size = (tileSize < 1) ? 1 : tileSize;
+        std::vector<RenderTile> tiles;
+
+        for (int y = 0; y < imageHeight; y += size)
+            for (int x = 0; x < imageWidth; x += size)
+                tiles.push_back(RenderTile{ x, y, std::min(x + size, imageWidth), std::min(y + size, imageHeight) });
+
+        return tiles;
+    }
+
+    void startPixelSample(int currentWidth, int currentHeight, int sampleIndex) const {
+        // Key the thread's random stream for this camera path; see RandomStream.
+        auto pixelIndex = static_cast<std::uint64_t>(currentHeight) * imageWidth + currentWidth;
+        getRandomStream().setPixelSample(randomSeed, pixelIndex, static_cast<std::uint64_t>(sampleIndex), &getSampler(samplerType));
+    }
+
+    void renderTile(const Hittable& world, const RenderTile& tile, Framebuffer& outputFramebuffer) const {
+        for (int currentHeight = tile.minY; currentHeight < tile.maxY; ++currentHeight) {
+            for (int currentWidth = tile.minX; currentWidth < tile.maxX; ++currentWidth) {
+                Color pixelColor(0, 0, 0);
+
+                // the sampler spreads any number of samples evenly over the pixel
+                for (int currentSample = 0; currentSample < samplesPerPixel; ++currentSample) {
+                    startPixelSample(currentWidth, currentHeight, currentSample);
+                    Ray currentRay = getRayToSample(currentWidth, currentHeight);
+                    pixelColor += getRayColor(currentRay, maxDepth, world);
+                }
+                outputFramebuffer.setPixel(currentWidth, currentHeight, pixelSamplesScale * pixelColor);
+            }
+        }
+    }
+
+    void renderTileWavefront(const Hittable& world, const RenderTile& tile, Framebuffer& outputFramebuffer) const {
+        // Same samples as renderTile, but all camera rays of the tile are generated up front and
+        // handed to the wavefront engine in batches of wavefrontBatchSize. Every path carries its
+        // own random stream, so the result is identical to renderTile.
+        int tileWidth = tile.maxX - tile.minX;
+        std::vector<Color> pixelColors(static_cast<size_t>(tileWidth) * (tile.maxY - tile.minY));
+        std::vector<Ray> cameraRays;
+        std::vector<RandomStream> rayStreams;   // random stream of every camera path
+        std::vector<int> rayPixels;             // tile-local pixel of every camera ray
+        std::vector<Color> pathColors;
+        WavefrontIntegrator integrator(world, lightSampler, backgroundColor, maxDepth, russianRouletteDepth);
+
+        auto traceBatch = [&]() {
+            integrator.trace(cameraRays, rayStreams, pathColors);
+            for (size_t currentRay = 0; currentRay < cameraRays.size(); ++currentRay)
+                pixelColors[rayPixels[currentRay]] += pathColors[currentRay];
+            cameraRays.clear();
+            rayStreams.clear();
+            rayPixels.clear();
+        };
+
+        for (int currentHeight = tile.minY; currentHeight < tile.maxY; ++currentHeight) {
+            for (int currentWidth = tile.minX; currentWidth < tile.maxX; ++currentWidth) {
+                int pixelIndex = (currentHeight - tile.minY) * tileWidth + (currentWidth - tile.minX);
+                for (int currentSample = 0; currentSample < samplesPerPixel; ++currentSample) {
+                    startPixelSample(currentWidth, currentHeight, currentSample);
+                    cameraRays.push_back(getRayToSample(currentWidth, currentHeight));
+                    rayStreams.push_back(getRandomStream());
+                    rayPixels.push_back(pixelIndex);
+                    if (static_cast<int>(cameraRays.size()) >= wavefrontBatchSize)
+                        traceBatch();
+                }
+            }
+        }
+        if (!cameraRays.empty())
+            traceBatch();
+
+        for (int currentHeight = tile.minY; currentHeight < tile.maxY; ++currentHeight)
+            for (int currentWidth = tile.minX; currentWidth < tile.maxX; ++currentWidth)
+                outputFramebuffer.setPixel(currentWidth, currentHeight,
+                    pixelSamplesScale * pixelColors[(currentHeight - tile.minY) * tileWidth + (currentWidth - tile.minX)]);
+
+        PathStatistics& threadStatistics = getThreadPathStatistics();
+        threadStatistics.pathCount += integrator.getPathCount();
+        threadStatistics.segmentCount += integrator.getSegmentCount();
+    }
+
+    void renderTileSamples(const Hittable& world, const RenderTile& tile, int firstSample, int sampleCount, float* tileSums, int rowStride) const {
+        // Adds sampleCount more samples to every pixel of the tile. tileSums points at the r, g, b sums of the
+        // tile's top left pixel and rows are rowStride pixels apart. The sampler's sequences continue
+        // where the previous pass stopped, so the passes add up to one well spread set of samples.
+        for (int currentHeight = tile.minY; currentHeight < tile.maxY; ++currentHeight) {
+            for (int currentWidth = tile.minX; currentWidth < tile.maxX; ++currentWidth) {
+                Color pixelColor(0, 0, 0);
+                for (int currentSample = 0; currentSample < sampleCount; ++currentSample) {
+                    startPixelSample(currentWidth, currentHeight, firstSample + currentSample);
+                    Ray currentRay = getRayToSample(currentWidth, currentHeight);
+                    pixelColor += getRayColor(currentRay, maxDepth, world);
+                }
+
+                float* sum = &tileSums[(static_cast<size_t>(currentHeight - tile.minY) * rowStride + (currentWidth - tile.minX)) * 3];
+                sum[0] += static_cast<float>(pixelColor.getX());
+                sum[1] += static_cast<float>(pixelColor.getY());
+                sum[2] += static_cast<float>(pixelColor.getZ());
+            }
+        }
+    }
+
+    Ray getRayToSample(int currentWidth, int currentHeight) const {
+        // Construct a camera ray originating from the defocus disk and directed at a randomly
+        // sampled point anywhere inside the pixel location currentWidth, currentHeight.
+        getRandomStream().setDimension(PIXEL_OFFSET_DIMENSION);
+        auto offset = getSampleSquare();
         auto pixelSample = pixelCenterTopLeft
             + ((currentWidth + offset.getX()) * pixelDeltaWidth)
             + ((currentHeight + offset.getY()) * pixelDeltaHeight);
 
+        getRandomStream().setDimension(LENS_DIMENSION);
         auto rayOrigin = (defocusAngle <= 0) ? center : getDefocusRandomPoint();
         auto rayDirection = pixelSample - rayOrigin;
+        getRandomStream().setDimension(TIME_DIMENSION);
         auto rayTime = getRandomDouble();
 
         return Ray(rayOrigin, rayDirection, rayTime);
@@ -120,44 +611,90 @@ private:
         // Returns the vector to a random point in the [-.5,-.5]-[+.5,+.5] unit square.
         return Vec3(getRandomDouble(0, 1) - 0.5, getRandomDouble(0, 1) - 0.5, 0);
     }
-    Vec3 getSampleSquareStratified(int currentSampleRow, int currentSampleCol) const {
-        // Returns the vector to a random point in the square sub-pixel specified by grid
-        // indices currentSampleRow and currentSampleCol, for an idealized unit square pixel [-.5,-.5] to [+.5,+.5].
-        auto x = ((currentSampleCol + getRandomDouble()) / sqrtSamplesPerPixels) - 0.5;
-        auto y = ((currentSampleRow + getRandomDouble()) / sqrtSamplesPerPixels) - 0.5;
-
-        return Vec3(x, y, 0);
-    }
 
 
     Color getRayColor(const Ray& inputRay, int depth, const Hittable& world) const {
-        // if the ray keeps being reflected, then return black for that pixel
-        if (depth <= 0)
-            return Color(0, 0, 0);
+        // Iterative path tracer: instead of recursing once per bounce, carry the product of all
+        // attenuations so far (throughput) along the path. After russianRouletteDepth bounces a path
+        // survives with probability max(throughput) and is reweighted by 1 / probability,
+        // which keeps the estimate unbiased while ending paths that can barely contribute.
+        // Non-specular hits also sample the lights directly; that estimate and the emission the next
+        // scattered ray finds are weighted against each other with multiple importance sampling.
+        Color pathColor(0, 0, 0);
+        Color throughput(1, 1, 1);
+        Ray currentRay = inputRay;
+        int bounce = 0;
+        bool isPreviousLightSampled = false;
+        Point3 previousPosition;
+        double previousScatteringPdf = 0;
+
+        // if the ray keeps being reflected, then it gets nothing more after depth bounces
+        while (bounce < depth) {
+            ++bounce;
+            getRandomStream().setBounce(bounce);
+
+            HitRecord record;
+            bool isHitAnything = world.isHit(currentRay, Interval(0.001, RT_INFINITY), record);
+            RT_RECORD_BVH_RAY(bounce == 1 ? BVHRayKind::Primary : BVHRayKind::Secondary);
+            // If the ray hits nothing, add the background color.
+            if (!isHitAnything) {
+                pathColor += throughput * backgroundColor;
+                break;
+            }
+
+            ScatterRecord scatterRecord;
+            Color emittedColor = record.material->getEmittedColor(record.u, record.v, record.hitPosition);
+            if (isPreviousLightSampled && record.material->isEmissive())
+                emittedColor *= lightSampler.getEmissionWeight(previousPosition, currentRay.getDirection(), currentRay.getTime(), previousScatteringPdf);
+            pathColor += throughput * emittedColor;
+
+            // Sample the lights before checking for absorption: a fuzzy Metal absorbs the part of its
+            // lobe below the surface, but still reflects the light arriving from above.
+            getRandomStream().setDimension(SCATTERING_DIMENSION);
+            bool isScattered = record.material->doesScatter(currentRay, record, scatterRecord);
+            isPreviousLightSampled = !lightSampler.isEmpty() && !scatterRecord.isSpecular;
+            if (isPreviousLightSampled) {
+                pathColor += throughput * lightSampler.sampleDirectLight(world, currentRay, record);
+                previousPosition = record.hitPosition;
+                previousScatteringPdf = scatterRecord.pdf;
+            }
+
+            if (!isScattered)
+                break;
 
-        HitRecord record;
-        // If the ray hits nothing, return the background color.
-        if (!world.isHit(inputRay, Interval(0.001, RT_INFINITY), record))
-            return backgroundColor;
+            throughput = throughput * scatterRecord.attenuation;
 
-        Ray scattered;
-        Color attenuation;
-        Color emittedColor = record.material->getEmittedColor(record.u, record.v, record.hitPosition);
-        if (!record.material->doesScatter(inputRay, record, attenuation, scattered))
-            return emittedColor;         // only light material returns false for doesScatter()
+            if (bounce >= russianRouletteDepth) {
+                double survivalProbability = getRussianRouletteSurvival(throughput);
+                getRandomStream().setDimension(RUSSIAN_ROULETTE_DIMENSION);
+                if (getRandomDouble() >= survivalProbability)
+                    break;
+                throughput /= survivalProbability;
+            }
+
+            currentRay = scatterRecord.scatteredRay;
+        }
 
-        // handle other materials
-        Color scatteredColor = attenuation * getRayColor(scattered, depth - 1, world);
+        PathStatistics& threadStatistics = getThreadPathStatistics();
+        ++threadStatistics.pathCount;
+        threadStatistics.segmentCount += bounce;
 
+        return pathColor;
+    }
 
-        // so far, the emittedColor is zero
-        return emittedColor + scatteredColor;
+    static PathStatistics& getThreadPathStatistics() {
+        // counted per thread without locking and folded into pathStatistics after every tile
+        thread_local PathStatistics statistics;
+        return statistics;
     }
 
 
+    Framebuffer framebuffer;                // Linear colors of the last render
+    LightSampler lightSampler;              // Emitters of the scene being rendered
+    mutable PathStatistics pathStatistics;  // Paths traced by the last render, guarded by the tile progress lock
+    mutable BVHRayStatistics bvhRayStatistics;  // Traversal work per ray of the last render (RT_BVH_STATISTICS), same lock
     int    imageHeight;                     // Rendered image height
     double pixelSamplesScale;               // Color scale factor for a sum of pixel samples
-    int    sqrtSamplesPerPixels;            // Square root of number of samples per pixel
 
     Point3 center;                          // Camera center
     Point3 pixelCenterTopLeft;              // Location of pixel 0, 0
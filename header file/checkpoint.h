@@ -0,0 +1,89 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Snapshot of a progressive render: the running sum of every sample taken so far, per pixel.
+// Dividing accumulation by sampleCount gives the current image.
+struct RenderCheckpoint {
+    int width = 0;
+    int height = 0;
+    int sampleCount = 0;                // samples per pixel already accumulated
+    std::uint64_t sceneKey = 0;         // hash of the seed, camera and scene the samples belong to
+    std::vector<float> accumulation;    // width * height * 3 floats (r, g, b), scanline order
+};
+
+constexpr std::uint32_t CHECKPOINT_MAGIC = 0x4B435452;     // "RTCK"
+constexpr std::uint32_t CHECKPOINT_VERSION = 2;
+
+inline bool saveCheckpoint(const std::string& fileName, const RenderCheckpoint& checkpoint) {
+    // Write to a temporary file first and rename it afterwards, so a crash while writing
+    // never destroys the previous checkpoint.
+    auto temporaryFileName = fileName + ".tmp";
+    {
+        std::ofstream out(temporaryFileName, std::ios::binary | std::ios::trunc);
+        if (!out)
+            return false;
+
+        std::uint32_t header[5] = {
+            CHECKPOINT_MAGIC, CHECKPOINT_VERSION,
+            static_cast<std::uint32_t>(checkpoint.width),
+            static_cast<std::uint32_t>(checkpoint.height),
+            static_cast<std::uint32_t>(checkpoint.sampleCount)
+        };
+        out.write(reinterpret_cast<const char*>(header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(&checkpoint.sceneKey), sizeof(checkpoint.sceneKey));
+        out.write(reinterpret_cast<const char*>(checkpoint.accumulation.data()), checkpoint.accumulation.size() * sizeof(float));
+        if (!out)
+            return false;
+    }
+
+    // replaces the old checkpoint in one step (MoveFileEx with MOVEFILE_REPLACE_EXISTING on Windows)
+    std::error_code error;
+    std::filesystem::rename(temporaryFileName, fileName, error);
+    return !error;
+}
+
+inline bool loadCheckpoint(const std::string& fileName, RenderCheckpoint& checkpoint) {
+    // Returns false if the file is missing, truncated, has an invalid size or was written by another format version.
+    std::ifstream in(fileName, std::ios::binary);
+    if (!in)
+        return false;
+
+    std::uint32_t header[5];
+    if (!in.read(reinterpret_cast<char*>(header), sizeof(header)))
+        return false;
+    if (header[0] != CHECKPOINT_MAGIC || header[1] != CHECKPOINT_VERSION)
+        return false;
+
+    RenderCheckpoint loaded;
+    loaded.width = static_cast<int>(header[2]);
+    loaded.height = static_cast<int>(header[3]);
+    loaded.sampleCount = static_cast<int>(header[4]);
+    if (!in.read(reinterpret_cast<char*>(&loaded.sceneKey), sizeof(loaded.sceneKey)))
+        return false;
+    if (loaded.width <= 0 || loaded.height <= 0)
+        return false;
+
+    // check the pixels fit in the rest of the file before allocating room for them
+    auto dataStart = in.tellg();
+    in.seekg(0, std::ios::end);
+    auto dataSize = static_cast<std::uint64_t>(in.tellg() - dataStart);
+    in.seekg(dataStart);
+    auto floatCount = static_cast<std::uint64_t>(loaded.width) * static_cast<std::uint64_t>(loaded.height) * 3;
+    if (!in || floatCount > dataSize / sizeof(float))
+        return false;
+    loaded.accumulation.resize(static_cast<size_t>(floatCount));
+
+    if (!in.read(reinterpret_cast<char*>(loaded.accumulation.data()), loaded.accumulation.size() * sizeof(float)))
+        return false;
+
+    checkpoint = std::move(loaded);
+    return true;
+}
+
+#endif
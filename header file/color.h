@@ -6,6 +6,11 @@
 
 using Color = Vec3;
 
+enum class ToneMapping {
+    Clamp,          // values above 1 are clipped
+    Reinhard        // c / (1 + c), compresses highlights instead of clipping them
+};
+
 inline double convertLinearToGamma(double linearComponent) {
     if (linearComponent > 0)
         return std::sqrt(linearComponent);
@@ -13,26 +18,16 @@ inline double convertLinearToGamma(double linearComponent) {
     return 0;
 }
 
-
-void writeColor(std::ostream& out, const Color& pixelColor) {
-    auto r = pixelColor.getX();
-    auto g = pixelColor.getY();
-    auto b = pixelColor.getZ();
+inline unsigned char convertLinearToByte(double linearComponent, ToneMapping toneMapping) {
+    if (toneMapping == ToneMapping::Reinhard && linearComponent > 0)
+        linearComponent = linearComponent / (1 + linearComponent);
 
     // Aply gamma translation
-    r = convertLinearToGamma(r);
-    g = convertLinearToGamma(g);
-    b = convertLinearToGamma(b);
+    auto gammaComponent = convertLinearToGamma(linearComponent);
 
     // Translate the [0,1] component values to the byte range [0,255].
     static const Interval intensity(0.000, 0.999);
-    int rbyte = static_cast<int>(256 * intensity.clamp(r));
-    int gbyte = static_cast<int>(256 * intensity.clamp(g));
-    int bbyte = static_cast<int>(256 * intensity.clamp(b));
-
-
-    // Write out the pixel color components.
-    out << rbyte << ' ' << gbyte << ' ' << bbyte << '\n';
+    return static_cast<unsigned char>(256 * intensity.clamp(gammaComponent));
 }
 
 #endif
@@ -16,6 +16,36 @@ public:
     {}
 
     bool isHit(const Ray& inputRay, Interval timeIntervalToCheck, HitRecord& record) const override {
+        double scatteringTime;
+        if (!getScatteringTime(inputRay, timeIntervalToCheck, scatteringTime))
+            return false;
+
+        // update hit information to the scattering point
+        record.hitTime = scatteringTime;
+        record.hitPosition = inputRay.getPosition(record.hitTime);
+
+        record.normalizedVector = Vec3(1, 0, 0);    // arbitrary
+        record.isFrontFace = true;                  // also arbitrary
+        record.material = phaseFunction;            // because phaseFunction handles the random direction
+
+        return true;
+    }
+
+    bool isOccluded(const Ray& inputRay, Interval timeIntervalToCheck) const override {
+        // a ray that scatters inside the interval doesn't get through: one sample of the transmittance
+        double scatteringTime;
+        return getScatteringTime(inputRay, timeIntervalToCheck, scatteringTime);
+    }
+
+    AABB getBoundingBox() const override { return boundary->getBoundingBox(); }
+    AABB getBoundingBoxAtTime(double time) const override { return boundary->getBoundingBoxAtTime(time); }
+
+    void refit() override { boundary->refit(); }
+    int rebuildDegradedSubtrees(double rebuildThreshold) override { return boundary->rebuildDegradedSubtrees(rebuildThreshold); }
+    void collectTreeStatistics(std::vector<BVHTreeStatistics>& statistics) const override { boundary->collectTreeStatistics(statistics); }
+
+private:
+    bool getScatteringTime(const Ray& inputRay, Interval timeIntervalToCheck, double& scatteringTime) const {
         HitRecord firstIntersectionRecord, secondIntersectionRecord;
 
         if (!boundary->isHit(inputRay, Interval::universe, firstIntersectionRecord))
@@ -35,26 +65,16 @@ public:
 
         auto rayLengthTimeOne = inputRay.getDirection().getLength();
         auto distanceIntersections = (secondIntersectionRecord.hitTime - firstIntersectionRecord.hitTime) * rayLengthTimeOne;          // distance between two intersection points
-        auto distanceScattering = negativeInverseDensity * std::log(getRandomDouble());         // distance between first intersection and the point 
+        auto distanceScattering = negativeInverseDensity * std::log(getRandomStream().getHashedDouble());         // distance between first intersection and the point 
                                                                                                 //  where the ray starts to be scattered
 
         if (distanceScattering > distanceIntersections)
             return false;
 
-        // update hit information to the scattering point
-        record.hitTime = firstIntersectionRecord.hitTime + distanceScattering / rayLengthTimeOne;
-        record.hitPosition = inputRay.getPosition(record.hitTime);
-
-        record.normalizedVector = Vec3(1, 0, 0);    // arbitrary
-        record.isFrontFace = true;                  // also arbitrary
-        record.material = phaseFunction;            // because phaseFunction handles the random direction
-
+        scatteringTime = firstIntersectionRecord.hitTime + distanceScattering / rayLengthTimeOne;
         return true;
     }
 
-    AABB getBoundingBox() const override { return boundary->getBoundingBox(); }
-
-private:
     std::shared_ptr<Hittable> boundary;
     double negativeInverseDensity;
     std::shared_ptr<Material> phaseFunction;
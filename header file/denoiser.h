@@ -0,0 +1,130 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include "framebuffer.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Auxiliary buffers (AOVs) of the first camera hit, averaged over the samples of each pixel.
+// Pixels whose rays all miss the scene have the background as albedo and zero normal and depth.
+struct AOVBuffers {
+    Framebuffer albedo;     // reflectance of the surface, from its texture
+    Framebuffer normal;     // shading normal, facing the camera, in world space
+    Framebuffer depth;      // distance from the camera in all three channels
+};
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010). Every iteration is a 5x5 B3 spline
+// blur whose taps are spread 2^iteration pixels apart, so a handful of cheap passes covers a large
+// footprint. Taps across edges of the AOVs (albedo, normal, depth) or of the color itself are
+// weighted down, which removes Monte Carlo noise without blurring over geometry or texture.
+// Filtering happens on the color divided by the albedo, so texture detail is put back unfiltered.
+class ATrousDenoiser {
+public:
+    ATrousDenoiser(int inputIterations) : iterations(inputIterations) {}
+
+    Framebuffer denoise(const Framebuffer& color, const AOVBuffers& aovs, int threadCount) const {
+        int width = color.getWidth();
+        int height = color.getHeight();
+
+        Framebuffer current(width, height);
+        for (size_t currentPixel = 0; currentPixel < color.getPixelCount(); ++currentPixel)
+            current[currentPixel] = getDemodulated(color[currentPixel], aovs.albedo[currentPixel]);
+
+        Framebuffer filtered(width, height);
+        ThreadPool pool(threadCount);
+        double colorSigma = initialColorSigma;
+
+        for (int currentIteration = 0; currentIteration < iterations; ++currentIteration) {
+            int stepSize = 1 << currentIteration;
+            pool.run(height, [&](int row) {
+                for (int column = 0; column < width; ++column)
+                    filtered.setPixel(column, row, filterPixel(current, aovs, column, row, stepSize, colorSigma));
+            });
+            std::swap(current, filtered);
+
+            // Later passes see less noise, so color edges may stop them sooner.
+            colorSigma *= colorSigmaFalloff;
+        }
+
+        for (size_t currentPixel = 0; currentPixel < current.getPixelCount(); ++currentPixel)
+            current[currentPixel] = current[currentPixel] * getDemodulationAlbedo(aovs.albedo[currentPixel]);
+        return current;
+    }
+
+private:
+    static Color getDemodulationAlbedo(const Color& albedo) {
+        // black albedo channels can't be divided out; those keep the color as it is
+        return Color(albedo.getX() > 1e-3 ? albedo.getX() : 1,
+                     albedo.getY() > 1e-3 ? albedo.getY() : 1,
+                     albedo.getZ() > 1e-3 ? albedo.getZ() : 1);
+    }
+
+    static Color getDemodulated(const Color& color, const Color& albedo) {
+        Color divisor = getDemodulationAlbedo(albedo);
+        return Color(color.getX() / divisor.getX(), color.getY() / divisor.getY(), color.getZ() / divisor.getZ());
+    }
+
+    static Color getCompressed(const Color& color) {
+        // Reinhard curve, so bright emitters don't make every color difference look like an edge
+        return Color(color.getX() / (1 + color.getX()), color.getY() / (1 + color.getY()), color.getZ() / (1 + color.getZ()));
+    }
+
+    Color filterPixel(const Framebuffer& color, const AOVBuffers& aovs, int column, int row, int stepSize, double colorSigma) const {
+        static const double kernel[3] = { 3.0 / 8.0, 1.0 / 4.0, 1.0 / 16.0 };
+
+        const Color& centerColor = color.getPixel(column, row);
+        Color compressedCenter = getCompressed(centerColor);
+        const Color& centerAlbedo = aovs.albedo.getPixel(column, row);
+        const Color& centerNormal = aovs.normal.getPixel(column, row);
+        double centerDepth = aovs.depth.getPixel(column, row).getX();
+
+        Color colorSum(0, 0, 0);
+        double weightSum = 0;
+
+        for (int offsetY = -2; offsetY <= 2; ++offsetY) {
+            int tapRow = row + offsetY * stepSize;
+            if (tapRow < 0 || tapRow >= color.getHeight())
+                continue;
+
+            for (int offsetX = -2; offsetX <= 2; ++offsetX) {
+                int tapColumn = column + offsetX * stepSize;
+                if (tapColumn < 0 || tapColumn >= color.getWidth())
+                    continue;
+
+                const Color& tapColor = color.getPixel(tapColumn, tapRow);
+                double colorDistance = (getCompressed(tapColor) - compressedCenter).getLengthSquared();
+                double albedoDistance = (aovs.albedo.getPixel(tapColumn, tapRow) - centerAlbedo).getLengthSquared();
+                double normalDistance = (aovs.normal.getPixel(tapColumn, tapRow) - centerNormal).getLengthSquared();
+
+                double tapDepth = aovs.depth.getPixel(tapColumn, tapRow).getX();
+                double depthScale = std::max(std::max(centerDepth, tapDepth), 1e-8);
+                double depthDistance = (tapDepth - centerDepth) / depthScale;     // relative, so it works at any scene scale
+
+                double weight = kernel[std::abs(offsetX)] * kernel[std::abs(offsetY)]
+                    * std::exp(-colorDistance / (colorSigma * colorSigma)
+                               - albedoDistance / (albedoSigma * albedoSigma)
+                               - normalDistance / (normalSigma * normalSigma)
+                               - depthDistance * depthDistance / (depthSigma * depthSigma));
+
+                colorSum += weight * tapColor;
+                weightSum += weight;
+            }
+        }
+
+        // the center tap always has weight, so weightSum > 0
+        return colorSum / weightSum;
+    }
+
+    int iterations;
+
+    // edge stopping widths
+    double initialColorSigma = 1.0;
+    double colorSigmaFalloff = 0.5;     // per iteration
+    double albedoSigma = 0.1;
+    double normalSigma = 0.3;
+    double depthSigma = 0.05;
+};
+
+#endif
@@ -0,0 +1,573 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "render_tile.h"
+
+#ifndef _WIN32
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// Distributed rendering: one coordinator process owns the image and leases work units (one tile, a range
+// of its samples) to any number of worker processes, which build the same scene and send back the float
+// sums of their samples. Addresses are "unix:<socket path>" or "<host>:<port>" for TCP.
+//
+// Protocol: every message is a MessageHeader followed by payloadSize bytes, in the byte order of the
+// machines (the farm is assumed to be all little-endian or all big-endian).
+//   worker      -> coordinator   Hello   RenderJob of the worker, must match the coordinator's
+//   coordinator -> worker        Lease   LeaseMessage; the worker answers with Result
+//   worker      -> coordinator   Result  leaseId, then tile width * tile height * 3 floats
+//   coordinator -> worker        Finished / Rejected
+// A worker that disconnects or holds a lease for longer than the lease timeout loses the lease, and the
+// unit goes back to the front of the queue.
+
+enum class RenderRole {
+    Local,          // render everything in this process
+    Coordinator,    // lease the image out to workers and write the result
+    Worker          // render leases of a coordinator; writes no image
+};
+
+struct WorkUnit {
+    int tileIndex;
+    int firstSample;    // sample index of the first sample in every pixel of the tile
+    int sampleCount;
+};
+
+struct RenderJob {
+    // Everything both sides must agree on for the returned sums to fit together.
+    std::uint32_t width = 0;
+    std::uint32_t height = 0;
+    std::uint32_t samplesPerPixel = 0;
+    std::uint32_t tileSize = 0;
+    std::uint64_t fingerprint = 0;  // scene and camera settings; see Camera::getRenderJob()
+
+    bool operator==(const RenderJob& other) const {
+        return width == other.width && height == other.height && samplesPerPixel == other.samplesPerPixel
+            && tileSize == other.tileSize && fingerprint == other.fingerprint;
+    }
+};
+
+enum class MessageType : std::uint32_t {
+    Hello = 1,
+    Lease,
+    Result,
+    Finished,
+    Rejected
+};
+
+struct MessageHeader {
+    std::uint32_t type;
+    std::uint32_t payloadSize;
+};
+
+struct LeaseMessage {
+    std::uint32_t leaseId;
+    std::int32_t tileIndex;
+    std::int32_t firstSample;
+    std::int32_t sampleCount;
+};
+
+constexpr std::uint32_t DISTRIBUTED_MAGIC = 0x4C445452;     // "RTDL"
+constexpr std::uint32_t DISTRIBUTED_VERSION = 1;
+
+
+#ifndef _WIN32
+
+class SocketConnection {
+public:
+    // Owns one connected stream socket and sends and receives whole messages on it.
+    SocketConnection() {}
+    explicit SocketConnection(int inputDescriptor) : descriptor(inputDescriptor) {}
+    SocketConnection(const SocketConnection&) = delete;
+    SocketConnection& operator=(const SocketConnection&) = delete;
+    SocketConnection(SocketConnection&& other) noexcept : descriptor(other.descriptor) { other.descriptor = -1; }
+    SocketConnection& operator=(SocketConnection&& other) noexcept {
+        if (this != &other) {
+            close();
+            descriptor = other.descriptor;
+            other.descriptor = -1;
+        }
+        return *this;
+    }
+    ~SocketConnection() { close(); }
+
+    bool isOpen() const { return descriptor >= 0; }
+    int getDescriptor() const { return descriptor; }
+
+    void close() {
+        if (descriptor >= 0)
+            ::close(descriptor);
+        descriptor = -1;
+    }
+
+    void setReceiveTimeout(double seconds) {
+        // so a peer that stops in the middle of a message can't block us forever
+        timeval timeout;
+        timeout.tv_sec = static_cast<long>(seconds);
+        timeout.tv_usec = static_cast<long>((seconds - timeout.tv_sec) * 1e6);
+        setsockopt(descriptor, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+
+    bool sendMessage(MessageType type, const void* payload, size_t payloadSize) {
+        MessageHeader header = { static_cast<std::uint32_t>(type), static_cast<std::uint32_t>(payloadSize) };
+        return sendAll(&header, sizeof(header)) && sendAll(payload, payloadSize);
+    }
+
+    bool sendMessage(MessageType type, const std::vector<unsigned char>& payload) {
+        return sendMessage(type, payload.data(), payload.size());
+    }
+
+    bool receiveMessage(MessageType& type, std::vector<unsigned char>& payload, size_t maxPayloadSize) {
+        // Returns false if the connection was closed, broke or timed out. A header announcing more than
+        // maxPayloadSize bytes can't come from a valid peer, so the connection is closed instead of
+        // allocating whatever it asks for.
+        MessageHeader header;
+        if (!receiveAll(&header, sizeof(header)))
+            return false;
+        if (header.payloadSize > maxPayloadSize) {
+            close();
+            return false;
+        }
+        type = static_cast<MessageType>(header.type);
+        payload.resize(header.payloadSize);
+        return receiveAll(payload.data(), payload.size());
+    }
+
+private:
+    bool sendAll(const void* data, size_t size) {
+        const char* current = static_cast<const char*>(data);
+        while (size > 0) {
+#ifdef MSG_NOSIGNAL
+            ssize_t sent = ::send(descriptor, current, size, MSG_NOSIGNAL);     // a dead peer is an error, not SIGPIPE
+#else
+            ssize_t sent = ::send(descriptor, current, size, 0);
+#endif
+            if (sent <= 0)
+                return false;
+            current += sent;
+            size -= static_cast<size_t>(sent);
+        }
+        return true;
+    }
+
+    bool receiveAll(void* data, size_t size) {
+        char* current = static_cast<char*>(data);
+        while (size > 0) {
+            ssize_t received = ::recv(descriptor, current, size, 0);
+            if (received <= 0)
+                return false;
+            current += received;
+            size -= static_cast<size_t>(received);
+        }
+        return true;
+    }
+
+    int descriptor = -1;
+};
+
+inline bool getSocketAddress(const std::string& address, bool isListening, sockaddr_storage& socketAddress, socklen_t& addressLength) {
+    // "unix:<path>" or "<host>:<port>"; an empty host listens on every interface.
+    std::memset(&socketAddress, 0, sizeof(socketAddress));
+
+    if (address.compare(0, 5, "unix:") == 0) {
+        std::string path = address.substr(5);
+        sockaddr_un unixAddress;
+        std::memset(&unixAddress, 0, sizeof(unixAddress));
+        if (path.empty() || path.size() >= sizeof(unixAddress.sun_path))
+            return false;
+
+        unixAddress.sun_family = AF_UNIX;
+        std::memcpy(unixAddress.sun_path, path.c_str(), path.size());
+        std::memcpy(&socketAddress, &unixAddress, sizeof(unixAddress));
+        addressLength = sizeof(unixAddress);
+        return true;
+    }
+
+    auto colon = address.rfind(':');
+    if (colon == std::string::npos)
+        return false;
+    std::string host = address.substr(0, colon);
+    std::string port = address.substr(colon + 1);
+
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = isListening ? AI_PASSIVE : 0;
+
+    addrinfo* results = nullptr;
+    if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &results) != 0 || results == nullptr)
+        return false;
+
+    std::memcpy(&socketAddress, results->ai_addr, results->ai_addrlen);
+    addressLength = results->ai_addrlen;
+    freeaddrinfo(results);
+    return true;
+}
+
+inline SocketConnection openListeningSocket(const std::string& address) {
+    // Returns a closed connection on failure.
+    sockaddr_storage socketAddress;
+    socklen_t addressLength;
+    if (!getSocketAddress(address, true, socketAddress, addressLength))
+        return SocketConnection();
+
+    SocketConnection listener(::socket(socketAddress.ss_family, SOCK_STREAM, 0));
+    if (!listener.isOpen())
+        return listener;
+
+    if (socketAddress.ss_family == AF_UNIX)
+        ::unlink(reinterpret_cast<sockaddr_un*>(&socketAddress)->sun_path);     // left over from an earlier run
+    else {
+        int isReused = 1;
+        setsockopt(listener.getDescriptor(), SOL_SOCKET, SO_REUSEADDR, &isReused, sizeof(isReused));
+    }
+
+    if (::bind(listener.getDescriptor(), reinterpret_cast<sockaddr*>(&socketAddress), addressLength) != 0
+        || ::listen(listener.getDescriptor(), 64) != 0)
+        listener.close();
+
+    return listener;
+}
+
+inline SocketConnection connectToAddress(const std::string& address, double retrySeconds) {
+    // Keeps trying for retrySeconds, so workers may be started before the coordinator.
+    sockaddr_storage socketAddress;
+    socklen_t addressLength;
+    if (!getSocketAddress(address, false, socketAddress, addressLength))
+        return SocketConnection();
+
+    auto startTime = std::chrono::steady_clock::now();
+    while (true) {
+        SocketConnection connection(::socket(socketAddress.ss_family, SOCK_STREAM, 0));
+        if (!connection.isOpen())
+            return connection;
+
+        if (::connect(connection.getDescriptor(), reinterpret_cast<sockaddr*>(&socketAddress), addressLength) == 0) {
+            if (socketAddress.ss_family != AF_UNIX) {
+                int isNoDelay = 1;      // leases are tiny and latency bound
+                setsockopt(connection.getDescriptor(), IPPROTO_TCP, TCP_NODELAY, &isNoDelay, sizeof(isNoDelay));
+            }
+            return connection;
+        }
+
+        if (std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count() >= retrySeconds)
+            return SocketConnection();
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+}
+
+
+class RenderCoordinator {
+public:
+    RenderCoordinator(const RenderJob& inputJob, const std::vector<RenderTile>& inputTiles, int inputLeaseSampleCount, double inputLeaseTimeoutSeconds)
+        : job(inputJob), tiles(inputTiles), leaseTimeoutSeconds(inputLeaseTimeoutSeconds) {
+        // Units go chunk by chunk over all tiles: every tile gets its first samples before any tile
+        // gets more, and the unit before one of the same tile has usually long been merged.
+        int chunkSize = std::max(1, inputLeaseSampleCount);
+        for (int firstSample = 0; firstSample < static_cast<int>(job.samplesPerPixel); firstSample += chunkSize)
+            for (int tileIndex = 0; tileIndex < static_cast<int>(tiles.size()); ++tileIndex)
+                units.push_back(WorkUnit{ tileIndex, firstSample, std::min(chunkSize, static_cast<int>(job.samplesPerPixel) - firstSample) });
+
+        for (int unitIndex = 0; unitIndex < static_cast<int>(units.size()); ++unitIndex)
+            pendingUnits.push_back(unitIndex);
+        nextMergedUnit.resize(tiles.size());
+        for (int tileIndex = 0; tileIndex < static_cast<int>(tiles.size()); ++tileIndex)
+            nextMergedUnit[tileIndex] = tileIndex;
+
+        // the largest message a worker may send: a hello, or the sums of the largest tile
+        maxPayloadSize = 2 * sizeof(std::uint32_t) + sizeof(RenderJob);
+        for (const RenderTile& tile : tiles) {
+            size_t floatCount = static_cast<size_t>(tile.maxX - tile.minX) * (tile.maxY - tile.minY) * 3;
+            maxPayloadSize = std::max(maxPayloadSize, sizeof(std::uint32_t) + floatCount * sizeof(float));
+        }
+    }
+
+    bool run(const std::string& address, std::vector<float>& accumulation) {
+        // Serves workers until every unit is merged into accumulation (width * height * 3 sums).
+        // Results are merged in unit order per tile, so the image does not depend on the workers.
+        SocketConnection listener = openListeningSocket(address);
+        if (!listener.isOpen()) {
+            std::cerr << "ERROR: Could not listen on '" << address << "'.\n";
+            return false;
+        }
+        std::clog << "Coordinator listening on " << address << ", " << units.size() << " work units\n";
+
+        accumulation.assign(static_cast<size_t>(job.width) * job.height * 3, 0.0f);
+        mergedCount = 0;
+
+        while (mergedCount < units.size()) {
+            std::vector<pollfd> descriptors(1 + workers.size());
+            descriptors[0] = pollfd{ listener.getDescriptor(), POLLIN, 0 };
+            for (size_t currentWorker = 0; currentWorker < workers.size(); ++currentWorker)
+                descriptors[currentWorker + 1] = pollfd{ workers[currentWorker].connection.getDescriptor(), POLLIN, 0 };
+
+            if (::poll(descriptors.data(), descriptors.size(), 1000) < 0)
+                continue;
+
+            for (size_t currentWorker = 0; currentWorker < workers.size(); ++currentWorker)
+                if (descriptors[currentWorker + 1].revents != 0)
+                    serveWorker(workers[currentWorker], accumulation);
+            if (descriptors[0].revents & POLLIN)
+                acceptWorker(listener);
+
+            expireLeases();
+            removeClosedWorkers();
+            assignIdleWorkers();
+        }
+
+        for (Worker& worker : workers)
+            worker.connection.sendMessage(MessageType::Finished, nullptr, 0);
+        workers.clear();
+        std::clog << "\rAll work units merged.          \n";
+        return true;
+    }
+
+private:
+    struct Worker {
+        SocketConnection connection;
+        bool isGreeted = false;
+        int leasedUnit = -1;        // -1 while idle
+        std::uint32_t leaseId = 0;
+        std::chrono::steady_clock::time_point leaseTime;
+    };
+
+    void acceptWorker(SocketConnection& listener) {
+        SocketConnection connection(::accept(listener.getDescriptor(), nullptr, nullptr));
+        if (!connection.isOpen())
+            return;
+        connection.setReceiveTimeout(30);
+
+        Worker worker;
+        worker.connection = std::move(connection);
+        workers.push_back(std::move(worker));
+    }
+
+    void serveWorker(Worker& worker, std::vector<float>& accumulation) {
+        MessageType type;
+        std::vector<unsigned char> payload;
+        if (!worker.connection.receiveMessage(type, payload, maxPayloadSize)) {
+            dropWorker(worker);
+            return;
+        }
+
+        if (type == MessageType::Hello && !worker.isGreeted) {
+            std::uint32_t hello[2];
+            RenderJob workerJob;
+            if (payload.size() != sizeof(hello) + sizeof(RenderJob)) {
+                dropWorker(worker);
+                return;
+            }
+            std::memcpy(hello, payload.data(), sizeof(hello));
+            std::memcpy(&workerJob, payload.data() + sizeof(hello), sizeof(workerJob));
+
+            if (hello[0] != DISTRIBUTED_MAGIC || hello[1] != DISTRIBUTED_VERSION || !(workerJob == job)) {
+                std::cerr << "Rejected a worker with a different protocol, scene or camera\n";
+                worker.connection.sendMessage(MessageType::Rejected, nullptr, 0);
+                worker.connection.close();
+                return;
+            }
+            worker.isGreeted = true;
+            std::clog << "\rWorker joined                 \n";
+            return;
+        }
+
+        if (type == MessageType::Result && worker.leasedUnit >= 0) {
+            const RenderTile& tile = tiles[units[worker.leasedUnit].tileIndex];
+            size_t floatCount = static_cast<size_t>(tile.maxX - tile.minX) * (tile.maxY - tile.minY) * 3;
+            std::uint32_t leaseId;
+            if (payload.size() != sizeof(leaseId) + floatCount * sizeof(float)) {
+                dropWorker(worker);
+                return;
+            }
+            std::memcpy(&leaseId, payload.data(), sizeof(leaseId));
+            if (leaseId != worker.leaseId) {
+                dropWorker(worker);
+                return;
+            }
+
+            std::vector<float>& sums = finishedUnits[worker.leasedUnit];
+            sums.resize(floatCount);
+            std::memcpy(sums.data(), payload.data() + sizeof(leaseId), floatCount * sizeof(float));
+            mergeFinishedUnits(units[worker.leasedUnit].tileIndex, accumulation);
+            worker.leasedUnit = -1;
+            return;
+        }
+
+        dropWorker(worker);     // anything else breaks the protocol
+    }
+
+    void mergeFinishedUnits(int tileIndex, std::vector<float>& accumulation) {
+        const RenderTile& tile = tiles[tileIndex];
+        int tileWidth = tile.maxX - tile.minX;
+
+        auto found = finishedUnits.find(nextMergedUnit[tileIndex]);
+        while (found != finishedUnits.end()) {
+            const std::vector<float>& sums = found->second;
+            for (int currentHeight = tile.minY; currentHeight < tile.maxY; ++currentHeight) {
+                float* row = &accumulation[(static_cast<size_t>(currentHeight) * job.width + tile.minX) * 3];
+                const float* tileRow = &sums[static_cast<size_t>(currentHeight - tile.minY) * tileWidth * 3];
+                for (int currentValue = 0; currentValue < tileWidth * 3; ++currentValue)
+                    row[currentValue] += tileRow[currentValue];
+            }
+
+            finishedUnits.erase(found);
+            ++mergedCount;
+            nextMergedUnit[tileIndex] += static_cast<int>(tiles.size());
+            found = finishedUnits.find(nextMergedUnit[tileIndex]);
+        }
+
+        std::clog << "\rWork units remaining: " << units.size() - mergedCount << ' ' << std::flush;
+    }
+
+    void dropWorker(Worker& worker) {
+        // the lease of a lost worker is handed out again before anything else
+        if (worker.leasedUnit >= 0) {
+            pendingUnits.push_front(worker.leasedUnit);
+            std::clog << "\rWorker lost, re-leasing its tile\n";
+        }
+        worker.leasedUnit = -1;
+        worker.connection.close();
+    }
+
+    void expireLeases() {
+        if (leaseTimeoutSeconds <= 0)
+            return;
+
+        auto now = std::chrono::steady_clock::now();
+        for (Worker& worker : workers)
+            if (worker.leasedUnit >= 0 && std::chrono::duration<double>(now - worker.leaseTime).count() > leaseTimeoutSeconds)
+                dropWorker(worker);
+    }
+
+    void removeClosedWorkers() {
+        workers.erase(std::remove_if(workers.begin(), workers.end(), [](const Worker& worker) { return !worker.connection.isOpen(); }),
+            workers.end());
+    }
+
+    void assignIdleWorkers() {
+        for (Worker& worker : workers) {
+            if (pendingUnits.empty())
+                return;
+            if (!worker.isGreeted || worker.leasedUnit >= 0)
+                continue;
+
+            int unitIndex = pendingUnits.front();
+            pendingUnits.pop_front();
+            const WorkUnit& unit = units[unitIndex];
+
+            worker.leasedUnit = unitIndex;
+            worker.leaseId = ++lastLeaseId;
+            worker.leaseTime = std::chrono::steady_clock::now();
+            LeaseMessage lease = { worker.leaseId, unit.tileIndex, unit.firstSample, unit.sampleCount };
+            if (!worker.connection.sendMessage(MessageType::Lease, &lease, sizeof(lease)))
+                dropWorker(worker);
+        }
+    }
+
+    RenderJob job;
+    std::vector<RenderTile> tiles;
+    double leaseTimeoutSeconds;
+    size_t maxPayloadSize;
+
+    std::vector<WorkUnit> units;
+    std::deque<int> pendingUnits;
+    std::map<int, std::vector<float>> finishedUnits;    // returned sums waiting for an earlier unit of their tile
+    std::vector<int> nextMergedUnit;                    // per tile
+    size_t mergedCount = 0;
+
+    std::vector<Worker> workers;
+    std::uint32_t lastLeaseId = 0;
+};
+
+inline bool runRenderWorker(const std::string& address, const RenderJob& job,
+                            const std::function<void(const WorkUnit&, std::vector<float>&)>& renderUnit) {
+    // Connects to a coordinator and renders leases until it says it is finished. renderUnit fills the
+    // tile's sums, scanline order. Returns false if the coordinator rejected us or went away.
+    SocketConnection connection = connectToAddress(address, 30);
+    if (!connection.isOpen()) {
+        std::cerr << "ERROR: Could not connect to coordinator '" << address << "'.\n";
+        return false;
+    }
+
+    std::vector<unsigned char> hello(2 * sizeof(std::uint32_t) + sizeof(RenderJob));
+    std::uint32_t helloHeader[2] = { DISTRIBUTED_MAGIC, DISTRIBUTED_VERSION };
+    std::memcpy(hello.data(), helloHeader, sizeof(helloHeader));
+    std::memcpy(hello.data() + sizeof(helloHeader), &job, sizeof(job));
+    if (!connection.sendMessage(MessageType::Hello, hello))
+        return false;
+
+    MessageType type;
+    std::vector<unsigned char> payload;
+    std::vector<float> sums;
+    std::vector<unsigned char> result;
+    long long leaseCount = 0;
+
+    while (connection.receiveMessage(type, payload, sizeof(LeaseMessage))) {
+        if (type == MessageType::Finished) {
+            std::clog << "\rWorker finished after " << leaseCount << " leases\n";
+            return true;
+        }
+        if (type == MessageType::Rejected) {
+            std::cerr << "ERROR: The coordinator renders a different scene or camera.\n";
+            return false;
+        }
+        if (type != MessageType::Lease || payload.size() != sizeof(LeaseMessage))
+            break;
+
+        LeaseMessage lease;
+        std::memcpy(&lease, payload.data(), sizeof(lease));
+        renderUnit(WorkUnit{ lease.tileIndex, lease.firstSample, lease.sampleCount }, sums);
+
+        result.resize(sizeof(lease.leaseId) + sums.size() * sizeof(float));
+        std::memcpy(result.data(), &lease.leaseId, sizeof(lease.leaseId));
+        std::memcpy(result.data() + sizeof(lease.leaseId), sums.data(), sums.size() * sizeof(float));
+        if (!connection.sendMessage(MessageType::Result, result))
+            break;
+
+        ++leaseCount;
+        std::clog << "\rLeases rendered: " << leaseCount << ' ' << std::flush;
+    }
+
+    std::cerr << "ERROR: Lost the connection to the coordinator.\n";
+    return false;
+}
+
+#else
+
+// No socket implementation for Windows yet; both roles report an error.
+class RenderCoordinator {
+public:
+    RenderCoordinator(const RenderJob&, const std::vector<RenderTile>&, int, double) {}
+
+    bool run(const std::string&, std::vector<float>&) {
+        std::cerr << "ERROR: Distributed rendering is not supported on this platform.\n";
+        return false;
+    }
+};
+
+inline bool runRenderWorker(const std::string&, const RenderJob&, const std::function<void(const WorkUnit&, std::vector<float>&)>&) {
+    std::cerr << "ERROR: Distributed rendering is not supported on this platform.\n";
+    return false;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "ray_utility.h"
+
+#include <vector>
+
+// Linear (not gamma corrected, not clamped) HDR colors of a whole image in scanline order.
+class Framebuffer {
+public:
+    Framebuffer() {}
+    Framebuffer(int inputWidth, int inputHeight)
+        : width(inputWidth), height(inputHeight), pixels(static_cast<size_t>(inputWidth) * inputHeight) {}
+
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    size_t getPixelCount() const { return pixels.size(); }
+
+    const Color& getPixel(int x, int y) const { return pixels[static_cast<size_t>(y) * width + x]; }
+    void setPixel(int x, int y, const Color& color) { pixels[static_cast<size_t>(y) * width + x] = color; }
+
+    const Color& operator[](size_t pixelIndex) const { return pixels[pixelIndex]; }
+    Color& operator[](size_t pixelIndex) { return pixels[pixelIndex]; }
+
+private:
+    int width = 0;
+    int height = 0;
+    std::vector<Color> pixels;
+};
+
+#endif
@@ -3,6 +3,9 @@
 
 #include "ray_utility.h"
 #include "aabb.h"
+#include "bvh_statistics.h"
+
+#include <vector>
 
 class Material;
 
@@ -27,6 +30,43 @@ public:
 
     virtual bool isHit(const Ray& inputRay, Interval timeIntervalToCheck, HitRecord& record) const = 0;
     virtual AABB getBoundingBox() const = 0;
+
+    // Any-hit query for shadow and visibility rays: whether anything is hit inside the interval. It may
+    // stop at the first hit it finds and fills no HitRecord, so objects override it with a cheaper test.
+    virtual bool isOccluded(const Ray& inputRay, Interval timeIntervalToCheck) const {
+        HitRecord record;
+        return isHit(inputRay, timeIntervalToCheck, record);
+    }
+
+    // Light sampling. An emitter that can be sampled directly adds itself in collectEmitters()
+    // and overrides the two functions below; containers only pass the call on to their children.
+    virtual void collectEmitters(std::vector<const Hittable*>& emitters) const {}
+
+    virtual double getPdfValue(const Point3& origin, const Vec3& direction, double time) const {
+        // Solid angle density of getRandomDirection(origin, time) producing direction, for a ray at time.
+        return 0.0;
+    }
+
+    virtual Vec3 getRandomDirection(const Point3& origin, double time) const {
+        // A direction from origin towards a random point of the object where it is at time.
+        return Vec3(1, 0, 0);
+    }
+
+    // Animation. After objects have moved (Translate::setOffset, RotateY::setAngle), refit() recomputes
+    // the cached bounding boxes bottom-up, keeping the hierarchy as it is. rebuildDegradedSubtrees()
+    // then rebuilds the BVH subtrees that grew too much from it; returns how many were rebuilt.
+    virtual void refit() {}
+    virtual int rebuildDegradedSubtrees(double rebuildThreshold) { return 0; }
+
+    // Motion blur. The box around the object at one ray time, with the shutter open from time 0 to 1
+    // like a moving Sphere's; the default is the box over all times. MotionBVH interpolates linearly
+    // between the boxes at two times, so for any time between them the interpolated box must still
+    // hold the object. Boxes of linearly moving objects, and unions and affine maps of them, do.
+    virtual AABB getBoundingBoxAtTime(double time) const { return getBoundingBox(); }
+
+    // BVH statistics. Every BVH adds the metrics of its tree, once per tree, and passes the call on to
+    // its objects, like collectEmitters(); Camera::render() reports them with RT_BVH_STATISTICS.
+    virtual void collectTreeStatistics(std::vector<BVHTreeStatistics>& statistics) const {}
 };
 
 
@@ -36,6 +76,12 @@ public:
         boundingBox = baseObject->getBoundingBox() + offset;
     }
 
+    const Vec3& getOffset() const { return offset; }
+    void setOffset(const Vec3& inputOffset) {
+        offset = inputOffset;
+        boundingBox = baseObject->getBoundingBox() + offset;
+    }
+
     bool isHit(const Ray& inputRay, Interval timeIntervalToCheck, HitRecord& record) const override {
         // Move the ray backwards by the offset
         Ray adjustedRay(inputRay.getOrigin() - offset, inputRay.getDirection(), inputRay.getTime());
@@ -48,10 +94,35 @@ public:
         record.hitPosition += offset;
         return true;
     }
+
+    bool isOccluded(const Ray& inputRay, Interval timeIntervalToCheck) const override {
+        Ray adjustedRay(inputRay.getOrigin() - offset, inputRay.getDirection(), inputRay.getTime());
+        return baseObject->isOccluded(adjustedRay, timeIntervalToCheck);
+    }
+
     AABB getBoundingBox() const override {
         return boundingBox;
     }
 
+    AABB getBoundingBoxAtTime(double time) const override {
+        return baseObject->getBoundingBoxAtTime(time) + offset;
+    }
+
+    void refit() override {
+        baseObject->refit();
+        boundingBox = baseObject->getBoundingBox() + offset;
+    }
+
+    int rebuildDegradedSubtrees(double rebuildThreshold) override {
+        int rebuildCount = baseObject->rebuildDegradedSubtrees(rebuildThreshold);
+        boundingBox = baseObject->getBoundingBox() + offset;
+        return rebuildCount;
+    }
+
+    void collectTreeStatistics(std::vector<BVHTreeStatistics>& statistics) const override {
+        baseObject->collectTreeStatistics(statistics);
+    }
+
 private:
     std::shared_ptr<Hittable> baseObject;
     Vec3 offset;
@@ -61,50 +132,19 @@ private:
 class RotateY : public Hittable {
 public:
     RotateY(std::shared_ptr<Hittable> inputObject, double angle) : baseObject(inputObject) {
+        setAngle(angle);
+    }
+
+    void setAngle(double angle) {
         auto radians = convertDegreesToRadians(angle);
         sinTheta = std::sin(radians);
         cosTheta = std::cos(radians);
-        boundingBox = baseObject->getBoundingBox();
-
-        Point3 min(RT_INFINITY, RT_INFINITY, RT_INFINITY);
-        Point3 max(-RT_INFINITY, -RT_INFINITY, -RT_INFINITY);
-
-        for (int i = 0; i < 2; i++) {
-            for (int j = 0; j < 2; j++) {
-                for (int k = 0; k < 2; k++) {
-                    auto x = i * boundingBox.intervalX.max + (1 - i) * boundingBox.intervalX.min;
-                    auto y = j * boundingBox.intervalY.max + (1 - j) * boundingBox.intervalY.min;
-                    auto z = k * boundingBox.intervalZ.max + (1 - k) * boundingBox.intervalZ.min;
-
-                    auto newx = cosTheta * x + sinTheta * z;
-                    auto newz = -sinTheta * x + cosTheta * z;
-
-                    Vec3 tester(newx, y, newz);
-
-                    for (int c = 0; c < 3; c++) {
-                        min[c] = std::fmin(min[c], tester[c]);
-                        max[c] = std::fmax(max[c], tester[c]);
-                    }
-                }
-            }
-        }
-
-        boundingBox = AABB(min, max);
+        updateBoundingBox();
     }
 
     bool isHit(const Ray& inputRay, Interval timeIntervalToCheck, HitRecord& record) const override {
         // Transform the ray from world space to object space.
-        auto adjustedOrigin = Point3(
-            (cosTheta * inputRay.getOrigin().getX()) - (sinTheta * inputRay.getOrigin().getZ()),
-            inputRay.getOrigin().getY(),
-            (sinTheta * inputRay.getOrigin().getX()) + (cosTheta * inputRay.getOrigin().getZ())
-        );
-        auto adjustedDirection = Vec3(
-            (cosTheta * inputRay.getDirection().getX()) - (sinTheta * inputRay.getDirection().getZ()),
-            inputRay.getDirection().getY(),
-            (sinTheta * inputRay.getDirection().getX()) + (cosTheta * inputRay.getDirection().getZ())
-        );
-        Ray adjustedRay(adjustedOrigin, adjustedDirection, inputRay.getTime());
+        Ray adjustedRay = getObjectSpaceRay(inputRay);
 
         // Determine whether an intersection exists in object space (and if so, where).
         if (!baseObject->isHit(adjustedRay, timeIntervalToCheck, record))
@@ -124,11 +164,81 @@ public:
 
         return true;
     }
+
+    bool isOccluded(const Ray& inputRay, Interval timeIntervalToCheck) const override {
+        return baseObject->isOccluded(getObjectSpaceRay(inputRay), timeIntervalToCheck);
+    }
+
     AABB getBoundingBox() const override {
         return boundingBox;
     }
 
+    AABB getBoundingBoxAtTime(double time) const override {
+        return getRotatedBox(baseObject->getBoundingBoxAtTime(time));
+    }
+
+    void refit() override {
+        baseObject->refit();
+        updateBoundingBox();
+    }
+
+    int rebuildDegradedSubtrees(double rebuildThreshold) override {
+        int rebuildCount = baseObject->rebuildDegradedSubtrees(rebuildThreshold);
+        updateBoundingBox();
+        return rebuildCount;
+    }
+
+    void collectTreeStatistics(std::vector<BVHTreeStatistics>& statistics) const override {
+        baseObject->collectTreeStatistics(statistics);
+    }
+
 private:
+    Ray getObjectSpaceRay(const Ray& inputRay) const {
+        auto adjustedOrigin = Point3(
+            (cosTheta * inputRay.getOrigin().getX()) - (sinTheta * inputRay.getOrigin().getZ()),
+            inputRay.getOrigin().getY(),
+            (sinTheta * inputRay.getOrigin().getX()) + (cosTheta * inputRay.getOrigin().getZ())
+        );
+        auto adjustedDirection = Vec3(
+            (cosTheta * inputRay.getDirection().getX()) - (sinTheta * inputRay.getDirection().getZ()),
+            inputRay.getDirection().getY(),
+            (sinTheta * inputRay.getDirection().getX()) + (cosTheta * inputRay.getDirection().getZ())
+        );
+        return Ray(adjustedOrigin, adjustedDirection, inputRay.getTime());
+    }
+
+    void updateBoundingBox() {
+        boundingBox = getRotatedBox(baseObject->getBoundingBox());
+    }
+
+    AABB getRotatedBox(const AABB& box) const {
+        // the box around the rotated corners of box
+        Point3 min(RT_INFINITY, RT_INFINITY, RT_INFINITY);
+        Point3 max(-RT_INFINITY, -RT_INFINITY, -RT_INFINITY);
+
+        for (int i = 0; i < 2; i++) {
+            for (int j = 0; j < 2; j++) {
+                for (int k = 0; k < 2; k++) {
+                    auto x = i * box.intervalX.max + (1 - i) * box.intervalX.min;
+                    auto y = j * box.intervalY.max + (1 - j) * box.intervalY.min;
+                    auto z = k * box.intervalZ.max + (1 - k) * box.intervalZ.min;
+
+                    auto newx = cosTheta * x + sinTheta * z;
+                    auto newz = -sinTheta * x + cosTheta * z;
+
+                    Vec3 tester(newx, y, newz);
+
+                    for (int c = 0; c < 3; c++) {
+                        min[c] = std::fmin(min[c], tester[c]);
+                        max[c] = std::fmax(max[c], tester[c]);
+                    }
+                }
+            }
+        }
+
+        return AABB(min, max);
+    }
+
     std::shared_ptr<Hittable> baseObject;
     double sinTheta, cosTheta;
     AABB boundingBox;
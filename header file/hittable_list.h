@@ -38,8 +38,47 @@ public:
         return isHitAnything;
     }
 
+    bool isOccluded(const Ray& r, Interval rayInterval) const override {
+        for (const auto& object : objects)
+            if (object->isOccluded(r, rayInterval))
+                return true;
+        return false;
+    }
+
     AABB getBoundingBox() const override { return boundingBox; }
 
+    AABB getBoundingBoxAtTime(double time) const override {
+        AABB box;
+        for (const auto& object : objects)
+            box = AABB(box, object->getBoundingBoxAtTime(time));
+        return box;
+    }
+
+    void collectEmitters(std::vector<const Hittable*>& emitters) const override {
+        for (const auto& object : objects)
+            object->collectEmitters(emitters);
+    }
+
+    void collectTreeStatistics(std::vector<BVHTreeStatistics>& statistics) const override {
+        for (const auto& object : objects)
+            object->collectTreeStatistics(statistics);
+    }
+
+    void refit() override {
+        boundingBox = AABB();
+        for (const auto& object : objects) {
+            object->refit();
+            boundingBox = AABB(boundingBox, object->getBoundingBox());
+        }
+    }
+
+    int rebuildDegradedSubtrees(double rebuildThreshold) override {
+        int rebuiltCount = 0;
+        for (const auto& object : objects)
+            rebuiltCount += object->rebuildDegradedSubtrees(rebuildThreshold);
+        return rebuiltCount;
+    }
+
 private:
     AABB boundingBox;
 };
@@ -0,0 +1,201 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include "framebuffer.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+// Output stage: turns a linear Framebuffer into bytes and writes the whole image in bulk.
+// PPM and PNG are tone mapped and gamma corrected to 8 bits, PFM keeps the linear floats.
+
+inline std::vector<unsigned char> getDisplayBytes(const Framebuffer& framebuffer, ToneMapping toneMapping) {
+    // RGB bytes for every pixel in scanline order
+    std::vector<unsigned char> bytes(framebuffer.getPixelCount() * 3);
+
+    for (size_t currentPixel = 0; currentPixel < framebuffer.getPixelCount(); ++currentPixel) {
+        const Color& pixelColor = framebuffer[currentPixel];
+        bytes[currentPixel * 3 + 0] = convertLinearToByte(pixelColor.getX(), toneMapping);
+        bytes[currentPixel * 3 + 1] = convertLinearToByte(pixelColor.getY(), toneMapping);
+        bytes[currentPixel * 3 + 2] = convertLinearToByte(pixelColor.getZ(), toneMapping);
+    }
+
+    return bytes;
+}
+
+inline bool writePPM(std::ostream& out, const Framebuffer& framebuffer, ToneMapping toneMapping) {
+    // binary P6
+    auto bytes = getDisplayBytes(framebuffer, toneMapping);
+
+    out << "P6\n" << framebuffer.getWidth() << ' ' << framebuffer.getHeight() << "\n255\n";
+    out.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+    out.flush();
+    return static_cast<bool>(out);
+}
+
+inline bool writePFM(std::ostream& out, const Framebuffer& framebuffer) {
+    // Three channel float image. Rows go from bottom to top and a negative scale means little-endian floats.
+    int width = framebuffer.getWidth();
+    std::vector<float> row(static_cast<size_t>(width) * 3);
+
+    out << "PF\n" << width << ' ' << framebuffer.getHeight() << "\n-1.0\n";
+    for (int currentHeight = framebuffer.getHeight() - 1; currentHeight >= 0; --currentHeight) {
+        for (int currentWidth = 0; currentWidth < width; ++currentWidth) {
+            const Color& pixelColor = framebuffer.getPixel(currentWidth, currentHeight);
+            row[currentWidth * 3 + 0] = static_cast<float>(pixelColor.getX());
+            row[currentWidth * 3 + 1] = static_cast<float>(pixelColor.getY());
+            row[currentWidth * 3 + 2] = static_cast<float>(pixelColor.getZ());
+        }
+        out.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(float));
+    }
+
+    out.flush();
+    return static_cast<bool>(out);
+}
+
+
+class PNGEncoder {
+public:
+    // Minimal PNG encoder: 8-bit RGB, no filtering, and a zlib stream made of "stored"
+    // (uncompressed) deflate blocks, so it needs no compression library.
+    static bool write(std::ostream& out, const Framebuffer& framebuffer, ToneMapping toneMapping) {
+        auto bytes = getDisplayBytes(framebuffer, toneMapping);
+        auto width = static_cast<std::uint32_t>(framebuffer.getWidth());
+        auto height = static_cast<std::uint32_t>(framebuffer.getHeight());
+
+        // every scanline starts with its filter type, 0 = none
+        std::vector<unsigned char> scanlines;
+        scanlines.reserve(bytes.size() + height);
+        for (std::uint32_t currentRow = 0; currentRow < height; ++currentRow) {
+            scanlines.push_back(0);
+            auto rowBegin = bytes.begin() + static_cast<size_t>(currentRow) * width * 3;
+            scanlines.insert(scanlines.end(), rowBegin, rowBegin + static_cast<size_t>(width) * 3);
+        }
+
+        static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+        out.write(reinterpret_cast<const char*>(signature), sizeof(signature));
+
+        std::vector<unsigned char> header;
+        appendBigEndian(header, width);
+        appendBigEndian(header, height);
+        header.insert(header.end(), { 8, 2, 0, 0, 0 });     // bit depth, color type RGB, compression, filter, interlace
+        writeChunk(out, "IHDR", header);
+
+        writeChunk(out, "IDAT", getStoredZlibStream(scanlines));
+        writeChunk(out, "IEND", {});
+
+        out.flush();
+        return static_cast<bool>(out);
+    }
+
+private:
+    static void appendBigEndian(std::vector<unsigned char>& data, std::uint32_t value) {
+        data.push_back(static_cast<unsigned char>(value >> 24));
+        data.push_back(static_cast<unsigned char>(value >> 16));
+        data.push_back(static_cast<unsigned char>(value >> 8));
+        data.push_back(static_cast<unsigned char>(value));
+    }
+
+    static std::uint32_t getCRC(const unsigned char* data, size_t size, std::uint32_t crc) {
+        static const auto table = []() {
+            std::vector<std::uint32_t> values(256);
+            for (std::uint32_t n = 0; n < 256; ++n) {
+                std::uint32_t c = n;
+                for (int k = 0; k < 8; ++k)
+                    c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                values[n] = c;
+            }
+            return values;
+        }();
+
+        for (size_t i = 0; i < size; ++i)
+            crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+        return crc;
+    }
+
+    static void writeChunk(std::ostream& out, const char* type, const std::vector<unsigned char>& data) {
+        std::vector<unsigned char> chunk;
+        appendBigEndian(chunk, static_cast<std::uint32_t>(data.size()));
+        chunk.insert(chunk.end(), type, type + 4);
+        chunk.insert(chunk.end(), data.begin(), data.end());
+
+        // the CRC covers the type and the data, but not the length
+        std::uint32_t crc = getCRC(chunk.data() + 4, chunk.size() - 4, 0xFFFFFFFFu) ^ 0xFFFFFFFFu;
+        appendBigEndian(chunk, crc);
+
+        out.write(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+    }
+
+    static std::vector<unsigned char> getStoredZlibStream(const std::vector<unsigned char>& data) {
+        const size_t MAX_BLOCK_SIZE = 65535;
+        std::vector<unsigned char> stream = { 0x78, 0x01 };     // deflate, 32K window, no preset dictionary
+
+        size_t offset = 0;
+        do {
+            size_t blockSize = std::min(MAX_BLOCK_SIZE, data.size() - offset);
+            bool isFinalBlock = offset + blockSize == data.size();
+
+            stream.push_back(isFinalBlock ? 1 : 0);
+            stream.push_back(static_cast<unsigned char>(blockSize & 0xFF));
+            stream.push_back(static_cast<unsigned char>(blockSize >> 8));
+            stream.push_back(static_cast<unsigned char>(~blockSize & 0xFF));
+            stream.push_back(static_cast<unsigned char>((~blockSize >> 8) & 0xFF));
+            stream.insert(stream.end(), data.begin() + offset, data.begin() + offset + blockSize);
+
+            offset += blockSize;
+        } while (offset < data.size());
+
+        // Adler-32 checksum of the uncompressed data
+        std::uint32_t a = 1, b = 0;
+        for (unsigned char value : data) {
+            a = (a + value) % 65521;
+            b = (b + a) % 65521;
+        }
+        appendBigEndian(stream, (b << 16) | a);
+
+        return stream;
+    }
+};
+
+inline bool writePNG(std::ostream& out, const Framebuffer& framebuffer, ToneMapping toneMapping) {
+    return PNGEncoder::write(out, framebuffer, toneMapping);
+}
+
+
+inline bool writeImage(const std::string& fileName, const Framebuffer& framebuffer, ToneMapping toneMapping) {
+    // The extension of fileName picks the format (.png, .pfm, anything else is binary PPM).
+    // An empty file name or "-" writes a PPM to standard output.
+    if (fileName.empty() || fileName == "-") {
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);   // otherwise '\n' bytes in the pixel data become "\r\n"
+#endif
+        return writePPM(std::cout, framebuffer, toneMapping);
+    }
+
+    auto hasExtension = [&fileName](const std::string& extension) {
+        return fileName.size() >= extension.size()
+            && fileName.compare(fileName.size() - extension.size(), extension.size(), extension) == 0;
+    };
+
+    std::ofstream out(fileName, std::ios::binary | std::ios::trunc);
+    if (!out)
+        return false;
+
+    if (hasExtension(".png"))
+        return writePNG(out, framebuffer, toneMapping);
+    if (hasExtension(".pfm"))
+        return writePFM(out, framebuffer);
+    return writePPM(out, framebuffer, toneMapping);
+}
+
+#endif
@@ -0,0 +1,224 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+
+#include <cmath>
+#include <memory>
+#include <unordered_set>
+#include <vector>
+
+// Affine transform from object space to world space, kept together with its inverse. The factories
+// know their inverses exactly, and composing keeps both, so no matrix is ever inverted numerically.
+class Transform {
+public:
+    Transform() {
+        for (int row = 0; row < 3; ++row)
+            for (int column = 0; column < 4; ++column)
+                matrix[row][column] = inverse[row][column] = (row == column) ? 1 : 0;
+    }
+
+    static Transform getTranslation(const Vec3& offset) {
+        Transform transform;
+        for (int row = 0; row < 3; ++row) {
+            transform.matrix[row][3] = offset[row];
+            transform.inverse[row][3] = -offset[row];
+        }
+        return transform;
+    }
+
+    static Transform getScale(const Vec3& scale) {
+        Transform transform;
+        for (int row = 0; row < 3; ++row) {
+            transform.matrix[row][row] = scale[row];
+            transform.inverse[row][row] = 1 / scale[row];
+        }
+        return transform;
+    }
+
+    static Transform getRotationY(double angle) {
+        // the same rotation as RotateY with this angle in degrees
+        auto radians = convertDegreesToRadians(angle);
+        double sinTheta = std::sin(radians);
+        double cosTheta = std::cos(radians);
+
+        Transform transform;
+        transform.matrix[0][0] = cosTheta;   transform.matrix[0][2] = sinTheta;
+        transform.matrix[2][0] = -sinTheta;  transform.matrix[2][2] = cosTheta;
+        transform.inverse[0][0] = cosTheta;  transform.inverse[0][2] = -sinTheta;
+        transform.inverse[2][0] = sinTheta;  transform.inverse[2][2] = cosTheta;
+        return transform;
+    }
+
+    Transform operator*(const Transform& other) const {
+        // other first, then this
+        Transform result;
+        multiply(matrix, other.matrix, result.matrix);
+        multiply(other.inverse, inverse, result.inverse);
+        return result;
+    }
+
+    Point3 applyToPoint(const Point3& point) const { return apply(matrix, point, 1); }
+    Vec3 applyToVector(const Vec3& vector) const { return apply(matrix, vector, 0); }
+    Point3 applyInverseToPoint(const Point3& point) const { return apply(inverse, point, 1); }
+    Vec3 applyInverseToVector(const Vec3& vector) const { return apply(inverse, vector, 0); }
+
+    Vec3 applyToNormal(const Vec3& normal) const {
+        // normals go through the inverse transpose, which keeps them perpendicular under scaling
+        return Vec3(
+            inverse[0][0] * normal[0] + inverse[1][0] * normal[1] + inverse[2][0] * normal[2],
+            inverse[0][1] * normal[0] + inverse[1][1] * normal[1] + inverse[2][1] * normal[2],
+            inverse[0][2] * normal[0] + inverse[1][2] * normal[1] + inverse[2][2] * normal[2]
+        );
+    }
+
+    AABB applyToBox(const AABB& box) const {
+        // the box around the transformed corners
+        Point3 min(RT_INFINITY, RT_INFINITY, RT_INFINITY);
+        Point3 max(-RT_INFINITY, -RT_INFINITY, -RT_INFINITY);
+
+        for (int corner = 0; corner < 8; ++corner) {
+            Point3 point = applyToPoint(Point3(
+                (corner & 1) ? box.intervalX.max : box.intervalX.min,
+                (corner & 2) ? box.intervalY.max : box.intervalY.min,
+                (corner & 4) ? box.intervalZ.max : box.intervalZ.min
+            ));
+            for (int axis = 0; axis < 3; ++axis) {
+                min[axis] = std::fmin(min[axis], point[axis]);
+                max[axis] = std::fmax(max[axis], point[axis]);
+            }
+        }
+        return AABB(min, max);
+    }
+
+private:
+    static void multiply(const double lhs[3][4], const double rhs[3][4], double result[3][4]) {
+        // 3x4 matrices with an implicit last row (0, 0, 0, 1)
+        for (int row = 0; row < 3; ++row)
+            for (int column = 0; column < 4; ++column) {
+                result[row][column] = lhs[row][0] * rhs[0][column] + lhs[row][1] * rhs[1][column] + lhs[row][2] * rhs[2][column];
+                if (column == 3)
+                    result[row][column] += lhs[row][3];
+            }
+    }
+
+    static Vec3 apply(const double transform[3][4], const Vec3& vector, double w) {
+        return Vec3(
+            transform[0][0] * vector[0] + transform[0][1] * vector[1] + transform[0][2] * vector[2] + transform[0][3] * w,
+            transform[1][0] * vector[0] + transform[1][1] * vector[1] + transform[1][2] * vector[2] + transform[1][3] * w,
+            transform[2][0] * vector[0] + transform[2][1] * vector[1] + transform[2][2] * vector[2] + transform[2][3] * w
+        );
+    }
+
+    double matrix[3][4];    // object to world
+    double inverse[3][4];   // world to object
+};
+
+// One placement of shared geometry: a transform and a reference to the geometry's bottom-level BVH
+// (BLAS), which any number of instances can share. The ray is moved into object space instead of the
+// geometry into world space; its direction isn't renormalized, so hit times stay world-space times.
+// Like Translate and RotateY, instances don't pass emitters on for light sampling.
+class Instance : public Hittable {
+public:
+    Instance(std::shared_ptr<Hittable> inputGeometry, const Transform& inputTransform) : geometry(inputGeometry), transform(inputTransform) {
+        boundingBox = transform.applyToBox(geometry->getBoundingBox());
+    }
+
+    const std::shared_ptr<Hittable>& getGeometry() const { return geometry; }
+    const Transform& getTransform() const { return transform; }
+    void setTransform(const Transform& inputTransform) {
+        transform = inputTransform;
+        boundingBox = transform.applyToBox(geometry->getBoundingBox());
+    }
+
+    bool isHit(const Ray& inputRay, Interval timeIntervalToCheck, HitRecord& record) const override {
+        Ray objectRay(transform.applyInverseToPoint(inputRay.getOrigin()), transform.applyInverseToVector(inputRay.getDirection()), inputRay.getTime());
+        if (!geometry->isHit(objectRay, timeIntervalToCheck, record))
+            return false;
+
+        // the face side was decided in object space, and the inverse transpose keeps it
+        record.hitPosition = transform.applyToPoint(record.hitPosition);
+        record.normalizedVector = getUnitVector(transform.applyToNormal(record.normalizedVector));
+        return true;
+    }
+
+    bool isOccluded(const Ray& inputRay, Interval timeIntervalToCheck) const override {
+        Ray objectRay(transform.applyInverseToPoint(inputRay.getOrigin()), transform.applyInverseToVector(inputRay.getDirection()), inputRay.getTime());
+        return geometry->isOccluded(objectRay, timeIntervalToCheck);
+    }
+
+    AABB getBoundingBox() const override { return boundingBox; }
+    AABB getBoundingBoxAtTime(double time) const override { return transform.applyToBox(geometry->getBoundingBoxAtTime(time)); }
+
+    void refit() override {
+        // The geometry is shared, so it is refit once by TopLevelBVH, not once per instance.
+        boundingBox = transform.applyToBox(geometry->getBoundingBox());
+    }
+
+    void collectTreeStatistics(std::vector<BVHTreeStatistics>& statistics) const override {
+        // TopLevelBVH reports each shared geometry once itself; this is for an Instance outside one
+        geometry->collectTreeStatistics(statistics);
+    }
+
+private:
+    std::shared_ptr<Hittable> geometry;
+    Transform transform;
+    AABB boundingBox;
+};
+
+// Two-level acceleration structure: a top-level BVH (TLAS) over instances whose geometry is built once
+// per unique asset. Memory grows with the unique geometry plus one small Instance per placement.
+class TopLevelBVH : public Hittable {
+public:
+    TopLevelBVH(std::vector<std::shared_ptr<Instance>> inputInstances, const BVHBuildOptions& options = BVHBuildOptions())
+        : instances(std::move(inputInstances)) {
+        HittableList instanceList;
+        for (const auto& instance : instances)
+            instanceList.add(instance);
+        tree = std::make_shared<BVHNode>(instanceList, options);
+    }
+
+    bool isHit(const Ray& inputRay, Interval timeIntervalToCheck, HitRecord& record) const override {
+        return tree->isHit(inputRay, timeIntervalToCheck, record);
+    }
+
+    bool isOccluded(const Ray& inputRay, Interval timeIntervalToCheck) const override {
+        return tree->isOccluded(inputRay, timeIntervalToCheck);
+    }
+
+    AABB getBoundingBox() const override { return tree->getBoundingBox(); }
+
+    void refit() override {
+        // every shared geometry once, then the instance boxes and the top level
+        std::unordered_set<Hittable*> refitGeometries;
+        for (const auto& instance : instances)
+            if (refitGeometries.insert(instance->getGeometry().get()).second)
+                instance->getGeometry()->refit();
+        tree->refit();
+    }
+
+    int rebuildDegradedSubtrees(double rebuildThreshold) override {
+        return tree->rebuildDegradedSubtrees(rebuildThreshold);
+    }
+
+    void collectTreeStatistics(std::vector<BVHTreeStatistics>& statistics) const override {
+        // the top level, then every shared geometry once
+        statistics.push_back(tree->getTreeStatistics());
+        statistics.back().structureName = "TopLevelBVH";
+        std::unordered_set<const Hittable*> visitedGeometries;
+        for (const auto& instance : instances)
+            if (visitedGeometries.insert(instance->getGeometry().get()).second)
+                instance->getGeometry()->collectTreeStatistics(statistics);
+    }
+
+    size_t getInstanceCount() const { return instances.size(); }
+    const std::vector<std::shared_ptr<Instance>>& getInstances() const { return instances; }
+
+private:
+    std::vector<std::shared_ptr<Instance>> instances;
+    std::shared_ptr<BVHNode> tree;
+};
+
+#endif
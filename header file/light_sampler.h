@@ -0,0 +1,94 @@
+#ifndef LIGHT_SAMPLER_H
+#define LIGHT_SAMPLER_H
+
+#include "bvh_statistics.h"
+#include "hittable.h"
+#include "material.h"
+
+#include <algorithm>
+#include <vector>
+
+// Next-event estimation. Collects every emissive Quad and Sphere of a scene and, at a non-specular
+// hit, samples one of them directly and casts a shadow ray to it, instead of waiting for a scattered
+// ray to find the light by chance. Both ways of finding a light are combined with multiple importance
+// sampling, so each one counts most where it has the lower variance.
+class LightSampler {
+public:
+    LightSampler() {}
+    LightSampler(const Hittable& world) {
+        world.collectEmitters(emitters);
+    }
+
+    bool isEmpty() const { return emitters.empty(); }
+    size_t getEmitterCount() const { return emitters.size(); }
+
+    double getPdfValue(const Point3& origin, const Vec3& direction, double time) const {
+        // Density of sampleDirectLight() choosing direction for a ray at time: one emitter is picked
+        // uniformly, then a direction towards it.
+        if (emitters.empty())
+            return 0;
+
+        double pdfSum = 0;
+        for (const Hittable* emitter : emitters)
+            pdfSum += emitter->getPdfValue(origin, direction, time);
+
+        return pdfSum / emitters.size();
+    }
+
+    double getEmissionWeight(const Point3& origin, const Vec3& direction, double time, double scatteringPdf) const {
+        // Multiple importance sampling weight (power heuristic) for emission that a scattered ray
+        // found, when the scattering vertex at origin also sampled the lights.
+        auto lightPdf = getPdfValue(origin, direction, time);
+        return getPowerHeuristic(scatteringPdf, lightPdf);
+    }
+
+    Color sampleDirectLight(const Hittable& world, const Ray& inputRay, const HitRecord& record) const {
+        // One-sample estimate of the light the material at record scatters towards inputRay straight
+        // from an emitter, weighted against the material's own sampling by the power heuristic.
+        if (emitters.empty())
+            return Color(0, 0, 0);
+
+        auto emitterCount = static_cast<int>(emitters.size());
+        getRandomStream().setDimension(LIGHT_CHOICE_DIMENSION);
+        auto emitterIndex = std::min(static_cast<int>(getRandomDouble() * emitterCount), emitterCount - 1);
+        const Hittable* emitter = emitters[emitterIndex];
+
+        getRandomStream().setDimension(LIGHT_DIRECTION_DIMENSION);
+        Vec3 toLight = emitter->getRandomDirection(record.hitPosition, inputRay.getTime());
+        Color scattering = record.material->evaluateScattering(inputRay, record, toLight);
+        if (scattering.isNearZero())
+            return Color(0, 0, 0);
+
+        auto lightPdf = getPdfValue(record.hitPosition, toLight, inputRay.getTime());
+        if (lightPdf <= 0)
+            return Color(0, 0, 0);
+
+        Ray shadowRay(record.hitPosition, toLight, inputRay.getTime());
+        HitRecord lightRecord;
+        if (!emitter->isHit(shadowRay, Interval(0.001, RT_INFINITY), lightRecord))
+            return Color(0, 0, 0);
+
+        // anything in front of the light point blocks it
+        bool isBlocked = world.isOccluded(shadowRay, Interval(0.001, lightRecord.hitTime * (1 - 1e-6)));
+        RT_RECORD_BVH_RAY(BVHRayKind::Secondary);
+        if (isBlocked)
+            return Color(0, 0, 0);
+
+        auto scatteringPdf = record.material->getScatteringPdf(inputRay, record, toLight);
+        auto weight = getPowerHeuristic(lightPdf, scatteringPdf);
+
+        Color emittedColor = lightRecord.material->getEmittedColor(lightRecord.u, lightRecord.v, lightRecord.hitPosition);
+        return scattering * emittedColor * (weight / lightPdf);
+    }
+
+private:
+    static double getPowerHeuristic(double pdf, double otherPdf) {
+        auto pdfSquared = pdf * pdf;
+        auto sum = pdfSquared + otherPdf * otherPdf;
+        return sum > 0 ? pdfSquared / sum : 0;
+    }
+
+    std::vector<const Hittable*> emitters;
+};
+
+#endif
@@ -0,0 +1,250 @@
+#ifndef LINEAR_BVH_H
+#define LINEAR_BVH_H
+
+#include "bvh.h"
+#include "mapped_file.h"
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// One node of a LinearBVH, 32 bytes, so two share a cache line.
+struct alignas(32) LinearBVHNode {
+    float bounds[2][3];             // min and max corner, rounded outwards from the double box
+    std::uint32_t offset;           // leaf: index of its first object; inner node: index of the second child
+    std::uint16_t objectCount;      // 0 for inner nodes, whose first child directly follows them
+    std::uint8_t  axis;             // inner node: axis the children are split along
+    std::uint8_t  padding;
+};
+
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should fill exactly half a cache line");
+
+// Traversal of a binary BVH flattened in depth-first order, shared by LinearBVH and MotionBVH. Nodes
+// have offset, objectCount and axis as in LinearBVHNode; only where their boxes come from differs,
+// which getBound(node, corner, axis) answers: the min (corner 0) or max (corner 1) of the box.
+// Returns the closest hit into record, or, for isAnyHit, whether there is any hit at all.
+template <bool isAnyHit, typename Node, typename BoundFunction>
+bool traverseFlattenedBVH(const Node* nodes, std::uint32_t rootIndex, const std::shared_ptr<Hittable>* objects,
+                          const Ray& inputRay, Interval timeIntervalToCheck, HitRecord* record, std::uint32_t* stack, const BoundFunction& getBound) {
+    const Point3& origin = inputRay.getOrigin();
+    const Vec3& inverseDirection = inputRay.getInverseDirection();
+    int isDirectionNegative[3] = { inputRay.isDirectionNegative(0), inputRay.isDirectionNegative(1), inputRay.isDirectionNegative(2) };
+
+    auto isBoxHit = [&](const Node& node, Interval timeInterval) {
+        // slab test; the near and far planes of each axis are picked by the sign of the direction
+        for (int axis = 0; axis < 3; ++axis) {
+            double timeNear = (getBound(node, isDirectionNegative[axis], axis) - origin[axis]) * inverseDirection[axis];
+            double timeFar = (getBound(node, 1 - isDirectionNegative[axis], axis) - origin[axis]) * inverseDirection[axis];
+            if (timeNear > timeInterval.min) timeInterval.min = timeNear;
+            if (timeFar < timeInterval.max) timeInterval.max = timeFar;
+            if (timeInterval.max <= timeInterval.min)
+                return false;
+        }
+        return true;
+    };
+
+    bool isHitAnything = false;
+    int stackSize = 0;
+    std::uint32_t currentNodeIndex = rootIndex;
+
+    while (true) {
+        const Node& node = nodes[currentNodeIndex];
+
+        RT_COUNT_BVH(boxTests, 1);
+        if (isBoxHit(node, timeIntervalToCheck)) {
+            RT_COUNT_BVH(nodeVisits, 1);
+            if (node.objectCount == 0) {
+                // inner node: go on with the near child, keep the far one for later
+                if (isDirectionNegative[node.axis]) {
+                    stack[stackSize++] = currentNodeIndex + 1;
+                    currentNodeIndex = node.offset;
+                }
+                else {
+                    stack[stackSize++] = node.offset;
+                    currentNodeIndex = currentNodeIndex + 1;
+                }
+                continue;
+            }
+
+            for (std::uint32_t currentObject = node.offset; currentObject < node.offset + node.objectCount; ++currentObject) {
+                RT_COUNT_BVH(objectTests, 1);
+                if constexpr (isAnyHit) {
+                    if (objects[currentObject]->isOccluded(inputRay, timeIntervalToCheck))
+                        return true;
+                }
+                else if (objects[currentObject]->isHit(inputRay, timeIntervalToCheck, *record)) {
+                    isHitAnything = true;
+                    timeIntervalToCheck.max = record->hitTime;
+                }
+            }
+        }
+
+        if (stackSize == 0)
+            return isHitAnything;
+        currentNodeIndex = stack[--stackSize];
+    }
+}
+
+template <bool isAnyHit, typename Node, typename BoundFunction>
+bool queryFlattenedBVH(const Node* nodes, std::uint32_t rootIndex, int maxDepth, const std::shared_ptr<Hittable>* objects,
+                       const Ray& inputRay, Interval timeIntervalToCheck, HitRecord* record, const BoundFunction& getBound) {
+    // deep trees need more than the stack array; they are rare enough to pay for a heap allocation
+    constexpr int MAX_STACK_SIZE = 64;
+    if (maxDepth < MAX_STACK_SIZE) {
+        std::uint32_t stack[MAX_STACK_SIZE];
+        return traverseFlattenedBVH<isAnyHit>(nodes, rootIndex, objects, inputRay, timeIntervalToCheck, record, stack, getBound);
+    }
+    std::vector<std::uint32_t> stack(maxDepth + 1);
+    return traverseFlattenedBVH<isAnyHit>(nodes, rootIndex, objects, inputRay, timeIntervalToCheck, record, stack.data(), getBound);
+}
+
+// A BVHNode tree flattened into one array in depth-first order, with the objects stored in leaf order.
+// Traversal is a loop over node indices with an explicit stack: no pointer chasing through scattered
+// heap blocks and no virtual call until a leaf's objects are tested. Children are visited near to
+// far along the split axis, so the far one is often culled by the closest hit found so far.
+class LinearBVH : public Hittable {
+public:
+    LinearBVH(HittableList list, const BVHBuildOptions& options = BVHBuildOptions()) : LinearBVH(BVHNode(list, options)) {}
+
+    LinearBVH(const BVHNode& tree) {
+        boundingBox = tree.getBoundingBox();
+#ifdef RT_BVH_STATISTICS
+        buildTreeStatistics = tree.getTreeStatistics();
+        buildTreeStatistics.structureName = "LinearBVH, build tree";
+#endif
+        if (!tree.isLeaf() || !tree.getLeafObjects().empty())     // an empty tree gets no nodes
+            flatten(tree, 0);
+    }
+
+    // a tree loaded from a BVH cache file, see bvh_cache.h
+    LinearBVH(NodeArray<LinearBVHNode> inputNodes, std::vector<std::shared_ptr<Hittable>> inputObjects, const AABB& inputBoundingBox, int inputMaxDepth)
+        : nodes(std::move(inputNodes)), objects(std::move(inputObjects)), boundingBox(inputBoundingBox), maxDepth(inputMaxDepth) {}
+
+    bool isHit(const Ray& inputRay, Interval timeIntervalToCheck, HitRecord& record) const override {
+        return query<false>(inputRay, timeIntervalToCheck, &record);
+    }
+
+    bool isOccluded(const Ray& inputRay, Interval timeIntervalToCheck) const override {
+        return query<true>(inputRay, timeIntervalToCheck, nullptr);
+    }
+
+    AABB getBoundingBox() const override { return boundingBox; }
+
+    void collectEmitters(std::vector<const Hittable*>& emitters) const override {
+        for (const auto& object : objects)
+            object->collectEmitters(emitters);
+    }
+
+    void collectTreeStatistics(std::vector<BVHTreeStatistics>& statistics) const override {
+#ifdef RT_BVH_STATISTICS
+        if (buildTreeStatistics.nodeCount > 0)
+            statistics.push_back(buildTreeStatistics);
+#endif
+        for (const auto& object : objects)
+            object->collectTreeStatistics(statistics);
+    }
+
+    void refit() override {
+        // Children come after their parent in depth-first order, so one backwards pass sees every
+        // child before its parent.
+        std::vector<AABB> nodeBoxes(nodes.size());
+        for (size_t currentNodeIndex = nodes.size(); currentNodeIndex-- > 0;) {
+            LinearBVHNode& node = nodes[currentNodeIndex];
+            AABB nodeBox = AABB::empty;
+
+            if (node.objectCount > 0) {
+                for (std::uint32_t currentObject = node.offset; currentObject < node.offset + node.objectCount; ++currentObject) {
+                    objects[currentObject]->refit();
+                    nodeBox = AABB(nodeBox, objects[currentObject]->getBoundingBox());
+                }
+            }
+            else
+                nodeBox = AABB(nodeBoxes[currentNodeIndex + 1], nodeBoxes[node.offset]);
+
+            nodeBoxes[currentNodeIndex] = nodeBox;
+            setBounds(node, nodeBox);
+        }
+        if (!nodes.empty())
+            boundingBox = nodeBoxes[0];
+    }
+
+    size_t getNodeCount() const { return nodes.size(); }
+    size_t getMemoryUsage() const { return nodes.size() * sizeof(LinearBVHNode) + objects.size() * sizeof(std::shared_ptr<Hittable>); }
+
+    const NodeArray<LinearBVHNode>& getNodes() const { return nodes; }
+    const std::vector<std::shared_ptr<Hittable>>& getObjects() const { return objects; }
+    int getMaxDepth() const { return maxDepth; }
+
+    bool isConsistent() const {
+        // What traversal relies on, for trees that were not built here: every link points forward and
+        // into the arrays, and no path is deeper than maxDepth, which sizes the traversal stack.
+        if (maxDepth < 0 || static_cast<size_t>(maxDepth) > nodes.size())
+            return false;
+
+        std::vector<int> depths(nodes.size(), 0);
+        for (size_t currentNodeIndex = 0; currentNodeIndex < nodes.size(); ++currentNodeIndex) {
+            const LinearBVHNode& node = nodes[currentNodeIndex];
+            if (node.objectCount > 0) {
+                if (static_cast<size_t>(node.offset) + node.objectCount > objects.size())
+                    return false;
+                continue;
+            }
+
+            if (node.axis > 2 || node.offset <= currentNodeIndex + 1 || node.offset >= nodes.size() || depths[currentNodeIndex] + 1 > maxDepth)
+                return false;
+            for (size_t child : { currentNodeIndex + 1, static_cast<size_t>(node.offset) })
+                depths[child] = std::max(depths[child], depths[currentNodeIndex] + 1);
+        }
+        return true;
+    }
+
+private:
+    std::uint32_t flatten(const BVHNode& treeNode, int depth) {
+        // appends treeNode and its subtree depth-first and returns its index
+        auto nodeIndex = static_cast<std::uint32_t>(nodes.size());
+        nodes.emplace_back();
+        setBounds(nodes[nodeIndex], treeNode.getBoundingBox());
+        maxDepth = std::max(maxDepth, depth);
+
+        if (treeNode.isLeaf()) {
+            nodes[nodeIndex].offset = static_cast<std::uint32_t>(objects.size());
+            nodes[nodeIndex].objectCount = static_cast<std::uint16_t>(treeNode.getLeafObjects().size());
+            objects.insert(objects.end(), treeNode.getLeafObjects().begin(), treeNode.getLeafObjects().end());
+            return nodeIndex;
+        }
+
+        nodes[nodeIndex].axis = static_cast<std::uint8_t>(treeNode.getSplitAxis());
+        flatten(treeNode.getLeftChild(), depth + 1);
+        nodes[nodeIndex].offset = flatten(treeNode.getRightChild(), depth + 1);
+        return nodeIndex;
+    }
+
+    static void setBounds(LinearBVHNode& node, const AABB& box) {
+        // floats are rounded outwards, so the node box still contains the double box
+        for (int axis = 0; axis < 3; ++axis) {
+            const Interval& interval = box.getAxisInterval(axis);
+            auto min = static_cast<float>(interval.min);
+            auto max = static_cast<float>(interval.max);
+            node.bounds[0][axis] = (min > interval.min) ? std::nextafter(min, -HUGE_VALF) : min;
+            node.bounds[1][axis] = (max < interval.max) ? std::nextafter(max, HUGE_VALF) : max;
+        }
+    }
+
+    template <bool isAnyHit>
+    bool query(const Ray& inputRay, Interval timeIntervalToCheck, HitRecord* record) const {
+        if (nodes.empty())
+            return false;
+        return queryFlattenedBVH<isAnyHit>(nodes.data(), 0, maxDepth, objects.data(), inputRay, timeIntervalToCheck, record,
+            [](const LinearBVHNode& node, int corner, int axis) { return node.bounds[corner][axis]; });
+    }
+
+    NodeArray<LinearBVHNode> nodes;
+    std::vector<std::shared_ptr<Hittable>> objects;     // in leaf order
+    AABB boundingBox;
+    int maxDepth = 0;
+#ifdef RT_BVH_STATISTICS
+    BVHTreeStatistics buildTreeStatistics;  // of the BVHNode it was built from; empty when loaded from a BVH cache
+#endif
+};
+
+#endif
@@ -0,0 +1,141 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A whole file in memory. On POSIX systems it is mapped, so pages are only read from disk when they are
+// first touched; the mapping is private, so writes to it change this process's copy and never the file.
+// Elsewhere the file is read into memory.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& fileName) {
+#ifndef _WIN32
+        int descriptor = ::open(fileName.c_str(), O_RDONLY);
+        if (descriptor < 0)
+            return;
+
+        struct stat fileStatus;
+        if (::fstat(descriptor, &fileStatus) == 0 && fileStatus.st_size > 0) {
+            void* mapping = ::mmap(nullptr, static_cast<size_t>(fileStatus.st_size), PROT_READ | PROT_WRITE, MAP_PRIVATE, descriptor, 0);
+            if (mapping != MAP_FAILED) {
+                data = static_cast<unsigned char*>(mapping);
+                size = static_cast<size_t>(fileStatus.st_size);
+            }
+        }
+        ::close(descriptor);      // the mapping stays valid without it
+#else
+        std::ifstream in(fileName, std::ios::binary | std::ios::ate);
+        if (!in)
+            return;
+
+        auto fileSize = static_cast<size_t>(in.tellg());
+        // cache line sized blocks, so nodes read from the file are aligned like in a mapping
+        buffer.resize((fileSize + sizeof(AlignedBlock) - 1) / sizeof(AlignedBlock));
+        in.seekg(0);
+        if (fileSize > 0 && in.read(reinterpret_cast<char*>(buffer.data()), fileSize)) {
+            data = reinterpret_cast<unsigned char*>(buffer.data());
+            size = fileSize;
+        }
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+#ifndef _WIN32
+        if (data)
+            ::munmap(data, size);
+#endif
+    }
+
+    bool isOpen() const { return data != nullptr; }
+    unsigned char* getData() const { return data; }
+    size_t getSize() const { return size; }
+
+private:
+#ifdef _WIN32
+    struct alignas(64) AlignedBlock {
+        unsigned char bytes[64];
+    };
+#endif
+
+    unsigned char* data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    std::vector<AlignedBlock> buffer;
+#endif
+};
+
+// The node array of a flattened BVH: either built in memory, or a view into a MappedFile, which it
+// keeps open. Both are read and written the same way, so traversal and refit don't care which it is.
+template <typename Node>
+class NodeArray {
+public:
+    NodeArray() {}
+
+    NodeArray(std::shared_ptr<MappedFile> inputFile, size_t byteOffset, size_t inputCount)
+        : file(std::move(inputFile)), nodes(reinterpret_cast<Node*>(file->getData() + byteOffset)), count(inputCount) {}
+
+    // A copy owns its nodes. The mapping of a file is shared and writable, so copies of a mapped array
+    // read the nodes into memory; otherwise refitting one copy would move the boxes of all of them.
+    NodeArray(const NodeArray& other) : builtNodes(other.nodes, other.nodes + other.count), nodes(builtNodes.data()), count(other.count) {}
+
+    NodeArray& operator=(const NodeArray& other) {
+        if (this != &other)
+            *this = NodeArray(other);
+        return *this;
+    }
+
+    NodeArray(NodeArray&& other) noexcept
+        : builtNodes(std::move(other.builtNodes)), file(std::move(other.file)), nodes(other.nodes), count(other.count) {
+        other.nodes = nullptr;
+        other.count = 0;
+    }
+
+    NodeArray& operator=(NodeArray&& other) noexcept {
+        if (this != &other) {
+            builtNodes = std::move(other.builtNodes);
+            file = std::move(other.file);
+            nodes = other.nodes;
+            count = other.count;
+            other.nodes = nullptr;
+            other.count = 0;
+        }
+        return *this;
+    }
+
+    Node& operator[](size_t index) { return nodes[index]; }
+    const Node& operator[](size_t index) const { return nodes[index]; }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const Node* data() const { return nodes; }
+
+    void emplace_back() {
+        // only while building
+        builtNodes.emplace_back();
+        nodes = builtNodes.data();
+        count = builtNodes.size();
+    }
+
+private:
+    std::vector<Node> builtNodes;
+    std::shared_ptr<MappedFile> file;
+    Node* nodes = nullptr;      // builtNodes.data() or into the file
+    size_t count = 0;
+};
+
+#endif
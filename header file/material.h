@@ -2,18 +2,64 @@
 #define MATERIAL_H
 
 #include "hittable.h"
+#include "onb.h"
 #include "texture.h"
 
+// Used by the wavefront engine to shade all hits of one kind of material together.
+enum class MaterialType {
+    Lambertian,
+    Metal,
+    Dielectric,
+    DiffuseLight,
+    Isotropic,
+    Other,
+    Count
+};
+
+struct ScatterRecord {
+    Ray scatteredRay;
+    Color attenuation;      // sample weight: BSDF * cosine / pdf for scatteredRay's direction
+    double pdf = 0;         // solid angle density of scatteredRay's direction
+    bool isSpecular = true;     // a single possible direction, which can't be evaluated or light sampled;
+                                // left true by materials that never scatter, like lights
+};
+
 class Material {
 public:
     virtual ~Material() = default;
 
-    virtual bool doesScatter(const Ray &inputRay, const HitRecord &record, Color &attenuation, Ray &scatteredRay) const {
+    virtual MaterialType getType() const {
+        return MaterialType::Other;
+    }
+
+    // Returns false when the path is absorbed. isSpecular and pdf are filled in either way, since
+    // light sampling at the hit doesn't depend on the direction that was drawn.
+    virtual bool doesScatter(const Ray &inputRay, const HitRecord &record, ScatterRecord &scatterRecord) const {
         return false;
     }
+
+    // For non-specular materials: the BSDF times the cosine term for light leaving along direction,
+    // and the density with which doesScatter() picks direction. evaluateScattering / getScatteringPdf
+    // equals the attenuation doesScatter() reports for that direction.
+    virtual Color evaluateScattering(const Ray& inputRay, const HitRecord& record, const Vec3& direction) const {
+        return Color(0, 0, 0);
+    }
+    virtual double getScatteringPdf(const Ray& inputRay, const HitRecord& record, const Vec3& direction) const {
+        return 0;
+    }
+
     virtual Color getEmittedColor(double u, double v, const Point3& hitPosition) const {
         return Color(0, 0, 0);
     }
+    virtual bool isEmissive() const {
+        // objects with an emissive material are collected for light sampling
+        return false;
+    }
+
+    virtual Color getAlbedo(const HitRecord& record) const {
+        // surface color for the denoiser's albedo buffer
+        return Color(1, 1, 1);
+    }
 };
 
 class Lambertian : public Material {
@@ -21,18 +67,38 @@ public:
     Lambertian(const Color& inputAlbedo) : texture(std::make_shared<ConstantTexture>(inputAlbedo)) {}
     Lambertian(std::shared_ptr<Texture> inputTexture) : texture(inputTexture) {}
 
-    bool doesScatter(const Ray &inputRay, const HitRecord &record, Color &attenuation, Ray &scatteredRay) const override {
-        auto scatteredVector = record.normalizedVector + getRandomUnitVector();
+    MaterialType getType() const override {
+        return MaterialType::Lambertian;
+    }
 
-        // handling invalid scattering
-        if (scatteredVector.isNearZero())
-            scatteredVector = record.normalizedVector;
+    bool doesScatter(const Ray &inputRay, const HitRecord &record, ScatterRecord &scatterRecord) const override {
+        // cosine-weighted hemisphere sampling, so BSDF * cosine / pdf is just the albedo
+        ONB uvw(record.normalizedVector);
+        auto scatteredVector = uvw.transform(getRandomCosineDirection());
 
-        scatteredRay = Ray(record.hitPosition, scatteredVector, inputRay.getTime());
-        attenuation = texture->getColor(record.u, record.v, record.hitPosition);
+        scatterRecord.scatteredRay = Ray(record.hitPosition, scatteredVector, inputRay.getTime());
+        scatterRecord.attenuation = texture->getColor(record.u, record.v, record.hitPosition);
+        scatterRecord.pdf = performDot(uvw.getW(), scatteredVector) / PI;
+        scatterRecord.isSpecular = false;
         return true;
     }
 
+    Color evaluateScattering(const Ray& inputRay, const HitRecord& record, const Vec3& direction) const override {
+        auto cosine = performDot(record.normalizedVector, getUnitVector(direction));
+        if (cosine <= 0)
+            return Color(0, 0, 0);
+        return texture->getColor(record.u, record.v, record.hitPosition) * (cosine / PI);
+    }
+
+    double getScatteringPdf(const Ray& inputRay, const HitRecord& record, const Vec3& direction) const override {
+        auto cosine = performDot(record.normalizedVector, getUnitVector(direction));
+        return cosine < 0 ? 0 : cosine / PI;
+    }
+
+    Color getAlbedo(const HitRecord& record) const override {
+        return texture->getColor(record.u, record.v, record.hitPosition);
+    }
+
 private:
     std::shared_ptr<Texture> texture;
 };
@@ -41,23 +107,70 @@ private:
 class Metal : public Material {
 public:
     Metal(const Color& inputAlbedo, double inputFuzz) : albedo(inputAlbedo), fuzz(inputFuzz) {
-        if (inputFuzz < -1)
-            inputFuzz = -1;
-        else if (inputFuzz > 1)
-            inputFuzz = 1;
+        if (fuzz < 0)
+            fuzz = 0;
+        else if (fuzz > 1)
+            fuzz = 1;
+
+        // A fuzzy reflection is spread uniformly over the cone of directions that
+        // "mirror direction + fuzz * unit sphere" can reach.
+        cosThetaMax = std::sqrt(1 - fuzz * fuzz);
+    }
+
+    MaterialType getType() const override {
+        return MaterialType::Metal;
     }
 
-    bool doesScatter(const Ray &inputRay, const HitRecord &record, Color &attenuation, Ray &scatteredRay) const override {
-        Vec3 reflectedVector = getReflectedMirror(inputRay.getDirection(), record.normalizedVector);
-        reflectedVector = getUnitVector(reflectedVector) + (fuzz * getRandomUnitVector());
-        scatteredRay = Ray(record.hitPosition, reflectedVector, inputRay.getTime());
-        attenuation = albedo;
-        return (performDot(scatteredRay.getDirection(), record.normalizedVector) > 0);
+    bool doesScatter(const Ray &inputRay, const HitRecord &record, ScatterRecord &scatterRecord) const override {
+        Vec3 reflectedVector = getUnitVector(getReflectedMirror(inputRay.getDirection(), record.normalizedVector));
+        scatterRecord.attenuation = albedo;
+
+        if (fuzz <= 0) {
+            scatterRecord.scatteredRay = Ray(record.hitPosition, reflectedVector, inputRay.getTime());
+            scatterRecord.pdf = 0;
+            scatterRecord.isSpecular = true;
+            return true;
+        }
+
+        ONB uvw(reflectedVector);
+        auto scatteredVector = uvw.transform(getRandomInCone(cosThetaMax));
+        scatterRecord.scatteredRay = Ray(record.hitPosition, scatteredVector, inputRay.getTime());
+        scatterRecord.pdf = getConePdf();
+        scatterRecord.isSpecular = false;
+
+        // directions of the lobe that point into the surface are absorbed
+        return (performDot(scatteredVector, record.normalizedVector) > 0);
+    }
+
+    Color evaluateScattering(const Ray& inputRay, const HitRecord& record, const Vec3& direction) const override {
+        // chosen so that evaluateScattering / getScatteringPdf is the albedo, like doesScatter() reports
+        return getScatteringPdf(inputRay, record, direction) * albedo;
+    }
+
+    double getScatteringPdf(const Ray& inputRay, const HitRecord& record, const Vec3& direction) const override {
+        if (fuzz <= 0)
+            return 0;
+
+        Vec3 unitDirection = getUnitVector(direction);
+        if (performDot(unitDirection, record.normalizedVector) <= 0)
+            return 0;
+
+        Vec3 reflectedVector = getUnitVector(getReflectedMirror(inputRay.getDirection(), record.normalizedVector));
+        return performDot(unitDirection, reflectedVector) >= cosThetaMax ? getConePdf() : 0;
+    }
+
+    Color getAlbedo(const HitRecord& record) const override {
+        return albedo;
     }
 
 private:
+    double getConePdf() const {
+        return 1 / (2 * PI * (1 - cosThetaMax));
+    }
+
     Color albedo;
     double fuzz;
+    double cosThetaMax;     // cosine of the half angle of the fuzzy reflection lobe
 };
 
 
@@ -65,8 +178,14 @@ class Dielectric : public Material {
 public:
     Dielectric(double inputRefractionIndex) : refractionIndex(inputRefractionIndex) {}
 
-    bool doesScatter(const Ray &inputRay, const HitRecord &record, Color &attenuation, Ray &scatteredRay) const override {
-        attenuation = Color(1.0, 1.0, 1.0);
+    MaterialType getType() const override {
+        return MaterialType::Dielectric;
+    }
+
+    bool doesScatter(const Ray &inputRay, const HitRecord &record, ScatterRecord &scatterRecord) const override {
+        scatterRecord.attenuation = Color(1.0, 1.0, 1.0);
+        scatterRecord.pdf = 0;
+        scatterRecord.isSpecular = true;
         double finalRefractionIndex = record.isFrontFace ? (1.0 / refractionIndex) : refractionIndex;
 
         Vec3 normalizedInputVector = getUnitVector(inputRay.getDirection());
@@ -80,7 +199,7 @@ public:
         else
             finalRay = getRefracted(normalizedInputVector, record.normalizedVector, finalRefractionIndex);
 
-        scatteredRay = Ray(record.hitPosition, finalRay, inputRay.getTime());
+        scatterRecord.scatteredRay = Ray(record.hitPosition, finalRay, inputRay.getTime());
         return true;
     }
 
@@ -102,6 +221,10 @@ public:
     DiffuseLight(std::shared_ptr<Texture> inputTexture) : texture(inputTexture) {}
     DiffuseLight(const Color& emit) : texture(std::make_shared<ConstantTexture>(emit)) {}
 
+    MaterialType getType() const override {
+        return MaterialType::DiffuseLight;
+    }
+
     // DiffuseLight doens't perform reflection
     // Hence, only DiffuseLight returns false when the camera calls doesScatter() for Material objects
 
@@ -110,6 +233,16 @@ public:
         return texture->getColor(u, v, hitPosition);
     }
 
+    bool isEmissive() const override {
+        return true;
+    }
+
+    Color getAlbedo(const HitRecord& record) const override {
+        // the emitted color, clamped to a valid reflectance
+        Color emittedColor = getEmittedColor(record.u, record.v, record.hitPosition);
+        return Color(std::fmin(emittedColor.getX(), 1.0), std::fmin(emittedColor.getY(), 1.0), std::fmin(emittedColor.getZ(), 1.0));
+    }
+
 private:
     std::shared_ptr<Texture> texture;
 };
@@ -119,12 +252,31 @@ public:
     Isotropic(const Color& albedo) : texture(std::make_shared<ConstantTexture>(albedo)) {}
     Isotropic(std::shared_ptr<Texture> inputTexture) : texture(inputTexture) {}
 
-    bool doesScatter(const Ray& inputRay, const HitRecord& record, Color& attenuation, Ray& scatteredRay) const override {
-        scatteredRay = Ray(record.hitPosition, getRandomUnitVector(), inputRay.getTime());
-        attenuation = texture->getColor(record.u, record.v, record.hitPosition);
+    MaterialType getType() const override {
+        return MaterialType::Isotropic;
+    }
+
+    bool doesScatter(const Ray& inputRay, const HitRecord& record, ScatterRecord& scatterRecord) const override {
+        scatterRecord.scatteredRay = Ray(record.hitPosition, getRandomUnitVector(), inputRay.getTime());
+        scatterRecord.attenuation = texture->getColor(record.u, record.v, record.hitPosition);
+        scatterRecord.pdf = 1 / (4 * PI);
+        scatterRecord.isSpecular = false;
         return true;
     }
 
+    Color evaluateScattering(const Ray& inputRay, const HitRecord& record, const Vec3& direction) const override {
+        // phase function of uniform scattering; there is no cosine term inside a medium
+        return texture->getColor(record.u, record.v, record.hitPosition) / (4 * PI);
+    }
+
+    double getScatteringPdf(const Ray& inputRay, const HitRecord& record, const Vec3& direction) const override {
+        return 1 / (4 * PI);
+    }
+
+    Color getAlbedo(const HitRecord& record) const override {
+        return texture->getColor(record.u, record.v, record.hitPosition);
+    }
+
 private:
     std::shared_ptr<Texture> texture;
 };
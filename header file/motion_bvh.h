@@ -0,0 +1,248 @@
+#ifndef MOTION_BVH_H
+#define MOTION_BVH_H
+
+#include "bvh.h"
+#include "bvh_statistics.h"
+#include "linear_bvh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// One node of a MotionBVH: its box at the start and at the end of its tree's time range.
+struct alignas(64) MotionBVHNode {
+    float bounds[2][2][3];          // [start, end of the time range][min, max corner][axis], rounded outwards
+    std::uint32_t offset;           // leaf: index of its first object; inner node: index of the second child
+    std::uint16_t objectCount;      // 0 for inner nodes, whose first child directly follows them
+    std::uint8_t  axis;             // inner node: axis the children are split along
+    std::uint8_t  padding;
+};
+
+struct MotionBVHOptions {
+    int    maxTimeSegmentCount = 1;     // temporal splits: up to this many trees, each over an equal part of the shutter
+    double timeSplitThreshold = 1.5;    // split while the objects' boxes swept over a part average this much more area than at its ends
+};
+
+// BVH for motion blur. A BVHNode over moving objects holds the box around all their positions during
+// the shutter, so every ray pays for the whole sweep. Here each node keeps its box at the start and at
+// the end of the shutter, and a ray tests the box interpolated to its own time, which is only as big as
+// the objects are at that time. The hierarchy is built by BVHNode over the swept boxes and flattened
+// like LinearBVH.
+// Fast objects still make the sweep, and so the tree, poor. Temporal splits cut the shutter into equal
+// parts with a tree each, built over what the objects sweep in that part only; a ray picks the tree of
+// its time. The shutter is halved again while the boxes swept over a part are, on average, more than
+// timeSplitThreshold times the area of the boxes at its ends. Every tree references every object, so
+// each part costs one more tree.
+// Ray times are expected in [0, 1]; times outside use the boxes at the nearest end.
+class MotionBVH : public Hittable {
+public:
+    MotionBVH(HittableList list, const BVHBuildOptions& options = BVHBuildOptions(), const MotionBVHOptions& motionOptions = MotionBVHOptions())
+        : sceneObjectCount(list.objects.size()) {
+        if (list.objects.empty())
+            return;
+
+        timeSegmentCount = getTimeSegmentCount(list, motionOptions);
+        for (int segment = 0; segment < timeSegmentCount; ++segment) {
+            // the tree of this part is built over what each object sweeps in it
+            HittableList sweptList;
+            for (const auto& object : list.objects)
+                sweptList.add(std::make_shared<SweptObject>(object, getSegmentStart(segment), getSegmentStart(segment + 1)));
+
+            segmentRoots.push_back(static_cast<std::uint32_t>(nodes.size()));
+            BVHNode tree(sweptList, options);
+            flatten(tree, 0);
+#ifdef RT_BVH_STATISTICS
+            segmentStatistics.push_back(tree.getTreeStatistics());
+            segmentStatistics.back().structureName = "MotionBVH, build tree of one time segment";
+#endif
+        }
+        updateBounds();
+    }
+
+    bool isHit(const Ray& inputRay, Interval timeIntervalToCheck, HitRecord& record) const override {
+        return query<false>(inputRay, timeIntervalToCheck, &record);
+    }
+
+    bool isOccluded(const Ray& inputRay, Interval timeIntervalToCheck) const override {
+        return query<true>(inputRay, timeIntervalToCheck, nullptr);
+    }
+
+    AABB getBoundingBox() const override { return boundingBox; }
+
+    AABB getBoundingBoxAtTime(double time) const override {
+        if (nodes.empty())
+            return AABB();
+
+        double fraction;
+        const MotionBVHNode& root = nodes[segmentRoots[getSegment(time, fraction)]];
+        Point3 min, max;
+        for (int axis = 0; axis < 3; ++axis) {
+            min[axis] = getInterpolated(root, 0, axis, fraction);
+            max[axis] = getInterpolated(root, 1, axis, fraction);
+        }
+        return AABB(min, max);
+    }
+
+    void collectEmitters(std::vector<const Hittable*>& emitters) const override {
+        // the first tree alone references every object once
+        for (size_t currentObject = 0; currentObject < sceneObjectCount; ++currentObject)
+            objects[currentObject]->collectEmitters(emitters);
+    }
+
+    void collectTreeStatistics(std::vector<BVHTreeStatistics>& statistics) const override {
+#ifdef RT_BVH_STATISTICS
+        statistics.insert(statistics.end(), segmentStatistics.begin(), segmentStatistics.end());
+#endif
+        for (size_t currentObject = 0; currentObject < sceneObjectCount; ++currentObject)
+            objects[currentObject]->collectTreeStatistics(statistics);
+    }
+
+    void refit() override {
+        // Objects move their start and end positions; the hierarchies stay.
+        for (size_t currentObject = 0; currentObject < sceneObjectCount; ++currentObject)
+            objects[currentObject]->refit();
+        updateBounds();
+    }
+
+    int getTimeSegmentCount() const { return timeSegmentCount; }
+    size_t getNodeCount() const { return nodes.size(); }
+    size_t getMemoryUsage() const { return nodes.size() * sizeof(MotionBVHNode) + objects.size() * sizeof(std::shared_ptr<Hittable>); }
+
+private:
+    // Stands in for an object while the tree of one time range is built, with the box the object sweeps in it.
+    class SweptObject : public Hittable {
+    public:
+        SweptObject(std::shared_ptr<Hittable> inputObject, double startTime, double endTime)
+            : object(inputObject), boundingBox(object->getBoundingBoxAtTime(startTime), object->getBoundingBoxAtTime(endTime)) {}
+
+        bool isHit(const Ray& inputRay, Interval timeIntervalToCheck, HitRecord& record) const override {
+            return object->isHit(inputRay, timeIntervalToCheck, record);
+        }
+
+        AABB getBoundingBox() const override { return boundingBox; }
+
+        std::shared_ptr<Hittable> object;
+        AABB boundingBox;
+    };
+
+    static int getTimeSegmentCount(const HittableList& list, const MotionBVHOptions& motionOptions) {
+        int segmentCount = 1;
+        while (segmentCount * 2 <= motionOptions.maxTimeSegmentCount) {
+            // average over objects of swept area / area at the ends, so small fast objects count as much as big still ones
+            double growthSum = 0;
+            for (const auto& object : list.objects) {
+                for (int segment = 0; segment < segmentCount; ++segment) {
+                    AABB startBox = object->getBoundingBoxAtTime(static_cast<double>(segment) / segmentCount);
+                    AABB endBox = object->getBoundingBoxAtTime(static_cast<double>(segment + 1) / segmentCount);
+                    double endArea = 0.5 * (startBox.getSurfaceArea() + endBox.getSurfaceArea());
+                    growthSum += (endArea > 0) ? AABB(startBox, endBox).getSurfaceArea() / endArea : 1;
+                }
+            }
+            if (growthSum / (static_cast<double>(list.objects.size()) * segmentCount) <= motionOptions.timeSplitThreshold)
+                break;
+            segmentCount *= 2;
+        }
+        return segmentCount;
+    }
+
+    double getSegmentStart(int segment) const { return static_cast<double>(segment) / timeSegmentCount; }
+
+    int getSegment(double time, double& fraction) const {
+        // the tree for time, and where time lies in its range, from 0 at its start to 1 at its end
+        double scaledTime = std::clamp(time, 0.0, 1.0) * timeSegmentCount;
+        int segment = std::min(static_cast<int>(scaledTime), timeSegmentCount - 1);
+        fraction = scaledTime - segment;
+        return segment;
+    }
+
+    std::uint32_t flatten(const BVHNode& treeNode, int depth) {
+        // appends treeNode and its subtree depth-first and returns its index; bounds come later from updateBounds
+        auto nodeIndex = static_cast<std::uint32_t>(nodes.size());
+        nodes.emplace_back();
+        maxDepth = std::max(maxDepth, depth);
+
+        if (treeNode.isLeaf()) {
+            nodes[nodeIndex].offset = static_cast<std::uint32_t>(objects.size());
+            nodes[nodeIndex].objectCount = static_cast<std::uint16_t>(treeNode.getLeafObjects().size());
+            for (const auto& sweptObject : treeNode.getLeafObjects())
+                objects.push_back(static_cast<const SweptObject&>(*sweptObject).object);
+            return nodeIndex;
+        }
+
+        nodes[nodeIndex].axis = static_cast<std::uint8_t>(treeNode.getSplitAxis());
+        flatten(treeNode.getLeftChild(), depth + 1);
+        nodes[nodeIndex].offset = flatten(treeNode.getRightChild(), depth + 1);
+        return nodeIndex;
+    }
+
+    void updateBounds() {
+        // One backwards pass over each tree sees every child before its parent, as in LinearBVH::refit.
+        // The trees lie one after the other, and each tree's nodes use its own time range.
+        std::vector<AABB> nodeBoxes[2] = { std::vector<AABB>(nodes.size()), std::vector<AABB>(nodes.size()) };
+        boundingBox = AABB();
+
+        for (int segment = timeSegmentCount; segment-- > 0;) {
+            size_t segmentEnd = (segment + 1 < timeSegmentCount) ? segmentRoots[segment + 1] : nodes.size();
+            double times[2] = { getSegmentStart(segment), getSegmentStart(segment + 1) };
+
+            for (size_t currentNodeIndex = segmentEnd; currentNodeIndex-- > segmentRoots[segment];) {
+                MotionBVHNode& node = nodes[currentNodeIndex];
+                for (int end = 0; end < 2; ++end) {
+                    AABB nodeBox = AABB::empty;
+                    if (node.objectCount > 0) {
+                        for (std::uint32_t currentObject = node.offset; currentObject < node.offset + node.objectCount; ++currentObject)
+                            nodeBox = AABB(nodeBox, objects[currentObject]->getBoundingBoxAtTime(times[end]));
+                    }
+                    else
+                        nodeBox = AABB(nodeBoxes[end][currentNodeIndex + 1], nodeBoxes[end][node.offset]);
+
+                    nodeBoxes[end][currentNodeIndex] = nodeBox;
+                    setBounds(node, end, nodeBox);
+                }
+            }
+            boundingBox = AABB(boundingBox, AABB(nodeBoxes[0][segmentRoots[segment]], nodeBoxes[1][segmentRoots[segment]]));
+        }
+    }
+
+    static void setBounds(MotionBVHNode& node, int end, const AABB& box) {
+        // floats are rounded outwards, so the node box still contains the double box
+        for (int axis = 0; axis < 3; ++axis) {
+            const Interval& interval = box.getAxisInterval(axis);
+            auto min = static_cast<float>(interval.min);
+            auto max = static_cast<float>(interval.max);
+            node.bounds[end][0][axis] = (min > interval.min) ? std::nextafter(min, -HUGE_VALF) : min;
+            node.bounds[end][1][axis] = (max < interval.max) ? std::nextafter(max, HUGE_VALF) : max;
+        }
+    }
+
+    static double getInterpolated(const MotionBVHNode& node, int corner, int axis, double fraction) {
+        double start = node.bounds[0][corner][axis];
+        return start + fraction * (node.bounds[1][corner][axis] - start);
+    }
+
+    template <bool isAnyHit>
+    bool query(const Ray& inputRay, Interval timeIntervalToCheck, HitRecord* record) const {
+        // LinearBVH's traversal, testing each box at the ray's time in the tree of that time
+        if (nodes.empty())
+            return false;
+
+        double fraction;
+        std::uint32_t rootIndex = segmentRoots[getSegment(inputRay.getTime(), fraction)];
+        return queryFlattenedBVH<isAnyHit>(nodes.data(), rootIndex, maxDepth, objects.data(), inputRay, timeIntervalToCheck, record,
+            [fraction](const MotionBVHNode& node, int corner, int axis) { return getInterpolated(node, corner, axis, fraction); });
+    }
+
+    std::vector<MotionBVHNode> nodes;                   // the trees one after the other, each in depth-first order
+    std::vector<std::uint32_t> segmentRoots;            // root node of each part of the shutter
+    std::vector<std::shared_ptr<Hittable>> objects;     // in leaf order, tree after tree
+    size_t sceneObjectCount;
+    int timeSegmentCount = 0;
+    AABB boundingBox;
+    int maxDepth = 0;
+#ifdef RT_BVH_STATISTICS
+    std::vector<BVHTreeStatistics> segmentStatistics;   // of the BVHNode built for each part of the shutter
+#endif
+};
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef ONB_H
+#define ONB_H
+
+#include "ray_utility.h"
+
+// Orthonormal basis whose w axis is a given direction, used to turn samples
+// generated around +Z into samples around any direction.
+class ONB {
+public:
+    ONB(const Vec3& n) {
+        axis[2] = getUnitVector(n);
+        Vec3 a = (std::fabs(axis[2].getX()) > 0.9) ? Vec3(0, 1, 0) : Vec3(1, 0, 0);
+        axis[1] = getUnitVector(performCross(axis[2], a));
+        axis[0] = performCross(axis[2], axis[1]);
+    }
+
+    const Vec3& getU() const { return axis[0]; }
+    const Vec3& getV() const { return axis[1]; }
+    const Vec3& getW() const { return axis[2]; }
+
+    Vec3 transform(const Vec3& v) const {
+        // Transform from basis coordinates to local space.
+        return (v[0] * axis[0]) + (v[1] * axis[1]) + (v[2] * axis[2]);
+    }
+
+private:
+    Vec3 axis[3];
+};
+
+inline Vec3 getRandomCosineDirection() {
+    // Direction in the +Z hemisphere with density cos(theta) / PI, without rejection sampling.
+    auto r1 = getRandomDouble();
+    auto r2 = getRandomDouble();
+
+    auto phi = 2 * PI * r1;
+    auto x = std::cos(phi) * std::sqrt(r2);
+    auto y = std::sin(phi) * std::sqrt(r2);
+    auto z = std::sqrt(1 - r2);
+
+    return Vec3(x, y, z);
+}
+
+inline Vec3 getRandomInCone(double cosThetaMax) {
+    // Direction uniformly distributed over the cone around +Z with the given half angle.
+    auto r1 = getRandomDouble();
+    auto r2 = getRandomDouble();
+    auto z = 1 - r2 * (1 - cosThetaMax);
+
+    auto phi = 2 * PI * r1;
+    auto x = std::cos(phi) * std::sqrt(1 - z * z);
+    auto y = std::sin(phi) * std::sqrt(1 - z * z);
+
+    return Vec3(x, y, z);
+}
+
+inline Vec3 getRandomToSphere(double radius, double distanceSquared) {
+    // Direction (around +Z) to a uniformly chosen point of the cone that a sphere of the given radius,
+    // whose center is at the given squared distance along +Z, covers.
+    auto r1 = getRandomDouble();
+    auto r2 = getRandomDouble();
+    auto z = 1 + r2 * (std::sqrt(1 - radius * radius / distanceSquared) - 1);
+
+    auto phi = 2 * PI * r1;
+    auto x = std::cos(phi) * std::sqrt(1 - z * z);
+    auto y = std::sin(phi) * std::sqrt(1 - z * z);
+
+    return Vec3(x, y, z);
+}
+
+#endif
@@ -5,13 +5,21 @@
 
 class Perlin {
 public:
-    Perlin() {
-        for (int currentPoint = 0; currentPoint < POINT_COUNT; ++currentPoint)
-            tableVector[currentPoint] = getUnitVector(Vec3::getRandomVector(-1,1));
+    // the seed of the default constructor comes from the thread's random stream, so
+    // every Perlin of a scene gets its own tables and the scene still builds the same every run
+    Perlin() : Perlin(getRandomStream().getBits()) {}
+
+    explicit Perlin(std::uint64_t seed) {
+        RandomStream random(seed);
+
+        for (int currentPoint = 0; currentPoint < POINT_COUNT; ++currentPoint) {
+            Vec3 randomVector(random.getDouble() * 2 - 1, random.getDouble() * 2 - 1, random.getDouble() * 2 - 1);
+            tableVector[currentPoint] = getUnitVector(randomVector);
+        }
 
-        generatePermutationTable(tablePermutationX);
-        generatePermutationTable(tablePermutationY);
-        generatePermutationTable(tablePermutationZ);
+        generatePermutationTable(tablePermutationX, random);
+        generatePermutationTable(tablePermutationY, random);
+        generatePermutationTable(tablePermutationZ, random);
     }
 
     double getNoise(const Point3& hitPosition) const {
@@ -55,16 +63,16 @@ public:
     }
 
 private:
-    static void generatePermutationTable(int* currentTable) {
+    static void generatePermutationTable(int* currentTable, RandomStream& random) {
         for (int currentPoint = 0; currentPoint < POINT_COUNT; ++currentPoint)
             currentTable[currentPoint] = currentPoint;
 
-        permute(currentTable, POINT_COUNT);
+        permute(currentTable, POINT_COUNT, random);
     }
 
-    static void permute(int* currentTable, const int END_POINT) {
+    static void permute(int* currentTable, const int END_POINT, RandomStream& random) {
         for (int currentPoint = END_POINT - 1; currentPoint > 0; --currentPoint) {
-            int target = getRandomInt(0, currentPoint);
+            int target = static_cast<int>(random.getDouble() * (currentPoint + 1));
             int tempValue = currentTable[currentPoint];
             currentTable[currentPoint] = currentTable[target];
             currentTable[target] = tempValue;
@@ -3,6 +3,7 @@
 
 #include "ray_utility.h"
 #include "hittable.h"
+#include "material.h"
 
 class Quad : public Hittable {
 public:
@@ -11,6 +12,7 @@ public:
         auto n = performCross(u, v);
         k = n / performDot(n, n);
         normalVector = getUnitVector(n);
+        area = n.getLength();
 
         setBoundingBox();
     }
@@ -26,22 +28,39 @@ public:
         return boundingBox;
     }
 
-    bool isHit(const Ray& inputRay, Interval timeIntervalToCheck, HitRecord& record) const override {
-        // tempA and tempB are from the plane equation
-        double tempA = performDot(normalVector, inputRay.getOrigin() - q), tempB = performDot(normalVector, inputRay.getDirection());
+    void collectEmitters(std::vector<const Hittable*>& emitters) const override {
+        if (material->isEmissive())
+            emitters.push_back(this);
+    }
 
-        // No hit if the ray is parallel to the plane
-        if (std::fabs(tempB) < 1e-8)
-            return false;
-        auto timeIntersect = -tempA / tempB;
+    double getPdfValue(const Point3& origin, const Vec3& direction, double time) const override {
+        // Uniform over the area, converted to solid angle: distance^2 / (cosine * area)
+        HitRecord record;
+        if (!isHit(Ray(origin, direction, time), Interval(0.001, RT_INFINITY), record))
+            return 0;
 
-        // No hit if the time of intersection is not inside the given interval
-        if (timeIntervalToCheck.doesContain(timeIntersect) == false)
+        auto distanceSquared = record.hitTime * record.hitTime * direction.getLengthSquared();
+        auto cosine = std::fabs(performDot(direction, normalVector) / direction.getLength());
+
+        return distanceSquared / (cosine * area);
+    }
+
+    Vec3 getRandomDirection(const Point3& origin, double time) const override {
+        // v first: the order GCC evaluated the former one-line expression in, so images stay the same
+        auto vFraction = getRandomDouble();
+        auto uFraction = getRandomDouble();
+        auto p = q + (uFraction * u) + (vFraction * v);
+        return p - origin;
+    }
+
+    bool isHit(const Ray& inputRay, Interval timeIntervalToCheck, HitRecord& record) const override {
+        double timeIntersect;
+        Point3 positionIntersect;
+        if (!getPlaneHit(inputRay, timeIntervalToCheck, timeIntersect, positionIntersect))
             return false;
 
         // Now we know that the ray hits the plane
         // Hence, we need to calculate alpha and beta to check whether they are inside the Quad
-        auto positionIntersect = inputRay.getPosition(timeIntersect);
         auto alpha = performDot(performCross(positionIntersect - q, v), k);
         auto beta = performDot(performCross(u, positionIntersect - q), k);
 
@@ -58,6 +77,17 @@ public:
         return true;
     }
 
+    bool isOccluded(const Ray& inputRay, Interval timeIntervalToCheck) const override {
+        double timeIntersect;
+        Point3 positionIntersect;
+        if (!getPlaneHit(inputRay, timeIntervalToCheck, timeIntersect, positionIntersect))
+            return false;
+
+        // isInterior() may be overridden by other shapes, so it still decides; only its UV is thrown away
+        HitRecord uvRecord;
+        return isInterior(performDot(performCross(positionIntersect - q, v), k), performDot(performCross(u, positionIntersect - q), k), uvRecord);
+    }
+
     virtual bool isInterior(double a, double b, HitRecord& record) const {
         Interval unitInterval = Interval(0, 1);
         // Given the hit point in plane coordinates, return false if it is outside the
@@ -72,10 +102,28 @@ public:
     }
 
 private:
+    bool getPlaneHit(const Ray& inputRay, const Interval& timeIntervalToCheck, double& timeIntersect, Point3& positionIntersect) const {
+        // tempA and tempB are from the plane equation
+        double tempA = performDot(normalVector, inputRay.getOrigin() - q), tempB = performDot(normalVector, inputRay.getDirection());
+
+        // No hit if the ray is parallel to the plane
+        if (std::fabs(tempB) < 1e-8)
+            return false;
+        timeIntersect = -tempA / tempB;
+
+        // No hit if the time of intersection is not inside the given interval
+        if (timeIntervalToCheck.doesContain(timeIntersect) == false)
+            return false;
+
+        positionIntersect = inputRay.getPosition(timeIntersect);
+        return true;
+    }
+
     Point3 q;             // bottom-left corner
     Vec3 u, v;            // two sides
     Vec3 normalVector;    // normal vector to the plane
     Vec3 k;               // cached value before n is normalized
+    double area;
     std::shared_ptr<Material> material;
     AABB boundingBox;
 };
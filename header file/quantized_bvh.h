@@ -0,0 +1,150 @@
+#ifndef QUANTIZED_BVH_H
+#define QUANTIZED_BVH_H
+
+#include "wide_bvh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+// A node of a QuantizedBVH: four children in 64 bytes, one cache line, where a BVH4 node needs 128.
+// Child bounds are 8-bit steps on a grid over the node: a bound is gridOrigin + quantized * 2^gridExponent.
+struct alignas(64) QuantizedBVHNode {
+    float gridOrigin[3];                // min corner of the grid
+    std::int8_t gridExponents[3];       // per axis, the grid step is 2^gridExponent
+    std::uint8_t childCount;
+    std::uint8_t quantizedMin[3][4];    // [axis][child], rounded down; unused children have min 255, max 0
+    std::uint8_t quantizedMax[3][4];    // rounded up, so every child box holds what it bounds
+    std::uint32_t childOffsets[4];      // inner child: its node index; leaf child: index of its first object
+    std::uint16_t objectCounts[4];      // leaf child: its number of objects; 0 for inner children
+};
+
+static_assert(sizeof(QuantizedBVHNode) == 64, "QuantizedBVHNode should fill exactly one cache line");
+
+// How a QuantizedBVH stores its child boxes: on a grid of 8-bit steps per node, decoded during the slab test.
+// Each node's grid step is a power of two no finer than float precision at the node, so decoding a
+// bound is exact in float, and rounding the quantized bounds outwards keeps every box conservative.
+struct QuantizedBVHNodeDecoder {
+    using Node = QuantizedBVHNode;
+    static constexpr const char* STRUCTURE_NAME = "QuantizedBVH, build tree";
+    static constexpr int WIDTH = 4;
+    static constexpr int QUANTIZED_STEPS = 255;
+
+    static void setChildBounds(QuantizedBVHNode& node, const std::vector<AABB>& childBoxes) {
+        // The float boxes are rounded outwards as in WideBVHNodeDecoder, by one more float step than needed
+        // for the ray origin's rounding; then each axis gets the finest grid that spans them in QUANTIZED_STEPS.
+        // Refitting calls this again, so the grids follow the new boxes.
+        float boundsMin[3][WIDTH], boundsMax[3][WIDTH];
+        for (size_t child = 0; child < childBoxes.size(); ++child) {
+            for (int axis = 0; axis < 3; ++axis) {
+                const Interval& interval = childBoxes[child].getAxisInterval(axis);
+                boundsMin[axis][child] = std::nextafter(std::nextafter(static_cast<float>(interval.min), -HUGE_VALF), -HUGE_VALF);
+                boundsMax[axis][child] = std::nextafter(std::nextafter(static_cast<float>(interval.max), HUGE_VALF), HUGE_VALF);
+            }
+        }
+
+        for (int axis = 0; axis < 3; ++axis) {
+            float nodeMin = *std::min_element(boundsMin[axis], boundsMin[axis] + childBoxes.size());
+            float nodeMax = *std::max_element(boundsMax[axis], boundsMax[axis] + childBoxes.size());
+
+            // Start at the float step of the node's largest coordinate: every multiple of it up to there is a
+            // float, and so is every decoded bound. Grow it until the node fits into the quantized range.
+            int exponent;
+            std::frexp(std::max(std::fabs(nodeMin), std::fabs(nodeMax)), &exponent);
+            exponent = std::max(exponent - 24, -126);
+            double step, origin;
+            while (true) {
+                step = std::ldexp(1.0, exponent);
+                origin = std::floor(nodeMin / step) * step;
+                if (std::ceil((nodeMax - origin) / step) <= QUANTIZED_STEPS)
+                    break;
+                ++exponent;
+            }
+
+            node.gridOrigin[axis] = static_cast<float>(origin);
+            node.gridExponents[axis] = static_cast<std::int8_t>(exponent);
+            for (int child = 0; child < WIDTH; ++child) {
+                if (child >= static_cast<int>(childBoxes.size())) {
+                    node.quantizedMin[axis][child] = QUANTIZED_STEPS;
+                    node.quantizedMax[axis][child] = 0;
+                    continue;
+                }
+                // all values are multiples of step here, so these divisions and roundings are exact
+                node.quantizedMin[axis][child] = static_cast<std::uint8_t>(std::floor((boundsMin[axis][child] - origin) / step));
+                node.quantizedMax[axis][child] = static_cast<std::uint8_t>(std::ceil((boundsMax[axis][child] - origin) / step));
+            }
+        }
+    }
+
+    static float getGridStep(int exponent) {
+        // 2^exponent, built from its bits; exponents stay in the normal float range
+        std::uint32_t bits = static_cast<std::uint32_t>(exponent + 127) << 23;
+        float step;
+        std::memcpy(&step, &bits, sizeof(step));
+        return step;
+    }
+
+    static int intersectChildren(const QuantizedBVHNode& node, const WideBVHRay& ray, float timeMin, float timeMax, float entryTimes[WIDTH]) {
+        // Returns a bit mask of the children the ray hits within [timeMin, timeMax] and their entry times.
+        // Decoding a bound is exact, so the slab distances have the same error bound as in WideBVHNodeDecoder.
+#if defined(__SSE2__) || defined(_M_X64)
+        __m128 timeNear = _mm_set1_ps(timeMin);
+        __m128 timeFar = _mm_set1_ps(timeMax);
+        __m128i zero = _mm_setzero_si128();
+        for (int axis = 0; axis < 3; ++axis) {
+            // four bytes widened to four floats, then scaled onto the grid
+            std::int32_t packedMin, packedMax;
+            std::memcpy(&packedMin, node.quantizedMin[axis], sizeof(packedMin));
+            std::memcpy(&packedMax, node.quantizedMax[axis], sizeof(packedMax));
+            __m128 quantizedMin = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packedMin), zero), zero));
+            __m128 quantizedMax = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packedMax), zero), zero));
+            __m128 step = _mm_set1_ps(getGridStep(node.gridExponents[axis]));
+            __m128 gridOrigin = _mm_set1_ps(node.gridOrigin[axis]);
+
+            __m128 origin = _mm_set1_ps(ray.origin[axis]);
+            __m128 inverseDirection = _mm_set1_ps(ray.inverseDirection[axis]);
+            __m128 timeMinPlane = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(gridOrigin, _mm_mul_ps(quantizedMin, step)), origin), inverseDirection);
+            __m128 timeMaxPlane = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(gridOrigin, _mm_mul_ps(quantizedMax, step)), origin), inverseDirection);
+            // a NaN distance (origin on a plane the ray runs along) keeps the second operand
+            timeNear = _mm_max_ps(ray.isDirectionNegative[axis] ? timeMaxPlane : timeMinPlane, timeNear);
+            timeFar = _mm_min_ps(ray.isDirectionNegative[axis] ? timeMinPlane : timeMaxPlane, timeFar);
+        }
+        timeFar = _mm_mul_ps(timeFar, _mm_set1_ps(WIDE_BVH_SLAB_EXIT_SCALE));
+        _mm_storeu_ps(entryTimes, timeNear);
+        return _mm_movemask_ps(_mm_cmple_ps(timeNear, timeFar));
+#else
+        int hitMask = 0;
+        for (int child = 0; child < WIDTH; ++child) {
+            float timeNear = timeMin, timeFar = timeMax;
+            for (int axis = 0; axis < 3; ++axis) {
+                float step = getGridStep(node.gridExponents[axis]);
+                float boundMin = node.gridOrigin[axis] + node.quantizedMin[axis][child] * step;
+                float boundMax = node.gridOrigin[axis] + node.quantizedMax[axis][child] * step;
+                float timeMinPlane = (boundMin - ray.origin[axis]) * ray.inverseDirection[axis];
+                float timeMaxPlane = (boundMax - ray.origin[axis]) * ray.inverseDirection[axis];
+                float planeNear = ray.isDirectionNegative[axis] ? timeMaxPlane : timeMinPlane;
+                float planeFar = ray.isDirectionNegative[axis] ? timeMinPlane : timeMaxPlane;
+                timeNear = (planeNear > timeNear) ? planeNear : timeNear;     // NaN keeps the old value
+                timeFar = (planeFar < timeFar) ? planeFar : timeFar;
+            }
+            entryTimes[child] = timeNear;
+            if (timeNear <= timeFar * WIDE_BVH_SLAB_EXIT_SCALE)
+                hitMask |= 1 << child;
+        }
+        return hitMask;
+#endif
+    }
+};
+
+// A BVH4 with compressed nodes, for scenes whose tree no longer fits in the caches: traversal reads
+// half the bytes per node, at the cost of decoding the child boxes and testing slightly larger ones.
+// It is collapsed from a BVHNode and traversed by WideBVH; only the node format differs.
+using QuantizedBVH = WideBVH<4, QuantizedBVHNodeDecoder>;
+
+#endif
@@ -7,11 +7,18 @@ class Ray {
 public:
     Ray() {}
 
-    Ray(const Point3& originInput, const Vec3& directionInput, double timeInput) : origin(originInput), direction(directionInput), time(timeInput) {}
+    Ray(const Point3& originInput, const Vec3& directionInput, double timeInput) : origin(originInput), direction(directionInput), time(timeInput) {
+        // cached for box tests, which would otherwise divide by the direction at every node
+        inverseDirection = Vec3(1 / direction.getX(), 1 / direction.getY(), 1 / direction.getZ());
+        for (int axis = 0; axis < 3; ++axis)
+            isNegative[axis] = inverseDirection[axis] < 0;
+    }
     Ray(const Point3& originInput, const Vec3& directionInput) : Ray(originInput, directionInput, 0) {}
 
     const Point3& getOrigin() const { return origin; }
     const Vec3& getDirection() const { return direction; }
+    const Vec3& getInverseDirection() const { return inverseDirection; }
+    bool isDirectionNegative(int axis) const { return isNegative[axis]; }
 
     double getTime() const {
         return time;
@@ -25,6 +32,8 @@ private:
     Point3 origin;
     Vec3 direction;
     double time;
+    Vec3 inverseDirection;
+    bool isNegative[3];     // per axis: direction < 0 (or -0), so the max plane of a box is entered first
 };
 
 #endif
@@ -2,11 +2,13 @@
 #define RAYUTILITY_H
 
 #include <cmath>
-#include <random>
+#include <cstdint>
 #include <iostream>
 #include <limits>
 #include <memory>
 
+#include "sampler.h"
+
 
 // Constants
 constexpr double RT_INFINITY = std::numeric_limits<double>::infinity();
@@ -18,10 +20,75 @@ inline double convertDegreesToRadians(double degrees) {
 }
 
 
+class RandomStream {
+public:
+    // Counter-based random numbers: the n-th number is a hash of (key, bounce, n) and
+    // nothing else, so there is no generator state to share between threads. The camera keys the
+    // stream with (seed, pixel, sample) and moves it to every bounce, which makes every random
+    // decision of a path reproducible no matter which thread traces it, or when.
+    RandomStream() : RandomStream(0) {}
+    explicit RandomStream(std::uint64_t seed) : key(getMixedBits(seed)) {}
+
+    void setPixelSample(std::uint64_t seed, std::uint64_t pixelIndex, std::uint64_t sampleIndex, const Sampler* inputSampler = nullptr) {
+        // With a sampler, numbers drawn after setDimension() come from it; see SAMPLER_DIMENSIONS_PER_BOUNCE.
+        pixelKey = getMixedBits(getMixedBits(seed) ^ pixelIndex);
+        key = getMixedBits(pixelKey ^ sampleIndex);
+        currentSampleIndex = sampleIndex;
+        sampler = inputSampler;
+        setBounce(0);
+    }
+
+    void setBounce(std::uint64_t inputBounce) {
+        bounce = inputBounce;
+        dimension = SAMPLER_DIMENSIONS_PER_BOUNCE;
+        hashedIndex = 0;
+    }
+
+    void setDimension(std::uint32_t inputDimension) {
+        // the next numbers come from this and the following sampler dimensions of the bounce
+        dimension = inputDimension;
+    }
+
+    std::uint64_t getBits() {
+        return getMixedBits(key ^ getMixedBits((bounce << 32) ^ hashedIndex++));
+    }
+
+    double getDouble() {
+        if (sampler != nullptr && dimension < SAMPLER_DIMENSIONS_PER_BOUNCE) {
+            auto samplerDimension = static_cast<std::uint32_t>(bounce * SAMPLER_DIMENSIONS_PER_BOUNCE + dimension++);
+            return sampler->getSample(pixelKey, currentSampleIndex, samplerDimension);
+        }
+        return getHashedDouble();
+    }
+
+    double getHashedDouble() {
+        // top 53 bits, so the result is in [0,1)
+        return (getBits() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+private:
+    std::uint64_t key;
+    std::uint64_t pixelKey = 0;
+    std::uint64_t currentSampleIndex = 0;
+    const Sampler* sampler = nullptr;       // a shared instance from getSampler(), never owned
+    std::uint64_t bounce = 0;
+    std::uint64_t dimension = SAMPLER_DIMENSIONS_PER_BOUNCE;   // next sampler dimension of the bounce
+    std::uint64_t hashedIndex = 0;                              // next hashed number of the bounce
+};
+
+inline RandomStream& getRandomStream() {
+    // Every thread owns its stream, so render threads never share (or race on) random state.
+    // Outside of rendering (scene setup) it simply counts up from its seed.
+    thread_local RandomStream stream;
+    return stream;
+}
+
+inline void setRandomSeed(std::uint64_t seed) {
+    getRandomStream() = RandomStream(seed);
+}
+
 inline double getRandomDouble(double min, double max) {
-    std::uniform_real_distribution<double> distribution(min, max);
-    static std::mt19937 generator;
-    return distribution(generator);
+    return min + (max - min) * getRandomStream().getDouble();
 }
 
 inline double getRandomDouble() {
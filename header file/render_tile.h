@@ -0,0 +1,11 @@
+#ifndef RENDER_TILE_H
+#define RENDER_TILE_H
+
+// A rectangle of the image that is rendered as one unit of work, by a thread of this process or by a
+// distributed worker. Camera::getTiles() splits the image into them in scanline order.
+struct RenderTile {
+    int minX, minY;     // first pixel column and row of the tile
+    int maxX, maxY;     // one past the last pixel column and row
+};
+
+#endif
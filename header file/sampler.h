@@ -0,0 +1,169 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <cstdint>
+
+inline std::uint64_t getMixedBits(std::uint64_t x) {
+    // SplitMix64 finalizer: every input bit affects every output bit
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBull;
+    x ^= x >> 31;
+    return x;
+}
+
+// Sampler dimensions a camera path owns at every bounce. Each decision has a fixed dimension, which the
+// integrators move the stream to before drawing it, so a decision that a path skips (no light sampling
+// at a mirror, say) doesn't shift the dimensions of the ones after it. 2D decisions start on an even
+// dimension, so with Sobol both of their numbers come from one stratified pair. Draws without a
+// dimension, such as distances in a ConstantMedium, which a ray may cross several of, use hashed random
+// numbers.
+constexpr std::uint32_t SAMPLER_DIMENSIONS_PER_BOUNCE = 8;
+
+constexpr std::uint32_t PIXEL_OFFSET_DIMENSION = 0;         // camera ray: 2D point in the pixel
+constexpr std::uint32_t TIME_DIMENSION = 2;                 // camera ray: shutter time
+constexpr std::uint32_t LENS_DIMENSION = 4;                 // camera ray: 2D point on the defocus disk
+constexpr std::uint32_t SCATTERING_DIMENSION = 0;           // later bounces: 2D BSDF direction, or a Dielectric's 1D choice
+constexpr std::uint32_t LIGHT_DIRECTION_DIMENSION = 2;      // later bounces: 2D point on the chosen light
+constexpr std::uint32_t LIGHT_CHOICE_DIMENSION = 4;         // later bounces: which light to sample
+constexpr std::uint32_t RUSSIAN_ROULETTE_DIMENSION = 5;     // later bounces: whether the path survives
+
+enum class SamplerType {
+    Independent,    // uniform random numbers, no stratification
+    Halton,         // radical inverses in prime bases, rotated per pixel
+    Sobol           // Owen-scrambled Sobol (0,2)-sequence, shuffled per pair of dimensions
+};
+
+// Source of the numbers a camera sample uses. Every value is a pure function of (pixel, sample index,
+// dimension), so samples stay reproducible no matter which thread or process takes them, and the
+// first n samples of a pixel are well spread for any n, not only for square counts.
+class Sampler {
+public:
+    virtual ~Sampler() = default;
+
+    // A value in [0,1). pixelKey already contains the seed, so neighbouring pixels are decorrelated.
+    virtual double getSample(std::uint64_t pixelKey, std::uint64_t sampleIndex, std::uint32_t dimension) const = 0;
+
+protected:
+    static double getUnitDouble(std::uint32_t bits) {
+        return bits * (1.0 / 4294967296.0);
+    }
+
+    static std::uint32_t getHash(std::uint64_t pixelKey, std::uint64_t value) {
+        return static_cast<std::uint32_t>(getMixedBits(pixelKey ^ getMixedBits(value)) >> 32);
+    }
+};
+
+class IndependentSampler : public Sampler {
+public:
+    double getSample(std::uint64_t pixelKey, std::uint64_t sampleIndex, std::uint32_t dimension) const override {
+        return getUnitDouble(getHash(pixelKey, (sampleIndex << 20) ^ dimension));
+    }
+};
+
+class HaltonSampler : public Sampler {
+public:
+    // Dimension d is the radical inverse of the sample index in the d-th prime base, shifted by a per pixel
+    // random offset (Cranley-Patterson rotation). Large prime bases spread poorly, so dimensions past the
+    // prime table are independent random numbers.
+    double getSample(std::uint64_t pixelKey, std::uint64_t sampleIndex, std::uint32_t dimension) const override {
+        static const std::uint32_t primes[PRIME_COUNT] = {
+              2,   3,   5,   7,  11,  13,  17,  19,  23,  29,  31,  37,  41,  43,  47,  53,
+             59,  61,  67,  71,  73,  79,  83,  89,  97, 101, 103, 107, 109, 113, 127, 131,
+            137, 139, 149, 151, 157, 163, 167, 173, 179, 181, 191, 193, 197, 199, 211, 223,
+            227, 229, 233, 239, 241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311
+        };
+
+        if (dimension >= PRIME_COUNT)
+            return IndependentSampler().getSample(pixelKey, sampleIndex, dimension);
+
+        double value = getRadicalInverse(sampleIndex, primes[dimension]) + getUnitDouble(getHash(pixelKey, dimension));
+        return (value >= 1) ? value - 1 : value;
+    }
+
+private:
+    static constexpr std::uint32_t PRIME_COUNT = 64;
+
+    static double getRadicalInverse(std::uint64_t index, std::uint32_t base) {
+        // mirrors the base b digits of index around the radix point
+        double inverseBase = 1.0 / base;
+        double scale = inverseBase;
+        double result = 0;
+        while (index > 0) {
+            result += (index % base) * scale;
+            index /= base;
+            scale *= inverseBase;
+        }
+        return result;
+    }
+};
+
+class SobolSampler : public Sampler {
+public:
+    // Padded Sobol after Burley, "Practical Hash-based Owen Scrambling" (2020): dimensions are taken in
+    // pairs, and every pair is the 2D Sobol (0,2)-sequence with its own Owen scrambling and its own
+    // shuffled sample order. Each pair is stratified like a jittered grid for any sample count, and the
+    // pairs don't correlate with each other, so there is no limit on the number of dimensions.
+    double getSample(std::uint64_t pixelKey, std::uint64_t sampleIndex, std::uint32_t dimension) const override {
+        std::uint32_t pairSeed = getHash(pixelKey, dimension / 2);
+        std::uint32_t index = getNestedUniformScramble(static_cast<std::uint32_t>(sampleIndex), pairSeed);
+        std::uint32_t value = (dimension % 2 == 0) ? getSobolFirst(index) : getSobolSecond(index);
+        return getUnitDouble(getNestedUniformScramble(value, getHash(pairSeed, dimension % 2 + 1)));
+    }
+
+private:
+    static std::uint32_t getSobolFirst(std::uint32_t index) {
+        // the first Sobol dimension is the base 2 radical inverse
+        return getReversedBits(index);
+    }
+
+    static std::uint32_t getSobolSecond(std::uint32_t index) {
+        // second Sobol dimension; its direction numbers are the rows of Pascal's triangle mod 2
+        std::uint32_t result = 0;
+        for (std::uint32_t direction = 1u << 31; index != 0; index >>= 1, direction ^= direction >> 1)
+            if (index & 1)
+                result ^= direction;
+        return result;
+    }
+
+    static std::uint32_t getReversedBits(std::uint32_t x) {
+        x = (x << 16) | (x >> 16);
+        x = ((x & 0x00FF00FFu) << 8) | ((x & 0xFF00FF00u) >> 8);
+        x = ((x & 0x0F0F0F0Fu) << 4) | ((x & 0xF0F0F0F0u) >> 4);
+        x = ((x & 0x33333333u) << 2) | ((x & 0xCCCCCCCCu) >> 2);
+        x = ((x & 0x55555555u) << 1) | ((x & 0xAAAAAAAAu) >> 1);
+        return x;
+    }
+
+    static std::uint32_t getNestedUniformScramble(std::uint32_t x, std::uint32_t seed) {
+        // Owen scrambling: every bit is flipped depending on the bits above it only, which keeps the
+        // stratification of the sequence. Done with a hash in which every bit depends on the bits below
+        // it, applied to the reversed bits.
+        x = getReversedBits(x);
+        x ^= x * 0x3D20ADEAu;
+        x += seed;
+        x *= (seed >> 16) | 1;
+        x ^= x * 0x05526C56u;
+        x ^= x * 0x53A22864u;
+        return getReversedBits(x);
+    }
+};
+
+inline const Sampler& getSampler(SamplerType samplerType) {
+    // Samplers hold no state, so one shared instance of each serves every thread.
+    static const IndependentSampler independentSampler;
+    static const HaltonSampler haltonSampler;
+    static const SobolSampler sobolSampler;
+
+    switch (samplerType) {
+    case SamplerType::Halton:
+        return haltonSampler;
+    case SamplerType::Sobol:
+        return sobolSampler;
+    default:
+        return independentSampler;
+    }
+}
+
+#endif
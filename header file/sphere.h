@@ -3,6 +3,8 @@
 
 #include "ray_utility.h"
 #include "hittable.h"
+#include "material.h"
+#include "onb.h"
 
 class Sphere : public Hittable {
 public:
@@ -26,6 +28,67 @@ public:
 
     bool isHit(const Ray& inputRay, Interval rayInterval, HitRecord& record) const override {
         Point3 currentCenter = center.getPosition(inputRay.getTime());
+        double hitTime;
+        if (!getHitTime(inputRay, currentCenter, rayInterval, hitTime))
+            return false;
+
+        record.hitTime = hitTime;
+        record.hitPosition = inputRay.getPosition(record.hitTime);
+        Vec3 outwardNormal = (record.hitPosition - currentCenter) / radius;
+        record.setFaceNormal(inputRay, outwardNormal);
+        getSphereUV(outwardNormal, record.u, record.v);
+        record.material = material;
+
+        return true;
+    }
+
+    bool isOccluded(const Ray& inputRay, Interval rayInterval) const override {
+        double hitTime;
+        return getHitTime(inputRay, center.getPosition(inputRay.getTime()), rayInterval, hitTime);
+    }
+
+    AABB getBoundingBox() const override {
+        return boundingBox;
+    }
+
+    AABB getBoundingBoxAtTime(double time) const override {
+        auto vectorRadius = Vec3(radius, radius, radius);
+        return AABB(center.getPosition(time) - vectorRadius, center.getPosition(time) + vectorRadius);
+    }
+
+    void collectEmitters(std::vector<const Hittable*>& emitters) const override {
+        if (material->isEmissive())
+            emitters.push_back(this);
+    }
+
+    double getPdfValue(const Point3& origin, const Vec3& direction, double time) const override {
+        // Uniform over the cone of directions the sphere covers, seen from origin, where it is at time.
+        HitRecord record;
+        if (!isHit(Ray(origin, direction, time), Interval(0.001, RT_INFINITY), record))
+            return 0;
+
+        auto distanceSquared = (center.getPosition(time) - origin).getLengthSquared();
+        if (distanceSquared <= radius * radius)
+            return 0;       // origin inside the sphere: no cone to sample
+
+        auto cosThetaMax = std::sqrt(1 - radius * radius / distanceSquared);
+        auto solidAngle = 2 * PI * (1 - cosThetaMax);
+
+        return 1 / solidAngle;
+    }
+
+    Vec3 getRandomDirection(const Point3& origin, double time) const override {
+        Vec3 direction = center.getPosition(time) - origin;
+        auto distanceSquared = direction.getLengthSquared();
+        if (distanceSquared <= radius * radius)
+            return direction;
+
+        ONB uvw(direction);
+        return uvw.transform(getRandomToSphere(radius, distanceSquared));
+    }
+
+private:
+    bool getHitTime(const Ray& inputRay, const Point3& currentCenter, Interval rayInterval, double& hitTime) const {
         Vec3 oc = currentCenter - inputRay.getOrigin();
         auto a = inputRay.getDirection().getLengthSquared();
         auto h = performDot(inputRay.getDirection(), oc);
@@ -38,28 +101,15 @@ public:
         auto sqrtd = std::sqrt(discriminant);
 
         // Find the nearest root that lies in the acceptable range.
-        auto hitTime = (h - sqrtd) / a;
+        hitTime = (h - sqrtd) / a;
         if (hitTime <= rayInterval.min || rayInterval.max <= hitTime) {
             hitTime = (h + sqrtd) / a;
             if (hitTime <= rayInterval.min || rayInterval.max <= hitTime)
                 return false;
         }
-
-        record.hitTime = hitTime;
-        record.hitPosition = inputRay.getPosition(record.hitTime);
-        Vec3 outwardNormal = (record.hitPosition - currentCenter) / radius;
-        record.setFaceNormal(inputRay, outwardNormal);
-        getSphereUV(outwardNormal, record.u, record.v);
-        record.material = material;
-
         return true;
     }
 
-    AABB getBoundingBox() const override {
-        return boundingBox;
-    }
-
-private:
     static void getSphereUV(const Point3& hitPosition, double& u, double& v) {
         // p: a given point on the sphere of radius one, centered at the origin.
         // u: returned value [0,1] of angle around the Y axis from X=-1.
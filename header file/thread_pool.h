@@ -0,0 +1,104 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+public:
+    ThreadPool(int inputThreadCount) : threadCount(inputThreadCount) {
+        // 0 (or less) means "use every hardware thread"
+        if (threadCount <= 0)
+            threadCount = static_cast<int>(std::thread::hardware_concurrency());
+        if (threadCount <= 0)
+            threadCount = 1;
+    }
+
+    int getThreadCount() const { return threadCount; }
+
+    void run(int taskCount, const std::function<void(int)>& task) {
+        // Runs task(0) ... task(taskCount - 1) on the pool and returns once all of them are finished.
+        // Tasks are dealt round-robin into one queue per worker. A worker pops from the front of its own
+        // queue, and when it runs dry it steals from the back of the other queues, so workers that got
+        // cheap tasks keep helping the ones that got expensive tasks.
+        if (taskCount <= 0)
+            return;
+
+        int workerCount = std::min(threadCount, taskCount);
+        std::vector<WorkQueue> queues(workerCount);
+        for (int currentTask = 0; currentTask < taskCount; ++currentTask)
+            queues[currentTask % workerCount].tasks.push_back(currentTask);
+
+        if (workerCount == 1) {
+            runWorker(0, queues, task);
+            return;
+        }
+
+        std::vector<std::thread> workers;
+        workers.reserve(workerCount - 1);
+        for (int currentWorker = 1; currentWorker < workerCount; ++currentWorker)
+            workers.emplace_back([this, currentWorker, &queues, &task]() { runWorker(currentWorker, queues, task); });
+
+        runWorker(0, queues, task);        // the calling thread works as well
+
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+private:
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<int> tasks;
+    };
+
+    static bool popOwnTask(WorkQueue& queue, int& taskIndex) {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty())
+            return false;
+
+        taskIndex = queue.tasks.front();
+        queue.tasks.pop_front();
+        return true;
+    }
+
+    static bool stealTask(WorkQueue& queue, int& taskIndex) {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty())
+            return false;
+
+        taskIndex = queue.tasks.back();
+        queue.tasks.pop_back();
+        return true;
+    }
+
+    static void runWorker(int workerIndex, std::vector<WorkQueue>& queues, const std::function<void(int)>& task) {
+        const int workerCount = static_cast<int>(queues.size());
+        int taskIndex;
+
+        while (true) {
+            if (popOwnTask(queues[workerIndex], taskIndex)) {
+                task(taskIndex);
+                continue;
+            }
+
+            // own queue is empty, so look for a victim
+            bool hasStolen = false;
+            for (int offset = 1; offset < workerCount && !hasStolen; ++offset)
+                hasStolen = stealTask(queues[(workerIndex + offset) % workerCount], taskIndex);
+
+            // tasks are never added while running, so empty queues everywhere means we are done
+            if (!hasStolen)
+                return;
+
+            task(taskIndex);
+        }
+    }
+
+    int threadCount;
+};
+
+#endif
@@ -110,12 +110,12 @@ inline Vec3 getUnitVector(const Vec3& v) {
 }
 
 inline Vec3 getRandomUnitVector() {
-    while (true) {
-        auto p = Vec3::getRandomVector(-1, 1);
-        auto lengthSquared = p.getLengthSquared();
-        if (1e-160 < lengthSquared && lengthSquared <= 1)       // enable blockhole
-            return p / sqrt(lengthSquared);
-    }
+    // Maps two numbers straight onto the sphere (no rejection loop), so it always uses
+    // exactly two sampler dimensions.
+    auto z = 1 - 2 * getRandomDouble();
+    auto phi = 2 * PI * getRandomDouble();
+    auto r = std::sqrt(std::fmax(0.0, 1 - z * z));
+    return Vec3(r * std::cos(phi), r * std::sin(phi), z);
 }
 
 inline Vec3 getRandomOnHemisphere(const Vec3& normal) {
@@ -127,11 +127,23 @@ inline Vec3 getRandomOnHemisphere(const Vec3& normal) {
 }
 
 inline Vec3 getRandomInUnitDisk() {
-    while (true) {
-        auto p = Vec3(getRandomDouble(-1, 1), getRandomDouble(-1, 1), 0);
-        if (p.getLengthSquared() < 1)
-            return p;
+    // Shirley-Chiu concentric mapping of the square onto the disk, which keeps the stratification
+    // of the two numbers it uses
+    auto a = getRandomDouble(-1, 1);
+    auto b = getRandomDouble(-1, 1);
+    if (a == 0 && b == 0)
+        return Vec3(0, 0, 0);
+
+    double r, phi;
+    if (std::fabs(a) > std::fabs(b)) {
+        r = a;
+        phi = (PI / 4) * (b / a);
+    }
+    else {
+        r = b;
+        phi = (PI / 2) - (PI / 4) * (a / b);
     }
+    return Vec3(r * std::cos(phi), r * std::sin(phi), 0);
 }
 
 inline Vec3 getReflectedMirror(const Vec3& inputVector, const Vec3 &normalVector) {
@@ -0,0 +1,166 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "hittable.h"
+#include "light_sampler.h"
+#include "material.h"
+
+#include <vector>
+
+inline double getRussianRouletteSurvival(const Color& throughput) {
+    // Probability that a path with this throughput keeps going; capped so no path lives forever.
+    return std::fmin(0.95, std::fmax(throughput.getX(), std::fmax(throughput.getY(), throughput.getZ())));
+}
+
+// Stream (wavefront) path tracer. Instead of following one path through all of its bounces, it moves
+// a whole batch of paths one bounce at a time:
+//   1. intersect every ray in the active queue with the scene,
+//   2. sort the hits by material type,
+//   3. shade each material group in one go, so the same doesScatter code runs back to back,
+//   4. compact the paths that scattered into the queue of the next bounce.
+// It computes the same estimate as Camera::getRayColor, only in a different order.
+class WavefrontIntegrator {
+public:
+    WavefrontIntegrator(const Hittable& inputWorld, const LightSampler& inputLightSampler, const Color& inputBackgroundColor,
+                        int inputMaxDepth, int inputRussianRouletteDepth)
+        : world(inputWorld), lightSampler(inputLightSampler), backgroundColor(inputBackgroundColor), maxDepth(inputMaxDepth), russianRouletteDepth(inputRussianRouletteDepth) {}
+
+    void trace(const std::vector<Ray>& cameraRays, const std::vector<RandomStream>& cameraStreams, std::vector<Color>& pathColors) {
+        // pathColors[i] receives the radiance carried back along cameraRays[i]. cameraStreams[i] is the
+        // random stream the camera keyed for that path; it is swapped into the thread whenever the path
+        // is worked on, so every path draws the same numbers it would in Camera::getRayColor.
+        size_t pathCount = cameraRays.size();
+        rays = cameraRays;
+        streams = cameraStreams;
+        throughputs.assign(pathCount, Color(1, 1, 1));
+        isLightSampled.assign(pathCount, 0);
+        previousPositions.resize(pathCount);
+        previousScatteringPdfs.resize(pathCount);
+        pathColors.assign(pathCount, Color(0, 0, 0));
+        records.resize(pathCount);
+
+        activeQueue.resize(pathCount);
+        for (size_t currentPath = 0; currentPath < pathCount; ++currentPath)
+            activeQueue[currentPath] = static_cast<int>(currentPath);
+
+        for (int bounce = 1; bounce <= maxDepth && !activeQueue.empty(); ++bounce) {
+            segmentCount += activeQueue.size();
+            intersect(bounce, pathColors);
+            sortByMaterial();
+            shade(bounce, pathColors);
+            activeQueue.swap(nextQueue);
+        }
+
+        pathTotal += pathCount;
+    }
+
+    long long getPathCount() const { return pathTotal; }
+    long long getSegmentCount() const { return segmentCount; }
+
+private:
+    void intersect(int bounce, std::vector<Color>& pathColors) {
+        // Paths that miss the scene pick up the background and leave the queue here.
+        // (Intersection may draw random numbers too, for instance inside a ConstantMedium.)
+        hitQueue.clear();
+        for (int pathIndex : activeQueue) {
+            RandomStream& random = getRandomStream();
+            random = streams[pathIndex];
+            random.setBounce(bounce);
+            bool isHitAnything = world.isHit(rays[pathIndex], Interval(0.001, RT_INFINITY), records[pathIndex]);
+            RT_RECORD_BVH_RAY(bounce == 1 ? BVHRayKind::Primary : BVHRayKind::Secondary);
+            streams[pathIndex] = random;
+
+            if (isHitAnything)
+                hitQueue.push_back(pathIndex);
+            else
+                pathColors[pathIndex] += throughputs[pathIndex] * backgroundColor;
+        }
+    }
+
+    void sortByMaterial() {
+        // counting sort on the material type, stable so the shading order stays deterministic
+        const int typeCount = static_cast<int>(MaterialType::Count);
+        groupOffsets.assign(typeCount + 1, 0);
+        for (int pathIndex : hitQueue)
+            ++groupOffsets[static_cast<int>(records[pathIndex].material->getType()) + 1];
+        for (int currentType = 0; currentType < typeCount; ++currentType)
+            groupOffsets[currentType + 1] += groupOffsets[currentType];
+
+        sortedQueue.resize(hitQueue.size());
+        std::vector<size_t> writePositions(groupOffsets.begin(), groupOffsets.end() - 1);
+        for (int pathIndex : hitQueue)
+            sortedQueue[writePositions[static_cast<int>(records[pathIndex].material->getType())]++] = pathIndex;
+    }
+
+    void shade(int bounce, std::vector<Color>& pathColors) {
+        nextQueue.clear();
+        const int typeCount = static_cast<int>(MaterialType::Count);
+
+        for (int currentType = 0; currentType < typeCount; ++currentType) {
+            for (size_t currentEntry = groupOffsets[currentType]; currentEntry < groupOffsets[currentType + 1]; ++currentEntry) {
+                int pathIndex = sortedQueue[currentEntry];
+                const HitRecord& record = records[pathIndex];
+                getRandomStream() = streams[pathIndex];
+
+                Color emittedColor = record.material->getEmittedColor(record.u, record.v, record.hitPosition);
+                if (isLightSampled[pathIndex] && record.material->isEmissive())
+                    emittedColor *= lightSampler.getEmissionWeight(previousPositions[pathIndex], rays[pathIndex].getDirection(), rays[pathIndex].getTime(), previousScatteringPdfs[pathIndex]);
+                pathColors[pathIndex] += throughputs[pathIndex] * emittedColor;
+
+                // as in Camera::getRayColor, absorbed directions still get the direct light
+                ScatterRecord scatterRecord;
+                getRandomStream().setDimension(SCATTERING_DIMENSION);
+                bool isScattered = record.material->doesScatter(rays[pathIndex], record, scatterRecord);
+                Color& throughput = throughputs[pathIndex];
+                isLightSampled[pathIndex] = !lightSampler.isEmpty() && !scatterRecord.isSpecular;
+                if (isLightSampled[pathIndex]) {
+                    pathColors[pathIndex] += throughput * lightSampler.sampleDirectLight(world, rays[pathIndex], record);
+                    previousPositions[pathIndex] = record.hitPosition;
+                    previousScatteringPdfs[pathIndex] = scatterRecord.pdf;
+                }
+                if (!isScattered)
+                    continue;
+
+                throughput = throughput * scatterRecord.attenuation;
+
+                if (bounce >= russianRouletteDepth) {
+                    double survivalProbability = getRussianRouletteSurvival(throughput);
+                    getRandomStream().setDimension(RUSSIAN_ROULETTE_DIMENSION);
+                    if (getRandomDouble() >= survivalProbability)
+                        continue;
+                    throughput /= survivalProbability;
+                }
+
+                rays[pathIndex] = scatterRecord.scatteredRay;
+                nextQueue.push_back(pathIndex);
+            }
+        }
+    }
+
+    const Hittable& world;
+    const LightSampler& lightSampler;
+    Color backgroundColor;
+    int maxDepth;
+    int russianRouletteDepth;
+
+    // per path state, indexed by path
+    std::vector<Ray> rays;
+    std::vector<Color> throughputs;
+    std::vector<HitRecord> records;
+    std::vector<RandomStream> streams;
+    std::vector<char> isLightSampled;       // sampled the lights at the previous hit
+    std::vector<Point3> previousPositions;
+    std::vector<double> previousScatteringPdfs;
+
+    // queues of path indices
+    std::vector<int> activeQueue;
+    std::vector<int> hitQueue;
+    std::vector<int> sortedQueue;
+    std::vector<int> nextQueue;
+    std::vector<size_t> groupOffsets;   // sortedQueue range of every material type
+
+    long long pathTotal = 0;
+    long long segmentCount = 0;
+};
+
+#endif
@@ -0,0 +1,392 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include "bvh.h"
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+// The ray of a WideBVH query in float, prepared once per query.
+struct WideBVHRay {
+    float origin[3];
+    float inverseDirection[3];
+    bool  isDirectionNegative[3];
+};
+
+// Relative error bound of the float slab distances (3 roundings; PBRT's gamma(3)), applied twice
+// to the exit distance so rounding never culls a box the ray touches.
+constexpr float WIDE_BVH_SLAB_EXIT_SCALE = 1 + 2 * 3 * 0x1p-24f / (1 - 3 * 0x1p-24f);
+
+// A node of a WideBVH with up to Width children. The child boxes are stored axis by axis
+// (structure of arrays), so one SIMD register holds the same bound of every child.
+template <int Width>
+struct alignas(32) WideBVHNode {
+    float boundsMin[3][Width];                  // [axis][child], rounded outwards from the double boxes
+    float boundsMax[3][Width];                  // unused children have an empty box, which no ray hits
+    std::uint32_t childOffsets[Width];          // inner child: its node index; leaf child: index of its first object
+    std::uint16_t objectCounts[Width];          // leaf child: its number of objects; 0 for inner children
+    std::uint8_t  childCount;
+};
+
+// How a WideBVH stores the child boxes of its nodes: here as floats, so decoding a box is a load.
+// Other node formats plug into WideBVH with a decoder of the same shape, see quantized_bvh.h.
+template <int Width>
+struct WideBVHNodeDecoder {
+    using Node = WideBVHNode<Width>;
+    static constexpr const char* STRUCTURE_NAME = (Width == 4) ? "BVH4, build tree" : "BVH8, build tree";
+
+    static void setChildBounds(Node& node, const std::vector<AABB>& childBoxes) {
+        // Rounded outwards by one more float step than needed, which covers the rounding of the ray
+        // origin to float in the slab test. Unused children get an empty box, which no ray hits.
+        for (int axis = 0; axis < 3; ++axis) {
+            for (int child = 0; child < Width; ++child) {
+                if (child >= static_cast<int>(childBoxes.size())) {
+                    node.boundsMin[axis][child] = HUGE_VALF;
+                    node.boundsMax[axis][child] = -HUGE_VALF;
+                    continue;
+                }
+                const Interval& interval = childBoxes[child].getAxisInterval(axis);
+                node.boundsMin[axis][child] = std::nextafter(std::nextafter(static_cast<float>(interval.min), -HUGE_VALF), -HUGE_VALF);
+                node.boundsMax[axis][child] = std::nextafter(std::nextafter(static_cast<float>(interval.max), HUGE_VALF), HUGE_VALF);
+            }
+        }
+    }
+
+    static int intersectChildren(const Node& node, const WideBVHRay& ray, float timeMin, float timeMax, float entryTimes[Width]) {
+        // Returns a bit mask of the children the ray hits within [timeMin, timeMax] and their entry times.
+#if defined(__AVX2__)
+        if constexpr (Width == 8) {
+            __m256 timeNear = _mm256_set1_ps(timeMin);
+            __m256 timeFar = _mm256_set1_ps(timeMax);
+            for (int axis = 0; axis < 3; ++axis) {
+                __m256 origin = _mm256_set1_ps(ray.origin[axis]);
+                __m256 inverseDirection = _mm256_set1_ps(ray.inverseDirection[axis]);
+                __m256 timeMinPlane = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.boundsMin[axis]), origin), inverseDirection);
+                __m256 timeMaxPlane = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.boundsMax[axis]), origin), inverseDirection);
+                // a NaN distance (origin on a plane the ray runs along) keeps the second operand
+                timeNear = _mm256_max_ps(ray.isDirectionNegative[axis] ? timeMaxPlane : timeMinPlane, timeNear);
+                timeFar = _mm256_min_ps(ray.isDirectionNegative[axis] ? timeMinPlane : timeMaxPlane, timeFar);
+            }
+            timeFar = _mm256_mul_ps(timeFar, _mm256_set1_ps(WIDE_BVH_SLAB_EXIT_SCALE));
+            _mm256_storeu_ps(entryTimes, timeNear);
+            return _mm256_movemask_ps(_mm256_cmp_ps(timeNear, timeFar, _CMP_LE_OQ));
+        }
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+        // Width / 4 groups of four children
+        int hitMask = 0;
+        for (int group = 0; group < Width; group += 4) {
+            __m128 timeNear = _mm_set1_ps(timeMin);
+            __m128 timeFar = _mm_set1_ps(timeMax);
+            for (int axis = 0; axis < 3; ++axis) {
+                __m128 origin = _mm_set1_ps(ray.origin[axis]);
+                __m128 inverseDirection = _mm_set1_ps(ray.inverseDirection[axis]);
+                __m128 timeMinPlane = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.boundsMin[axis] + group), origin), inverseDirection);
+                __m128 timeMaxPlane = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.boundsMax[axis] + group), origin), inverseDirection);
+                timeNear = _mm_max_ps(ray.isDirectionNegative[axis] ? timeMaxPlane : timeMinPlane, timeNear);
+                timeFar = _mm_min_ps(ray.isDirectionNegative[axis] ? timeMinPlane : timeMaxPlane, timeFar);
+            }
+            timeFar = _mm_mul_ps(timeFar, _mm_set1_ps(WIDE_BVH_SLAB_EXIT_SCALE));
+            _mm_storeu_ps(entryTimes + group, timeNear);
+            hitMask |= _mm_movemask_ps(_mm_cmple_ps(timeNear, timeFar)) << group;
+        }
+        return hitMask;
+#else
+        int hitMask = 0;
+        for (int child = 0; child < Width; ++child) {
+            float timeNear = timeMin, timeFar = timeMax;
+            for (int axis = 0; axis < 3; ++axis) {
+                float timeMinPlane = (node.boundsMin[axis][child] - ray.origin[axis]) * ray.inverseDirection[axis];
+                float timeMaxPlane = (node.boundsMax[axis][child] - ray.origin[axis]) * ray.inverseDirection[axis];
+                float planeNear = ray.isDirectionNegative[axis] ? timeMaxPlane : timeMinPlane;
+                float planeFar = ray.isDirectionNegative[axis] ? timeMinPlane : timeMaxPlane;
+                timeNear = (planeNear > timeNear) ? planeNear : timeNear;     // NaN keeps the old value
+                timeFar = (planeFar < timeFar) ? planeFar : timeFar;
+            }
+            entryTimes[child] = timeNear;
+            if (timeNear <= timeFar * WIDE_BVH_SLAB_EXIT_SCALE)
+                hitMask |= 1 << child;
+        }
+        return hitMask;
+#endif
+    }
+};
+
+// A BVHNode tree collapsed into nodes of Width (4 or 8) children: every node absorbs the largest
+// inner nodes below it until it has Width children. Such a tree is about half (BVH4) or a third
+// (BVH8) as deep, and a ray is tested against all children of a node in one SIMD slab test
+// (SSE for 4 children, AVX2 for 8, plain loops elsewhere). The children it hits are visited near
+// to far, and any whose entry distance lies beyond the closest hit so far are skipped.
+// NodeDecoder chooses the node format: how child boxes are stored, and how a ray is tested against them.
+template <int Width, typename NodeDecoder = WideBVHNodeDecoder<Width>>
+class WideBVH : public Hittable {
+public:
+    static_assert(Width == 4 || Width == 8, "WideBVH supports 4 and 8 children per node");
+
+    using Node = typename NodeDecoder::Node;
+
+    WideBVH(HittableList list, const BVHBuildOptions& options = BVHBuildOptions()) : WideBVH(BVHNode(list, options)) {}
+
+    WideBVH(const BVHNode& tree) {
+        boundingBox = tree.getBoundingBox();
+#ifdef RT_BVH_STATISTICS
+        buildTreeStatistics = tree.getTreeStatistics();
+        buildTreeStatistics.structureName = NodeDecoder::STRUCTURE_NAME;
+#endif
+        if (tree.isLeaf()) {
+            // one leaf child under a root node, so traversal always starts at a node
+            if (tree.getLeafObjects().empty())
+                return;
+            nodes.emplace_back();
+            addLeafChild(nodes[0], tree);
+            NodeDecoder::setChildBounds(nodes[0], { tree.getBoundingBox() });
+            return;
+        }
+        collapse(tree, 1);
+    }
+
+    // a tree loaded from a BVH cache file, see bvh_cache.h
+    WideBVH(NodeArray<Node> inputNodes, std::vector<std::shared_ptr<Hittable>> inputObjects, const AABB& inputBoundingBox, int inputMaxDepth)
+        : nodes(std::move(inputNodes)), objects(std::move(inputObjects)), boundingBox(inputBoundingBox), maxDepth(inputMaxDepth) {}
+
+    bool isHit(const Ray& inputRay, Interval timeIntervalToCheck, HitRecord& record) const override {
+        return query<false>(inputRay, timeIntervalToCheck, &record);
+    }
+
+    bool isOccluded(const Ray& inputRay, Interval timeIntervalToCheck) const override {
+        return query<true>(inputRay, timeIntervalToCheck, nullptr);
+    }
+
+    AABB getBoundingBox() const override { return boundingBox; }
+
+    void collectEmitters(std::vector<const Hittable*>& emitters) const override {
+        for (const auto& object : objects)
+            object->collectEmitters(emitters);
+    }
+
+    void collectTreeStatistics(std::vector<BVHTreeStatistics>& statistics) const override {
+#ifdef RT_BVH_STATISTICS
+        if (buildTreeStatistics.nodeCount > 0)
+            statistics.push_back(buildTreeStatistics);
+#endif
+        for (const auto& object : objects)
+            object->collectTreeStatistics(statistics);
+    }
+
+    void refit() override {
+        // Inner children come after their parent in depth-first order, so one backwards pass sees
+        // every child node before its parent.
+        std::vector<AABB> nodeBoxes(nodes.size());
+        for (size_t currentNodeIndex = nodes.size(); currentNodeIndex-- > 0;) {
+            Node& node = nodes[currentNodeIndex];
+            std::vector<AABB> childBoxes(node.childCount, AABB::empty);
+            AABB nodeBox = AABB::empty;
+
+            for (int child = 0; child < node.childCount; ++child) {
+                if (node.objectCounts[child] > 0) {
+                    for (std::uint32_t currentObject = node.childOffsets[child]; currentObject < node.childOffsets[child] + node.objectCounts[child]; ++currentObject) {
+                        objects[currentObject]->refit();
+                        childBoxes[child] = AABB(childBoxes[child], objects[currentObject]->getBoundingBox());
+                    }
+                }
+                else
+                    childBoxes[child] = nodeBoxes[node.childOffsets[child]];
+                nodeBox = AABB(nodeBox, childBoxes[child]);
+            }
+            NodeDecoder::setChildBounds(node, childBoxes);
+            nodeBoxes[currentNodeIndex] = nodeBox;
+        }
+        if (!nodes.empty())
+            boundingBox = nodeBoxes[0];
+    }
+
+    size_t getNodeCount() const { return nodes.size(); }
+    size_t getMemoryUsage() const { return nodes.size() * sizeof(Node) + objects.size() * sizeof(std::shared_ptr<Hittable>); }
+
+    const NodeArray<Node>& getNodes() const { return nodes; }
+    const std::vector<std::shared_ptr<Hittable>>& getObjects() const { return objects; }
+    int getMaxDepth() const { return maxDepth; }
+
+    bool isConsistent() const {
+        // What traversal relies on, for trees that were not built here: every link points forward and
+        // into the arrays, and no path is deeper than maxDepth, which sizes the traversal stack.
+        if (maxDepth < 1 || static_cast<size_t>(maxDepth) > std::max<size_t>(nodes.size(), 1))
+            return false;
+
+        std::vector<int> depths(nodes.size(), 1);
+        for (size_t currentNodeIndex = 0; currentNodeIndex < nodes.size(); ++currentNodeIndex) {
+            const Node& node = nodes[currentNodeIndex];
+            if (node.childCount > Width)
+                return false;
+
+            for (int child = 0; child < node.childCount; ++child) {
+                std::uint32_t offset = node.childOffsets[child];
+                if (node.objectCounts[child] > 0) {
+                    if (static_cast<size_t>(offset) + node.objectCounts[child] > objects.size())
+                        return false;
+                    continue;
+                }
+                if (offset <= currentNodeIndex || offset >= nodes.size() || depths[currentNodeIndex] + 1 > maxDepth)
+                    return false;
+                depths[offset] = std::max(depths[offset], depths[currentNodeIndex] + 1);
+            }
+        }
+        return true;
+    }
+
+private:
+    static constexpr size_t MAX_STACK_SIZE = 256;
+
+    struct StackEntry {
+        std::uint32_t offset;           // as in the node's childOffsets
+        std::uint32_t objectCount;      // 0 for a node
+        float entryTime;                // where the ray enters the entry's box
+    };
+
+    void addLeafChild(Node& node, const BVHNode& leaf) {
+        int child = node.childCount++;
+        node.childOffsets[child] = static_cast<std::uint32_t>(objects.size());
+        node.objectCounts[child] = static_cast<std::uint16_t>(leaf.getLeafObjects().size());
+        objects.insert(objects.end(), leaf.getLeafObjects().begin(), leaf.getLeafObjects().end());
+    }
+
+    std::uint32_t collapse(const BVHNode& treeNode, int depth) {
+        // Appends a node for the inner treeNode and the nodes below it depth-first; returns its index.
+        // Its children are found by opening the largest inner node among them until there are Width.
+        std::vector<const BVHNode*> children = { &treeNode.getLeftChild(), &treeNode.getRightChild() };
+        while (children.size() < Width) {
+            int largestInner = -1;
+            double largestArea = -1;
+            for (size_t child = 0; child < children.size(); ++child) {
+                if (!children[child]->isLeaf() && children[child]->getBoundingBox().getSurfaceArea() > largestArea) {
+                    largestArea = children[child]->getBoundingBox().getSurfaceArea();
+                    largestInner = static_cast<int>(child);
+                }
+            }
+            if (largestInner < 0)
+                break;
+
+            const BVHNode* opened = children[largestInner];
+            children[largestInner] = &opened->getLeftChild();
+            children.insert(children.begin() + largestInner + 1, &opened->getRightChild());
+        }
+
+        // a new node is zeroed: no children yet
+        auto nodeIndex = static_cast<std::uint32_t>(nodes.size());
+        nodes.emplace_back();
+        maxDepth = std::max(maxDepth, depth);
+
+        std::vector<AABB> childBoxes;
+        for (const BVHNode* child : children) {
+            childBoxes.push_back(child->getBoundingBox());
+            if (child->isLeaf()) {
+                addLeafChild(nodes[nodeIndex], *child);
+                continue;
+            }
+            std::uint32_t childIndex = collapse(*child, depth + 1);
+            // nodes may have been reallocated by the recursion
+            int slot = nodes[nodeIndex].childCount++;
+            nodes[nodeIndex].childOffsets[slot] = childIndex;
+        }
+        NodeDecoder::setChildBounds(nodes[nodeIndex], childBoxes);
+        return nodeIndex;
+    }
+
+    template <bool isAnyHit>
+    bool query(const Ray& inputRay, Interval timeIntervalToCheck, HitRecord* record) const {
+        if (nodes.empty())
+            return false;
+
+        // the stack holds at most Width - 1 entries per level plus the one being visited
+        size_t stackSize = static_cast<size_t>(maxDepth) * (Width - 1) + 1;
+        if (stackSize <= MAX_STACK_SIZE) {
+            StackEntry stack[MAX_STACK_SIZE];
+            return traverse<isAnyHit>(inputRay, timeIntervalToCheck, record, stack);
+        }
+        std::vector<StackEntry> stack(stackSize);
+        return traverse<isAnyHit>(inputRay, timeIntervalToCheck, record, stack.data());
+    }
+
+    template <bool isAnyHit>
+    bool traverse(const Ray& inputRay, Interval timeIntervalToCheck, HitRecord* record, StackEntry* stack) const {
+        // closest hit into record, or, for isAnyHit, whether there is any hit at all
+        WideBVHRay ray;
+        for (int axis = 0; axis < 3; ++axis) {
+            ray.origin[axis] = static_cast<float>(inputRay.getOrigin()[axis]);
+            ray.inverseDirection[axis] = 1 / static_cast<float>(inputRay.getDirection()[axis]);
+            ray.isDirectionNegative[axis] = ray.inverseDirection[axis] < 0;
+        }
+        auto timeMin = static_cast<float>(timeIntervalToCheck.min);
+
+        bool isHitAnything = false;
+        int stackSize = 0;
+        stack[stackSize++] = { 0, 0, -HUGE_VALF };
+
+        while (stackSize > 0) {
+            StackEntry entry = stack[--stackSize];
+            if (entry.entryTime > timeIntervalToCheck.max * WIDE_BVH_SLAB_EXIT_SCALE)
+                continue;       // a closer hit was found after this entry was pushed
+
+            if (entry.objectCount > 0) {
+                for (std::uint32_t currentObject = entry.offset; currentObject < entry.offset + entry.objectCount; ++currentObject) {
+                    RT_COUNT_BVH(objectTests, 1);
+                    if constexpr (isAnyHit) {
+                        if (objects[currentObject]->isOccluded(inputRay, timeIntervalToCheck))
+                            return true;
+                    }
+                    else if (objects[currentObject]->isHit(inputRay, timeIntervalToCheck, *record)) {
+                        isHitAnything = true;
+                        timeIntervalToCheck.max = record->hitTime;
+                    }
+                }
+                continue;
+            }
+
+            const Node& node = nodes[entry.offset];
+            RT_COUNT_BVH(nodeVisits, 1);
+            RT_COUNT_BVH(boxTests, node.childCount);
+            alignas(32) float entryTimes[Width];
+            int hitMask = NodeDecoder::intersectChildren(node, ray, timeMin, static_cast<float>(timeIntervalToCheck.max), entryTimes);
+
+            // order the hit children far to near, then push them, so the nearest is popped first
+            int hitChildren[Width];
+            int hitCount = 0;
+            for (int child = 0; child < node.childCount; ++child) {
+                if (!(hitMask & (1 << child)))
+                    continue;
+                int position = hitCount++;
+                while (position > 0 && entryTimes[hitChildren[position - 1]] < entryTimes[child]) {
+                    hitChildren[position] = hitChildren[position - 1];
+                    --position;
+                }
+                hitChildren[position] = child;
+            }
+
+            for (int currentHit = 0; currentHit < hitCount; ++currentHit) {
+                int child = hitChildren[currentHit];
+                stack[stackSize++] = { node.childOffsets[child], node.objectCounts[child], entryTimes[child] };
+            }
+        }
+        return isHitAnything;
+    }
+
+    NodeArray<Node> nodes;
+    std::vector<std::shared_ptr<Hittable>> objects;     // in leaf order
+    AABB boundingBox;
+    int maxDepth = 1;
+#ifdef RT_BVH_STATISTICS
+    BVHTreeStatistics buildTreeStatistics;  // of the BVHNode it was built from; empty when loaded from a BVH cache
+#endif
+};
+
+using BVH4 = WideBVH<4>;
+using BVH8 = WideBVH<8>;
+
+#endif
@@ -1,14 +1,38 @@
 #include "ray_utility.h"
 
+#include "animation.h"
 #include "bvh.h"
+#include "bvh_cache.h"
 #include "camera.h"
 #include "constant_medium.h"
 #include "Hittable.h"
 #include "hittable_list.h"
+#include "instance.h"
+#include "linear_bvh.h"
 #include "material.h"
+#include "motion_bvh.h"
 #include "Quad.h"
+#include "quantized_bvh.h"
 #include "Sphere.h"
 #include "texture.h"
+#include "wide_bvh.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+// Distributed rendering role from the command line; every scene hands it to its camera, so
+// workers build exactly the scene the coordinator renders.
+RenderRole commandLineRole = RenderRole::Local;
+std::string commandLineAddress;
+
+void applyCommandLine(Camera& camera) {
+    camera.renderRole = commandLineRole;
+    if (!commandLineAddress.empty())
+        camera.renderAddress = commandLineAddress;
+}
 
 double isHitSphere(const Point3& sphereCenter, double sphereRadius, const Ray& inputRay) {
     Vec3 cq = sphereCenter - inputRay.getOrigin();      // C - Q
@@ -68,7 +92,8 @@ void renderBouncingSpheres() {
     auto material3 = std::make_shared<Metal>(Color(0.7, 0.6, 0.5), 0.0);
     world.add(std::make_shared<Sphere>(Point3(4, 1, 0), 1.0, material3));
 
-    world = HittableList(std::make_shared<BVHNode>(world));
+    // the small spheres bounce during the shutter; rays test the tree's boxes at their own time
+    world = HittableList(std::make_shared<MotionBVH>(world));
 
     Camera camera;
     camera.aspectRatio = 16.0 / 9.0;
@@ -86,6 +111,7 @@ void renderBouncingSpheres() {
     camera.focusDistance = 10.0;
 
 
+    applyCommandLine(camera);
     camera.render(world);
 }
 
@@ -113,6 +139,7 @@ void renderCheckeredSpheres() {
 
     camera.defocusAngle = 0;
 
+    applyCommandLine(camera);
     camera.render(world);
 }
 
@@ -137,6 +164,7 @@ void renderEarth() {
 
     camera.defocusAngle = 0;
 
+    applyCommandLine(camera);
     camera.render(HittableList(globe));
 }
 
@@ -163,6 +191,7 @@ void renderPerlinSpheres() {
 
     camera.defocusAngle = 0;
 
+    applyCommandLine(camera);
     camera.render(world);
 }
 
@@ -199,6 +228,7 @@ void renderQuads() {
 
     camera.defocusAngle = 0;
 
+    applyCommandLine(camera);
     camera.render(world);
 }
 
@@ -231,10 +261,12 @@ void renderSimpleLight() {
 
     camera.defocusAngle = 0;
 
+    applyCommandLine(camera);
     camera.render(world);
 }
 
-void renderCornellBox() {
+HittableList getCornellBoxScene(bool isMetalBoxes = false) {
+    // isMetalBoxes: rough metal boxes, whose glossy hits only light sampling with MIS handles well
     HittableList world;
 
     auto red = std::make_shared<Lambertian>(Color(.65, .05, .05));
@@ -254,23 +286,20 @@ void renderCornellBox() {
     //world.add(getBox(Point3(130, 0, 65), Point3(295, 165, 230), white));
     //world.add(getBox(Point3(265, 0, 295), Point3(430, 330, 460), white));
 
-    // adjusted boxes
-    std::shared_ptr<Hittable> box1 = getBox(Point3(0, 0, 0), Point3(165, 330, 165), white);
-    box1 = std::make_shared<RotateY>(box1, 15);
-    box1 = std::make_shared<Translate>(box1, Vec3(265, 0, 295));
-    world.add(box1);
-    std::shared_ptr<Hittable> box2 = getBox(Point3(0, 0, 0), Point3(165, 165, 165), white);
-    box2 = std::make_shared<RotateY>(box2, -18);
-    box2 = std::make_shared<Translate>(box2, Vec3(130, 0, 65));
-    world.add(box2);
-
-
-    Camera camera;
+    // adjusted boxes: two instances of one cube, the tall one scaled up
+    std::shared_ptr<Material> boxMaterial = white;
+    if (isMetalBoxes)
+        boxMaterial = std::make_shared<Metal>(Color(.8, .85, .88), 0.3);
+    auto cube = std::make_shared<BVHNode>(*getBox(Point3(0, 0, 0), Point3(165, 165, 165), boxMaterial));
+    auto box1 = std::make_shared<Instance>(cube,
+        Transform::getTranslation(Vec3(265, 0, 295)) * Transform::getRotationY(15) * Transform::getScale(Vec3(1, 2, 1)));
+    auto box2 = std::make_shared<Instance>(cube, Transform::getTranslation(Vec3(130, 0, 65)) * Transform::getRotationY(-18));
+    world.add(std::make_shared<TopLevelBVH>(std::vector<std::shared_ptr<Instance>>{ box1, box2 }));
+    return world;
+}
 
+void setCornellBoxView(Camera& camera) {
     camera.aspectRatio = 1.0;
-    camera.imageWidth = 600;
-    camera.samplesPerPixel = 200;
-    camera.maxDepth = 50;
     camera.backgroundColor = Color(0, 0, 0);
 
     camera.verticalFOV = 40;
@@ -279,7 +308,18 @@ void renderCornellBox() {
     camera.upVector = Vec3(0, 1, 0);
 
     camera.defocusAngle = 0;
+}
+
+void renderCornellBox() {
+    HittableList world = getCornellBoxScene();
 
+    Camera camera;
+    setCornellBoxView(camera);
+    camera.imageWidth = 600;
+    camera.samplesPerPixel = 200;
+    camera.maxDepth = 50;
+
+    applyCommandLine(camera);
     camera.render(world);
 }
 
@@ -325,11 +365,64 @@ void renderCornellSmoke() {
 
     camera.defocusAngle = 0;
 
+    applyCommandLine(camera);
     camera.render(world);
 }
 
 
-void renderFinalScene(int imageWidth, int samplesPerPixel, int maxDepth) {
+void renderAnimatedSpheres(int frameCount) {
+    // A grid of spheres bouncing in a wave, which then drifts apart. The spheres sit below Translate
+    // nodes, so every frame only moves them and refits the BVH.
+    HittableList world;
+
+    auto ground = std::make_shared<CheckerTexture>(0.32, Color(0.2, 0.3, 0.1), Color(0.9, 0.9, 0.9));
+    world.add(std::make_shared<Sphere>(Point3(0, -1000, 0), 1000, std::make_shared<Lambertian>(ground)));
+
+    Animation animation;
+    animation.frameCount = frameCount;
+    animation.framesPerSecond = 12;
+    animation.fileNamePattern = "animated_spheres_%03d.ppm";
+
+    HittableList spheres;
+    for (int a = -3; a <= 3; a++) {
+        for (int b = -3; b <= 3; b++) {
+            auto sphereMaterial = std::make_shared<Lambertian>(Color::getRandomVector() * Color::getRandomVector());
+            Vec3 restOffset(a, 0.3, b);
+            auto sphere = std::make_shared<Translate>(std::make_shared<Sphere>(Point3(0, 0, 0), 0.3, sphereMaterial), restOffset);
+            spheres.add(sphere);
+
+            double phase = 0.05 * (a + b + 6);
+            animation.addTrack(AnimationTrack(sphere, nullptr, {
+                { phase, restOffset },
+                { phase + 0.25, restOffset + Vec3(0, 1, 0) },
+                { phase + 0.5, restOffset },
+                { 2.0, Vec3(2 * a, 0.3, 2 * b) }
+            }));
+        }
+    }
+    world.add(std::make_shared<BVHNode>(spheres));
+
+    Camera camera;
+
+    camera.aspectRatio = 16.0 / 9.0;
+    camera.imageWidth = 400;
+    camera.samplesPerPixel = 64;
+    camera.maxDepth = 20;
+    camera.backgroundColor = Color(0.7, 0.8, 1.0);
+
+    camera.verticalFOV = 30;
+    camera.lookFrom = Point3(0, 8, 16);
+    camera.lookAt = Point3(0, 0.5, 0);
+    camera.upVector = Vec3(0, 1, 0);
+
+    camera.defocusAngle = 0;
+
+    applyCommandLine(camera);
+    animation.render(camera, world);
+}
+
+HittableList getFinalSceneFloor() {
+    // 20 x 20 boxes of random height
     HittableList boxes1;
     auto ground = std::make_shared<Lambertian>(Color(0.48, 0.83, 0.53));
 
@@ -347,10 +440,27 @@ void renderFinalScene(int imageWidth, int samplesPerPixel, int maxDepth) {
             boxes1.add(getBox(Point3(x0, y0, z0), Point3(x1, y1, z1), ground));
         }
     }
+    return boxes1;
+}
+
+HittableList getFinalSceneSphereCluster() {
+    HittableList boxes2;
+    auto white = std::make_shared<Lambertian>(Color(.73, .73, .73));
+    int ns = 1000;
+    for (int j = 0; j < ns; j++)
+        boxes2.add(std::make_shared<Sphere>(Point3::getRandomVector(0, 165), 10, white));
+    return boxes2;
+}
+
+void renderFinalScene(int imageWidth, int samplesPerPixel, int maxDepth) {
+    HittableList boxes1 = getFinalSceneFloor();
 
     HittableList world;
 
-    world.add(std::make_shared<BVHNode>(boxes1));
+    // Both trees are loaded from cache files as long as their objects stay the same.
+    auto floorStartTime = std::chrono::steady_clock::now();
+    world.add(getCachedBVH<BVH4>("final_scene_floor.bvh", boxes1));
+    std::clog << "Floor BVH: ready in " << std::chrono::duration<double>(std::chrono::steady_clock::now() - floorStartTime).count() * 1000 << " ms\n";
     auto light = std::make_shared<DiffuseLight>(Color(7, 7, 7));
     world.add(std::make_shared<Quad>(Point3(123, 554, 147), Vec3(300, 0, 0), Vec3(0, 0, 265), light));
     
@@ -374,13 +484,12 @@ void renderFinalScene(int imageWidth, int samplesPerPixel, int maxDepth) {
     auto pertext = std::make_shared<NoiseTexture>(0.2);
     world.add(std::make_shared<Sphere>(Point3(220, 280, 300), 80, std::make_shared<Lambertian>(pertext)));
 
-    HittableList boxes2;
-    auto white = std::make_shared<Lambertian>(Color(.73, .73, .73));
-    int ns = 1000;
-    for (int j = 0; j < ns; j++)
-        boxes2.add(std::make_shared<Sphere>(Point3::getRandomVector(0, 165), 10, white));
+    HittableList boxes2 = getFinalSceneSphereCluster();
 
-    world.add(std::make_shared<Translate>(std::make_shared<RotateY>(std::make_shared<BVHNode>(boxes2), 15), Vec3(-100, 270, 395)));
+    auto sphereClusterStartTime = std::chrono::steady_clock::now();
+    auto sphereClusterBVH = getCachedBVH<BVH4>("final_scene_spheres.bvh", boxes2);
+    std::clog << "Sphere cluster BVH: ready in " << std::chrono::duration<double>(std::chrono::steady_clock::now() - sphereClusterStartTime).count() * 1000 << " ms\n";
+    world.add(std::make_shared<Translate>(std::make_shared<RotateY>(sphereClusterBVH, 15), Vec3(-100, 270, 395)));
 
     
 
@@ -399,12 +508,356 @@ void renderFinalScene(int imageWidth, int samplesPerPixel, int maxDepth) {
 
     camera.defocusAngle = 0;
 
+    applyCommandLine(camera);
+    camera.render(world);
+}
+
+
+
+double getMeanSquaredError(const Framebuffer& image, const Framebuffer& reference) {
+    // per color channel, over all pixels
+    double errorSum = 0;
+    for (size_t pixelIndex = 0; pixelIndex < image.getPixelCount(); ++pixelIndex) {
+        Vec3 difference = image[pixelIndex] - reference[pixelIndex];
+        errorSum += performDot(difference, difference);
+    }
+    return errorSum / (3.0 * image.getPixelCount());
+}
+
+Color getMeanColor(const Framebuffer& image) {
+    Color colorSum(0, 0, 0);
+    for (size_t pixelIndex = 0; pixelIndex < image.getPixelCount(); ++pixelIndex)
+        colorSum += image[pixelIndex];
+    return colorSum / static_cast<double>(image.getPixelCount());
+}
+
+void measureLightSampling(int imageWidth, int samplesPerPixel, int referenceSamplesPerPixel, bool isMetalBoxes) {
+    // Error of the Cornell box with and without light sampling against a long render with it, and
+    // the mean color of each, which should agree if both estimators converge to the same image.
+    HittableList world = getCornellBoxScene(isMetalBoxes);
+    Camera camera;
+    setCornellBoxView(camera);
+    camera.imageWidth = imageWidth;
+    camera.maxDepth = 50;
+
+    camera.samplesPerPixel = referenceSamplesPerPixel;
+    camera.outputFileName = "light_sampling_reference.pfm";
+    camera.render(world);
+    Framebuffer reference = camera.getFramebuffer();
+
+    camera.samplesPerPixel = samplesPerPixel;
+    for (bool isLightSampling : { false, true }) {
+        camera.isLightSampling = isLightSampling;
+        camera.outputFileName = isLightSampling ? "light_sampling_on.pfm" : "light_sampling_off.pfm";
+        camera.render(world);
+        Color meanColor = getMeanColor(camera.getFramebuffer());
+        std::clog << "Light sampling " << (isLightSampling ? "on" : "off") << ": MSE " << getMeanSquaredError(camera.getFramebuffer(), reference)
+            << ", mean color " << meanColor << "\n";
+    }
+    std::clog << "Reference: mean color " << getMeanColor(reference) << "\n";
+}
+
+
+
+void measureDenoising(int imageWidth, int samplesPerPixel, int referenceSamplesPerPixel) {
+    // Error of the Cornell box against a long render: samplesPerPixel with and without denoising,
+    // and four times as many samples without, to compare the denoiser with simply sampling more.
+    HittableList world = getCornellBoxScene();
+    Camera camera;
+    setCornellBoxView(camera);
+    camera.imageWidth = imageWidth;
+    camera.maxDepth = 50;
+
+    camera.samplesPerPixel = referenceSamplesPerPixel;
+    camera.outputFileName = "denoising_reference.pfm";
     camera.render(world);
+    Framebuffer reference = camera.getFramebuffer();
+
+    struct Setting {
+        const char* name;
+        int samplesPerPixel;
+        bool isDenoising;
+        const char* outputFileName;
+    };
+    const Setting settings[] = {
+        { "noisy", samplesPerPixel, false, "denoising_off.pfm" },
+        { "denoised", samplesPerPixel, true, "denoising_on.pfm" },
+        { "noisy, 4x samples", 4 * samplesPerPixel, false, "denoising_off_4x.pfm" }
+    };
+    for (const Setting& setting : settings) {
+        camera.samplesPerPixel = setting.samplesPerPixel;
+        camera.isDenoising = setting.isDenoising;
+        camera.outputFileName = setting.outputFileName;
+        camera.render(world);
+        std::clog << setting.samplesPerPixel << " spp " << setting.name << ": MSE " << getMeanSquaredError(camera.getFramebuffer(), reference) << "\n";
+    }
 }
 
 
 
-int main() {
+void measureSamplers(int imageWidth, int samplesPerPixel, int referenceSamplesPerPixel, int seedCount) {
+    // Error of the Cornell box with every sampler against a long render, averaged over seedCount seeds.
+    HittableList world = getCornellBoxScene();
+    Camera camera;
+    setCornellBoxView(camera);
+    camera.imageWidth = imageWidth;
+    camera.maxDepth = 50;
+
+    camera.samplesPerPixel = referenceSamplesPerPixel;
+    camera.outputFileName = "sampler_reference.pfm";
+    camera.render(world);
+    Framebuffer reference = camera.getFramebuffer();
+
+    struct Sampler {
+        const char* name;
+        SamplerType samplerType;
+    };
+    const Sampler samplers[] = {
+        { "Independent", SamplerType::Independent },
+        { "Halton", SamplerType::Halton },
+        { "Sobol", SamplerType::Sobol }
+    };
+    camera.samplesPerPixel = samplesPerPixel;
+    camera.outputFileName = "sampler.pfm";
+    for (const Sampler& sampler : samplers) {
+        camera.samplerType = sampler.samplerType;
+        double errorSum = 0;
+        // seeds other than the reference's, so no sample is shared with it
+        for (int seed = 1; seed <= seedCount; ++seed) {
+            camera.randomSeed = static_cast<std::uint64_t>(seed);
+            camera.render(world);
+            errorSum += getMeanSquaredError(camera.getFramebuffer(), reference);
+        }
+        std::clog << sampler.name << ": mean MSE " << errorSum / seedCount << " over " << seedCount << " seeds\n";
+    }
+}
+
+
+
+struct BVHBenchmarkScene {
+    HittableList spheres;
+    std::vector<Ray> rays;
+};
+
+BVHBenchmarkScene getBVHBenchmarkScene(int objectCount, int rayCount) {
+    // Random spheres in a cube that grows with their number, and random rays from around the cube into it.
+    BVHBenchmarkScene scene;
+    auto white = std::make_shared<Lambertian>(Color(.73, .73, .73));
+    double extent = 165 * std::cbrt(objectCount / 1000.0);
+    for (int j = 0; j < objectCount; j++)
+        scene.spheres.add(std::make_shared<Sphere>(Point3::getRandomVector(0, extent), 10, white));
+
+    for (int j = 0; j < rayCount; j++) {
+        Point3 origin = Point3::getRandomVector(-extent, 2 * extent);
+        scene.rays.emplace_back(origin, Point3::getRandomVector(0, extent) - origin);
+    }
+    return scene;
+}
+
+double traceBVHBenchmarkRays(const Hittable& structure, const std::vector<Ray>& rays, int& hitCount) {
+    // closest hits of all rays; returns the seconds they took
+    auto traceStartTime = std::chrono::steady_clock::now();
+    for (const Ray& ray : rays) {
+        HitRecord record;
+        if (structure.isHit(ray, Interval(0.001, RT_INFINITY), record))
+            ++hitCount;
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - traceStartTime).count();
+}
+
+void benchmarkBVHBuilders(int objectCount, int rayCount) {
+    // Builds the same random spheres with every builder and traces the same random rays through each
+    // tree: build time against trace time, for picking a builder for scenes rebuilt every frame.
+    BVHBenchmarkScene scene = getBVHBenchmarkScene(objectCount, rayCount);
+
+    struct Builder {
+        const char* name;
+        BVHSplitMethod splitMethod;
+        bool isOptimizingTreelets;
+    };
+    const Builder builders[] = {
+        { "Median", BVHSplitMethod::Median, false },
+        { "SAH", BVHSplitMethod::SAH, false },
+        { "LBVH", BVHSplitMethod::LBVH, false },
+        { "LBVH + treelets", BVHSplitMethod::LBVH, true }
+    };
+
+    for (const Builder& builder : builders) {
+        BVHBuildOptions options;
+        options.splitMethod = builder.splitMethod;
+        options.isOptimizingTreelets = builder.isOptimizingTreelets;
+        BVHNode tree(scene.spheres, options);
+
+        int hitCount = 0;
+        double traceSeconds = traceBVHBenchmarkRays(tree, scene.rays, hitCount);
+
+        std::clog << builder.name << ": built in " << tree.getBuildSeconds() * 1000 << " ms, SAH cost " << tree.getSAHCost()
+            << ", " << traceSeconds * 1e9 / rayCount << " ns per ray, " << hitCount << " hits\n";
+    }
+}
+
+void benchmarkBVHLayouts(int objectCount, int rayCount) {
+    // The same SAH tree in every node layout: memory against trace time, for scenes whose tree no
+    // longer fits in the caches.
+    BVHBenchmarkScene scene = getBVHBenchmarkScene(objectCount, rayCount);
+
+    auto tree = std::make_shared<BVHNode>(scene.spheres);
+    auto linearTree = std::make_shared<LinearBVH>(*tree);
+    auto wideTree = std::make_shared<BVH4>(*tree);
+    auto quantizedTree = std::make_shared<QuantizedBVH>(*tree);
+
+    struct Layout {
+        const char* name;
+        std::shared_ptr<Hittable> structure;
+        size_t nodeCount;
+        size_t nodeSize;
+        size_t memoryUsage;
+    };
+    const Layout layouts[] = {
+        { "BVHNode", tree, tree->getTreeStatistics().nodeCount, sizeof(BVHNode), tree->getMemoryUsage() },
+        { "LinearBVH", linearTree, linearTree->getNodeCount(), sizeof(LinearBVHNode), linearTree->getMemoryUsage() },
+        { "BVH4", wideTree, wideTree->getNodeCount(), sizeof(WideBVHNode<4>), wideTree->getMemoryUsage() },
+        { "QuantizedBVH", quantizedTree, quantizedTree->getNodeCount(), sizeof(QuantizedBVHNode), quantizedTree->getMemoryUsage() }
+    };
+
+    for (const Layout& layout : layouts) {
+        int hitCount = 0;
+        double traceSeconds = traceBVHBenchmarkRays(*layout.structure, scene.rays, hitCount);
+
+        size_t nodeBytes = layout.nodeCount * layout.nodeSize;
+        std::clog << layout.name << ": " << layout.nodeCount << " nodes of " << layout.nodeSize << " bytes, "
+            << nodeBytes / (1024.0 * 1024.0) << " MiB of nodes, " << layout.memoryUsage / (1024.0 * 1024.0) << " MiB in all ("
+            << static_cast<double>(layout.memoryUsage) / objectCount << " bytes per object), "
+            << traceSeconds * 1e9 / rayCount << " ns per ray, " << hitCount << " hits\n";
+    }
+}
+
+void checkShadowQueries(int objectCount, int segmentCount) {
+    // Random segments through mixed primitives, asked with isHit and isOccluded of every structure:
+    // counts where a structure's answers disagree with each other or with the flat list's closest
+    // hits, and compares the time of the two queries.
+    HittableList objects;
+    auto white = std::make_shared<Lambertian>(Color(.73, .73, .73));
+    double extent = 165 * std::cbrt(objectCount / 1000.0);
+    for (int j = 0; j < objectCount; j++) {
+        Point3 position = Point3::getRandomVector(0, extent);
+        if (j % 3 == 0)
+            objects.add(std::make_shared<Quad>(position, Vec3(15, 0, 0), Vec3(0, 0, 4), white));
+        else if (j % 3 == 1)
+            objects.add(std::make_shared<Translate>(std::make_shared<RotateY>(std::make_shared<Sphere>(Point3(0, 0, 0), 8, white), 30), position));
+        else
+            objects.add(std::make_shared<Sphere>(position, 10, white));
+    }
+
+    // segments from origin to origin + direction, as shadow rays are cast
+    std::vector<Ray> segments;
+    for (int j = 0; j < segmentCount; j++) {
+        Point3 origin = Point3::getRandomVector(-0.5 * extent, 1.5 * extent);
+        segments.emplace_back(origin, Point3::getRandomVector(-0.5 * extent, 1.5 * extent) - origin);
+    }
+    const Interval segmentInterval(0.001, 0.999);
+
+    BVHNode tree(objects);
+    struct Structure {
+        const char* name;
+        std::shared_ptr<Hittable> structure;
+    };
+    const Structure structures[] = {
+        { "HittableList", std::make_shared<HittableList>(objects) },
+        { "BVHNode", std::make_shared<BVHNode>(tree) },
+        { "LinearBVH", std::make_shared<LinearBVH>(tree) },
+        { "BVH4", std::make_shared<BVH4>(tree) },
+        { "BVH8", std::make_shared<BVH8>(tree) },
+        { "QuantizedBVH", std::make_shared<QuantizedBVH>(tree) },
+        { "MotionBVH", std::make_shared<MotionBVH>(objects) }
+    };
+
+    std::vector<double> listHitTimes;
+    for (const Structure& structure : structures) {
+        std::vector<double> hitTimes(segments.size(), -1);
+        auto hitStartTime = std::chrono::steady_clock::now();
+        for (size_t currentSegment = 0; currentSegment < segments.size(); ++currentSegment) {
+            HitRecord record;
+            if (structure.structure->isHit(segments[currentSegment], segmentInterval, record))
+                hitTimes[currentSegment] = record.hitTime;
+        }
+        double hitSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - hitStartTime).count();
+
+        std::vector<char> isOccluded(segments.size());
+        auto occlusionStartTime = std::chrono::steady_clock::now();
+        for (size_t currentSegment = 0; currentSegment < segments.size(); ++currentSegment)
+            isOccluded[currentSegment] = structure.structure->isOccluded(segments[currentSegment], segmentInterval);
+        double occlusionSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - occlusionStartTime).count();
+
+        if (listHitTimes.empty())
+            listHitTimes = hitTimes;
+        int occludedCount = 0, queryMismatches = 0, listMismatches = 0;
+        for (size_t currentSegment = 0; currentSegment < segments.size(); ++currentSegment) {
+            occludedCount += isOccluded[currentSegment];
+            queryMismatches += (isOccluded[currentSegment] != 0) != (hitTimes[currentSegment] >= 0);
+            listMismatches += hitTimes[currentSegment] != listHitTimes[currentSegment];
+        }
+
+        std::clog << structure.name << ": " << occludedCount << " of " << segmentCount << " segments occluded, isHit "
+            << hitSeconds * 1e9 / segmentCount << " ns, isOccluded " << occlusionSeconds * 1e9 / segmentCount << " ns ("
+            << hitSeconds / occlusionSeconds << "x), " << queryMismatches << " isHit/isOccluded mismatches, "
+            << listMismatches << " closest hits unlike the list's\n";
+    }
+}
+
+
+
+void measureFinalSceneBuilders(int rayCount) {
+    // SAH cost and closest-hit time of the final scene's floor and sphere cluster, built with the
+    // Median and the SAH builder. The rays run from the final scene's camera to random points in each box.
+    struct Geometry {
+        const char* name;
+        HittableList objects;
+    };
+    const Geometry geometries[] = {
+        { "Floor", getFinalSceneFloor() },
+        { "Sphere cluster", getFinalSceneSphereCluster() }
+    };
+
+    for (const Geometry& geometry : geometries) {
+        AABB box = geometry.objects.getBoundingBox();
+        std::vector<Ray> rays;
+        Point3 origin(478, 278, -600);
+        for (int j = 0; j < rayCount; j++) {
+            Point3 target(getRandomDouble(box.intervalX.min, box.intervalX.max), getRandomDouble(box.intervalY.min, box.intervalY.max),
+                getRandomDouble(box.intervalZ.min, box.intervalZ.max));
+            rays.emplace_back(origin, target - origin);
+        }
+
+        for (BVHSplitMethod splitMethod : { BVHSplitMethod::Median, BVHSplitMethod::SAH }) {
+            BVHBuildOptions options;
+            options.splitMethod = splitMethod;
+            BVHNode tree(geometry.objects, options);
+
+            int hitCount = 0;
+            double traceSeconds = traceBVHBenchmarkRays(tree, rays, hitCount);
+            std::clog << geometry.name << ", " << (splitMethod == BVHSplitMethod::SAH ? "SAH" : "Median") << ": SAH cost " << tree.getSAHCost()
+                << ", " << traceSeconds * 1e9 / rayCount << " ns per ray, " << hitCount << " hits\n";
+        }
+    }
+}
+
+
+
+int main(int argc, char** argv) {
+    // raytracer [--coordinator <address> | --worker <address>]
+    // with an address like unix:/tmp/raytracer.sock or 127.0.0.1:5555
+    for (int currentArgument = 1; currentArgument < argc; ++currentArgument) {
+        bool isCoordinator = std::strcmp(argv[currentArgument], "--coordinator") == 0;
+        bool isWorker = std::strcmp(argv[currentArgument], "--worker") == 0;
+        if ((!isCoordinator && !isWorker) || currentArgument + 1 >= argc) {
+            std::cerr << "Usage: " << argv[0] << " [--coordinator <address> | --worker <address>]\n";
+            return 1;
+        }
+        commandLineRole = isCoordinator ? RenderRole::Coordinator : RenderRole::Worker;
+        commandLineAddress = argv[++currentArgument];
+    }
+
     //renderBouncingSpheres();
     //renderCheckeredSpheres();
     //renderEarth();
@@ -413,7 +866,16 @@ int main() {
     //renderSimpleLight();
     //renderCornellBox();
     //renderCornellSmoke();
+    //renderAnimatedSpheres(24);
     renderFinalScene(800, 10000, 40);   
+    //benchmarkBVHBuilders(100000, 100000);
+    //benchmarkBVHLayouts(1000000, 100000);
+    //checkShadowQueries(1000, 200000);
+    //measureLightSampling(64, 64, 16384, false);
+    //measureLightSampling(64, 64, 16384, true);
+    //measureDenoising(64, 16, 2048);
+    //measureSamplers(64, 64, 2048, 4);
+    //measureFinalSceneBuilders(1000000);
     //renderFinalScene(400, 250, 4);
 
     return 0;